@@ -0,0 +1,394 @@
+// throughput benchmark for decode_audio: generates a fixture corpus with ffmpeg's lavfi sources and prints JSON results
+// make bench_decode_audio && ./bench_decode_audio --corpus bench_corpus --output bench.json
+
+#define DECODE_AUDIO_NO_MAIN
+#include "decode_audio_ffmpeg.c"
+
+#include <sys/resource.h>
+
+struct bench_codec {const char* name; const char* ext; const char* args; int max_channels;} bench_codecs[] =
+{
+	{ "wav_s16", "wav" , "-c:a pcm_s16le"           , 6 },
+	{ "wav_f32", "wav" , "-c:a pcm_f32le"           , 6 },
+	{ "flac"   , "flac", "-c:a flac"                , 6 },
+	{ "mp3"    , "mp3" , "-c:a libmp3lame -b:a 192k", 2 },
+	{ "opus"   , "opus", "-c:a libopus -b:a 128k -mapping_family 1", 6 },
+	{ "aac"    , "m4a" , "-c:a aac -b:a 192k"       , 6 },
+};
+
+static const char* bench_layouts[] = { NULL, "mono", "stereo", NULL, NULL, NULL, "5.1" };
+
+enum { MODE_FILE, MODE_BUFFER, MODE_F32, MODE_RESAMPLE, MODE_BATCH, MODE_SEGMENTS, MODE_PIPELINE, MODE_LOGMEL, MODE_PUSH, MODE_OPEN, NUM_MODES };
+static const char* mode_names[NUM_MODES] = { "file", "buffer", "f32", "resample16k", "batch", "segments", "pipeline", "logmel16k", "push", "open" };
+
+struct bench_fixture
+{
+	char path[1024];
+	char name[64];
+	const char* codec;
+	int num_channels;
+	int duration;
+	uint8_t* buf;
+	int64_t size;
+};
+
+struct bench_config
+{
+	struct bench_fixture* fixture;
+	int mode;
+	int num_threads;
+	int batch_size;
+	double* latency_us;
+	uint64_t num_samples;
+	uint64_t num_errors;
+	char error[128];
+	struct DecodeAudioStats stats;
+	struct DecodeAudioAllocator* allocator;
+};
+
+struct counting_allocator
+{
+	uint64_t num_allocs;
+	uint64_t alloc_bytes;
+};
+
+static void* counting_alloc(void* ctx, size_t size)
+{
+	struct counting_allocator* counter = (struct counting_allocator*)ctx;
+	__atomic_fetch_add(&counter->num_allocs, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&counter->alloc_bytes, size, __ATOMIC_RELAXED);
+	return malloc(size);
+}
+
+static void counting_free(void* ctx, void* ptr)
+{
+	free(ptr);
+}
+
+static int parse_list(const char* str, int* values, int max_values)
+{
+	int count = 0;
+	for(const char* p = str; *p && count < max_values; p++)
+	{
+		values[count++] = atoi(p);
+		while(*p && *p != ',')
+			p++;
+		if(!*p)
+			break;
+	}
+	return count;
+}
+
+static bool generate_fixture(const char* ffmpeg, struct bench_fixture* fixture, struct bench_codec* codec)
+{
+	// deterministic content: one tone per channel plus seeded noise, so that lossless codecs do not degenerate
+	struct stat st;
+	if(stat(fixture->path, &st) == 0 && st.st_size > 0)
+		return true;
+
+	char exprs[512] = "";
+	for(int c = 0; c < fixture->num_channels; c++)
+		snprintf(exprs + strlen(exprs), sizeof(exprs) - strlen(exprs), "%s0.4*sin(2*PI*%d*t)+0.05*(random(%d)-0.5)", c > 0 ? "|" : "", 220 + 110 * c, c);
+
+	char cmd[4096];
+	snprintf(cmd, sizeof(cmd), "%s -nostdin -hide_banner -loglevel error -y -f lavfi -i \"aevalsrc=exprs='%s':sample_rate=48000:duration=%d:channel_layout=%s\" %s -fflags +bitexact -flags:a +bitexact %s", ffmpeg, exprs, fixture->duration, bench_layouts[fixture->num_channels], codec->args, fixture->path);
+	if(system(cmd) != 0)
+	{
+		fprintf(stderr, "bench_decode_audio: skipping %s, cannot generate it with [%s]\n", fixture->name, cmd);
+		unlink(fixture->path);
+		return false;
+	}
+	return true;
+}
+
+static bool load_fixture(struct bench_fixture* fixture)
+{
+	FILE* f = fopen(fixture->path, "rb");
+	if(!f)
+		return false;
+	fseek(f, 0, SEEK_END);
+	fixture->size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	fixture->buf = malloc(fixture->size);
+	bool ok = fixture->buf && fread(fixture->buf, 1, fixture->size, f) == (size_t)fixture->size;
+	fclose(f);
+	return ok;
+}
+
+static void reset_peak_rss()
+{
+	// since Linux 4.0 writing 5 to clear_refs resets VmHWM, otherwise the peak is process-wide
+	FILE* f = fopen("/proc/self/clear_refs", "w");
+	if(f)
+	{
+		fputs("5", f);
+		fclose(f);
+	}
+}
+
+static int64_t peak_rss_kb()
+{
+	FILE* f = fopen("/proc/self/status", "r");
+	char line[256];
+	int64_t kb = -1;
+	while(f && fgets(line, sizeof(line), f))
+		if(sscanf(line, "VmHWM: %" SCNd64, &kb) == 1)
+			break;
+	if(f)
+		fclose(f);
+	if(kb < 0)
+	{
+		struct rusage usage;
+		getrusage(RUSAGE_SELF, &usage);
+		kb = usage.ru_maxrss;
+	}
+	return kb;
+}
+
+static void release(struct DecodeAudio* audio)
+{
+	if(audio->data.deleter)
+		audio->data.deleter(&audio->data);
+}
+
+static struct DecodeAudio bench_push(struct bench_fixture* fixture, struct DecodeAudio output_options, double* latency_us)
+{
+	// loopback replay of the file in network-sized chunks; latency is from feeding the last byte of a chunk until the PCM it completes can be drained,
+	// averaged over the chunks that complete any (the rest only fill a partial packet)
+	struct DecodeAudio audio = { 0 };
+	struct DecodeAudioPush* push = decode_audio_push_create(output_options, NULL, 0, 0, audio.error, false);
+	if(!push)
+		return audio;
+
+	static __thread uint8_t pcm[1 << 20];
+	uint64_t fed = 0, num_samples = 0, chunk_size = 1024;
+	int64_t n = 0;
+	double sum_us = 0;
+	int num_latencies = 0;
+	while (n >= 0)
+	{
+		if(fed < fixture->size)
+			fed += decode_audio_push_feed(push, fixture->buf + fed, FFMIN(chunk_size, fixture->size - fed));
+		else
+			decode_audio_push_finish(push);
+		uint64_t tic = clock_ns(CLOCK_MONOTONIC);
+		bool first = true;
+		// waits until the worker has consumed everything fed so far, draining as PCM appears
+		for(;;)
+		{
+			n = decode_audio_push_drain(push, pcm, sizeof(pcm) / 64);
+			if(n > 0)
+			{
+				if(first)
+					sum_us += (clock_ns(CLOCK_MONOTONIC) - tic) / 1000.0, num_latencies++;
+				first = false;
+				num_samples += n;
+				continue;
+			}
+			int state = n < 0 ? DECODE_AUDIO_PUSH_DONE : decode_audio_push_poll(push, NULL);
+			if(state != DECODE_AUDIO_PUSH_OPENING && state != DECODE_AUDIO_PUSH_DECODING)
+				break;
+			sched_yield();
+		}
+	}
+	*latency_us = num_latencies > 0 ? sum_us / num_latencies : 0;
+
+	decode_audio_push_poll(push, &audio);
+	audio.num_samples = num_samples;
+	decode_audio_push_destroy(push);
+	return audio;
+}
+
+static void bench_decode(void* opaque, int i)
+{
+	struct bench_config* config = (struct bench_config*)opaque;
+	struct bench_fixture* fixture = config->fixture;
+	struct DecodeAudio input_options = { 0 }, output_options = { 0 }, audio;
+	output_options.allocator = config->allocator;
+	int64_t size = fixture->size;
+
+	uint64_t tic = clock_ns(CLOCK_MONOTONIC);
+	if(config->mode == MODE_BATCH)
+	{
+		const char* paths[config->batch_size];
+		uint64_t num_samples[config->batch_size];
+		for(int b = 0; b < config->batch_size; b++)
+			paths[b] = fixture->path;
+		audio = decode_audio_batch(config->batch_size, paths, NULL, output_options, NULL, num_samples, config->num_threads, false);
+	}
+	else
+	{
+		if(config->mode == MODE_BUFFER)
+		{
+			input_options.data.dl_tensor.data = fixture->buf;
+			input_options.data.dl_tensor.ndim = 1;
+			input_options.data.dl_tensor.shape = &size;
+			input_options.data.dl_tensor.dtype.lanes = 1;
+			input_options.data.dl_tensor.dtype.bits = 8;
+			input_options.data.dl_tensor.dtype.code = kDLUInt;
+		}
+		if(config->mode == MODE_F32)
+			strcpy(output_options.fmt, "f32le");
+		if(config->mode == MODE_RESAMPLE)
+			output_options.sample_rate = 16000;
+		if(config->mode == MODE_SEGMENTS)
+			output_options.num_segments = config->num_threads;
+		if(config->mode == MODE_PIPELINE)
+			output_options.pipeline = 1;
+		if(config->mode == MODE_LOGMEL)
+		{
+			// 80 mel bins over 25 ms / 10 ms windows, the Python benchmark runs the same through torchaudio
+			output_options.sample_rate = 16000;
+			output_options.n_mels = 80;
+			output_options.n_fft = 400;
+			output_options.hop_length = 160;
+		}
+		// open is header-only: container detection, demuxer open and stream discovery, per format as every fixture is one codec
+		if(config->mode != MODE_PUSH)
+			audio = decode_audio(config->mode == MODE_BUFFER ? NULL : fixture->path, input_options, output_options, NULL, config->mode == MODE_OPEN, false);
+	}
+	config->latency_us[i] = (clock_ns(CLOCK_MONOTONIC) - tic) / 1000.0;
+	if(config->mode == MODE_PUSH)
+		audio = bench_push(fixture, output_options, &config->latency_us[i]);
+
+	uint64_t num_samples = config->mode == MODE_BATCH ? audio.stats.num_decodes * audio.num_samples : audio.num_samples;
+	__atomic_fetch_add(&config->num_samples, num_samples, __ATOMIC_RELAXED);
+	add_stats(&config->stats, &audio.stats, true);
+	if(audio.error[0] && __atomic_fetch_add(&config->num_errors, 1, __ATOMIC_RELAXED) == 0)
+		strcpy(config->error, audio.error);
+	release(&audio);
+	free(audio.data.dl_tensor.shape);
+	free(audio.data.dl_tensor.strides);
+}
+
+static int compare_double(const void* a, const void* b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+static double percentile(const double* sorted, int count, double p)
+{
+	// nearest rank
+	int k = (int)ceil(p / 100.0 * count) - 1;
+	return sorted[FFMAX(0, FFMIN(k, count - 1))];
+}
+
+int main(int argc, char **argv)
+{
+	const char* corpus = "bench_corpus", *ffmpeg = "ffmpeg", *output_path = NULL;
+	int durations[16] = { 1, 10, 60 }, num_durations = 3;
+	int thread_counts[16] = { 1, 2, 4, (int)sysconf(_SC_NPROCESSORS_ONLN) }, num_thread_counts = 4;
+	int channel_counts[16] = { 1, 2, 6 }, num_channel_counts = 3;
+	int iterations = 20;
+	bool modes[NUM_MODES] = { true, true, true, true, true, true, true, true, true, true };
+
+	for(int i = 1; i < argc; i++)
+	{
+		const char* value = i + 1 < argc ? argv[i + 1] : "";
+		if(strcmp(argv[i], "--corpus") == 0)
+			corpus = value, i++;
+		else if(strcmp(argv[i], "--ffmpeg") == 0)
+			ffmpeg = value, i++;
+		else if(strcmp(argv[i], "--output") == 0)
+			output_path = value, i++;
+		else if(strcmp(argv[i], "--durations") == 0)
+			num_durations = parse_list(value, durations, 16), i++;
+		else if(strcmp(argv[i], "--threads") == 0)
+			num_thread_counts = parse_list(value, thread_counts, 16), i++;
+		else if(strcmp(argv[i], "--channels") == 0)
+			num_channel_counts = parse_list(value, channel_counts, 16), i++;
+		else if(strcmp(argv[i], "--iterations") == 0)
+			iterations = atoi(value), i++;
+		else if(strcmp(argv[i], "--modes") == 0)
+		{
+			for(int m = 0; m < NUM_MODES; m++)
+				modes[m] = strstr(value, mode_names[m]) != NULL;
+			i++;
+		}
+		else
+		{
+			printf("Usage: %s [--corpus DIR] [--ffmpeg PATH] [--output JSON] [--durations 1,10,60,600,3600] [--channels 1,2,6] [--threads 1,2,4] [--iterations 20] [--modes file,buffer,f32,resample16k,batch,segments,pipeline,logmel16k,push,open]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	mkdir(corpus, 0755);
+	FILE* out = output_path ? fopen(output_path, "w") : stdout;
+	if(!out)
+	{
+		fprintf(stderr, "bench_decode_audio: cannot open %s\n", output_path);
+		return 1;
+	}
+
+	struct counting_allocator counter = { 0 };
+	struct DecodeAudioAllocator allocator = { counting_alloc, counting_free, &counter };
+
+	fprintf(out, "{\n\"ffmpeg_version\": \"%s\",\n\"num_cpus\": %ld,\n\"iterations\": %d,\n\"results\": [\n", av_version_info(), sysconf(_SC_NPROCESSORS_ONLN), iterations);
+	bool first = true;
+	for(int k = 0; k < FF_ARRAY_ELEMS(bench_codecs); k++)
+	for(int c = 0; c < num_channel_counts; c++)
+	for(int d = 0; d < num_durations; d++)
+	{
+		struct bench_codec* codec = &bench_codecs[k];
+		struct bench_fixture fixture = { .codec = codec->name, .num_channels = channel_counts[c], .duration = durations[d] };
+		if(fixture.num_channels > codec->max_channels || fixture.num_channels >= FF_ARRAY_ELEMS(bench_layouts) || !bench_layouts[fixture.num_channels])
+			continue;
+		snprintf(fixture.name, sizeof(fixture.name), "%s_%dch_%ds", codec->name, fixture.num_channels, fixture.duration);
+		snprintf(fixture.path, sizeof(fixture.path), "%s/%s.%s", corpus, fixture.name, codec->ext);
+		if(!generate_fixture(ffmpeg, &fixture, codec) || !load_fixture(&fixture))
+		{
+			free(fixture.buf);
+			continue;
+		}
+
+		for(int m = 0; m < NUM_MODES; m++)
+		for(int t = 0; t < num_thread_counts; t++)
+		{
+			if(!modes[m])
+				continue;
+			// long fixtures get fewer decodes, every configuration still covers about ten minutes of audio or one decode per thread
+			int num_threads = FFMAX(1, thread_counts[t]);
+			int num_decodes = FFMAX(num_threads, FFMIN(iterations, 600 / fixture.duration));
+			struct bench_config config = { &fixture, m, num_threads, FFMAX(8, num_threads) };
+			config.latency_us = calloc(num_decodes, sizeof(double));
+			config.allocator = &allocator;
+
+			// untimed warm-up: page cache, decoder tables, kernel selection
+			bench_decode(&config, 0);
+			memset(&config.stats, 0, sizeof(config.stats));
+			config.num_samples = config.num_errors = 0;
+			counter.num_allocs = counter.alloc_bytes = 0;
+			reset_peak_rss();
+
+			uint64_t tic = clock_ns(CLOCK_MONOTONIC);
+			// batch and segments modes spend the threads inside one decode call
+			if(m == MODE_BATCH || m == MODE_SEGMENTS)
+				for(int i = 0; i < num_decodes; i++)
+					bench_decode(&config, i);
+			else
+				parallel_for(num_decodes, num_threads, bench_decode, &config);
+			double wall_sec = (clock_ns(CLOCK_MONOTONIC) - tic) / 1e9;
+
+			qsort(config.latency_us, num_decodes, sizeof(double), compare_double);
+			double mean_us = 0;
+			for(int i = 0; i < num_decodes; i++)
+				mean_us += config.latency_us[i] / num_decodes;
+
+			fprintf(out, "%s{\"fixture\": \"%s\", \"codec\": \"%s\", \"num_channels\": %d, \"duration\": %d, \"file_size\": %" PRId64 ", \"mode\": \"%s\", \"num_threads\": %d, \"batch_size\": %d, \"num_decodes\": %d, ",
+				first ? "" : ",\n", fixture.name, fixture.codec, fixture.num_channels, fixture.duration, fixture.size, mode_names[m], num_threads, m == MODE_BATCH ? config.batch_size : 1, num_decodes);
+			fprintf(out, "\"latency_us\": {\"mean\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f}, ",
+				mean_us, percentile(config.latency_us, num_decodes, 50), percentile(config.latency_us, num_decodes, 90), percentile(config.latency_us, num_decodes, 99), config.latency_us[num_decodes - 1]);
+			fprintf(out, "\"wall_sec\": %.6f, \"samples_per_sec\": %.1f, \"peak_rss_kb\": %" PRId64 ", \"num_allocs\": %" PRIu64 ", \"output_alloc_bytes\": %" PRIu64 ", \"alloc_bytes\": %" PRIu64 ", \"num_errors\": %" PRIu64 ", \"error\": \"%s\"}",
+				wall_sec, config.num_samples / wall_sec, peak_rss_kb(), counter.num_allocs, counter.alloc_bytes, config.stats.alloc_bytes, config.num_errors, config.error);
+			fflush(out);
+			first = false;
+			free(config.latency_us);
+		}
+		free(fixture.buf);
+	}
+	fprintf(out, "\n]\n}\n");
+	if(out != stdout)
+		fclose(out);
+	return 0;
+}
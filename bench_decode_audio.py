@@ -0,0 +1,151 @@
+# compares decode_audio against scipy / soundfile on the corpus generated by bench_decode_audio, and diffs two result files to catch regressions
+# python3 bench_decode_audio.py run --corpus bench_corpus --output bench_python.json
+# python3 bench_decode_audio.py compare bench_baseline.json bench.json --threshold 0.1
+
+import os
+import re
+import sys
+import json
+import math
+import time
+import argparse
+
+def peak_rss_kb():
+	for line in open('/proc/self/status'):
+		if line.startswith('VmHWM:'):
+			return int(line.split()[1])
+	import resource
+	return resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+
+def reset_peak_rss():
+	try:
+		with open('/proc/self/clear_refs', 'w') as f:
+			f.write('5')
+	except OSError:
+		pass
+
+def percentile(sorted_values, p):
+	# nearest rank, same as the C benchmark
+	k = math.ceil(p / 100 * len(sorted_values)) - 1
+	return sorted_values[max(0, min(k, len(sorted_values) - 1))]
+
+def decoders():
+	import ctypes
+	from decode_audio import DecodeAudio
+	decode_audio = DecodeAudio()
+	def decode(path):
+		audio = decode_audio(path)
+		if audio.data.deleter:
+			audio.data.deleter(ctypes.byref(audio.data))
+		return audio.num_samples
+	yield 'decode_audio', decode
+
+	def decode_log_mel(path):
+		audio = decode_audio(path, sample_rate = 16000, features = dict(n_mels = 80, n_fft = 400, hop_length = 160))
+		if audio.data.deleter:
+			audio.data.deleter(ctypes.byref(audio.data))
+		return audio.num_samples
+	yield 'decode_audio_logmel16k', decode_log_mel
+
+	try:
+		import numpy
+		import torch
+		import torchaudio
+		# the unfused path: decode to a waveform tensor, then STFT and mel projection in torch, same options and log as the fused one
+		mel_spectrogram = torchaudio.transforms.MelSpectrogram(sample_rate = 16000, n_fft = 400, hop_length = 160, n_mels = 80)
+		def decode_torch_log_mel(path):
+			audio = decode_audio(path, sample_rate = 16000, fmt = 'f32le')
+			waveform = torch.from_numpy(numpy.asarray(audio.data.dl_tensor)).mean(dim = 1)
+			log_mel = (mel_spectrogram(waveform) + 1e-6).log()
+			if audio.data.deleter:
+				audio.data.deleter(ctypes.byref(audio.data))
+			return audio.num_samples
+		yield 'torchaudio_logmel16k', decode_torch_log_mel
+	except ImportError:
+		print('torchaudio is not installed, skipping', file = sys.stderr)
+
+	try:
+		import scipy.io.wavfile
+		yield 'scipy', lambda path: len(scipy.io.wavfile.read(path, mmap = False)[1]) if path.endswith('.wav') else None
+	except ImportError:
+		print('scipy is not installed, skipping', file = sys.stderr)
+
+	try:
+		import soundfile
+		# libsndfile decodes WAV, FLAC and, since 1.1, MP3 / Opus in Ogg; everything else fails and is reported as an error
+		yield 'soundfile', lambda path: len(soundfile.read(path, always_2d = True)[0])
+	except ImportError:
+		print('soundfile is not installed, skipping', file = sys.stderr)
+
+def run(args):
+	results = []
+	fixtures = sorted(f for f in os.listdir(args.corpus) if re.match(r'.+_\d+ch_\d+s\..+', f))
+	for name, decode in decoders():
+		for file_name in fixtures:
+			path = os.path.join(args.corpus, file_name)
+			codec, num_channels, duration = re.match(r'(.+)_(\d+)ch_(\d+)s\.', file_name).groups()
+			num_decodes = max(1, min(args.iterations, 600 // int(duration)))
+			result = dict(fixture = file_name.split('.')[0], codec = codec, num_channels = int(num_channels), duration = int(duration), file_size = os.path.getsize(path), mode = name, num_threads = 1, batch_size = 1, num_decodes = num_decodes, num_errors = 0, error = '')
+
+			try:
+				if decode(path) is None:
+					continue
+			except Exception as e:
+				result.update(num_errors = 1, error = str(e)[:127])
+				results.append(result)
+				continue
+
+			reset_peak_rss()
+			latency_us, num_samples = [], 0
+			tic = time.perf_counter()
+			for i in range(num_decodes):
+				t = time.perf_counter()
+				num_samples += decode(path)
+				latency_us.append((time.perf_counter() - t) * 1e6)
+			wall_sec = time.perf_counter() - tic
+			latency_us.sort()
+
+			result.update(latency_us = dict(mean = sum(latency_us) / num_decodes, p50 = percentile(latency_us, 50), p90 = percentile(latency_us, 90), p99 = percentile(latency_us, 99), max = latency_us[-1]), wall_sec = wall_sec, samples_per_sec = num_samples / wall_sec, peak_rss_kb = peak_rss_kb())
+			results.append(result)
+			print(name, file_name, round(result['latency_us']['p50'], 1), 'microsec p50', file = sys.stderr)
+
+	report = dict(python_version = sys.version.split()[0], num_cpus = os.cpu_count(), iterations = args.iterations, results = results)
+	json.dump(report, open(args.output, 'w') if args.output else sys.stdout, indent = 1)
+
+def compare(args):
+	# results are matched by fixture, mode and thread count; a slower p50 or a lower throughput beyond the threshold is a regression
+	key = lambda r: (r['fixture'], r['mode'], r['num_threads'])
+	baseline = {key(r) : r for r in json.load(open(args.baseline))['results'] if not r['num_errors']}
+	current = {key(r) : r for r in json.load(open(args.current))['results'] if not r['num_errors']}
+
+	regressions = 0
+	for k in sorted(baseline.keys() & current.keys()):
+		b, c = baseline[k], current[k]
+		p50 = c['latency_us']['p50'] / b['latency_us']['p50'] - 1
+		throughput = c['samples_per_sec'] / b['samples_per_sec'] - 1
+		regressed = p50 > args.threshold or throughput < -args.threshold
+		regressions += regressed
+		if regressed or args.verbose:
+			print('{:<32} {:<12} {:>3} threads  p50 {:+7.1%}  samples/sec {:+7.1%}{}'.format(*k, p50, throughput, '  REGRESSION' if regressed else ''))
+
+	for k in sorted(baseline.keys() - current.keys()):
+		print('{:<32} {:<12} {:>3} threads  missing in {}'.format(*k, args.current))
+	print(regressions, 'regressions out of', len(baseline.keys() & current.keys()), 'configurations')
+	sys.exit(1 if regressions else 0)
+
+if __name__ == '__main__':
+	parser = argparse.ArgumentParser()
+	subparsers = parser.add_subparsers(dest = 'command', required = True)
+	parser_run = subparsers.add_parser('run')
+	parser_run.add_argument('--corpus', default = 'bench_corpus')
+	parser_run.add_argument('--output', '-o')
+	parser_run.add_argument('--iterations', type = int, default = 20)
+	parser_run.set_defaults(func = run)
+	parser_compare = subparsers.add_parser('compare')
+	parser_compare.add_argument('baseline')
+	parser_compare.add_argument('current')
+	parser_compare.add_argument('--threshold', type = float, default = 0.1)
+	parser_compare.add_argument('--verbose', action = 'store_true')
+	parser_compare.set_defaults(func = compare)
+	args = parser.parse_args()
+	args.func(args)
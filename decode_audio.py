@@ -13,6 +13,9 @@
 import os
 import sys
 import ctypes
+import asyncio
+import threading
+import concurrent.futures
 
 class DLDeviceType(ctypes.c_int):
 	kDLCPU = 1
@@ -106,6 +109,35 @@ PyCapsule_GetPointer = ctypes.pythonapi.PyCapsule_GetPointer
 PyCapsule_GetPointer.restype = ctypes.c_void_p
 PyCapsule_GetPointer.argtypes = (ctypes.py_object, ctypes.c_char_p)
 
+class DecodeAudioAllocator(ctypes.Structure):
+	# output tensors are allocated by alloc(ctx, size) and released by free(ctx, ptr); Python callbacks take the GIL, the object must outlive the tensors
+	alloc_type = ctypes.CFUNCTYPE(ctypes.c_void_p, ctypes.c_void_p, ctypes.c_size_t)
+	free_type = ctypes.CFUNCTYPE(None, ctypes.c_void_p, ctypes.c_void_p)
+	_fields_ = [
+		('alloc', alloc_type),
+		('free', free_type),
+		('ctx', ctypes.c_void_p)
+	]
+
+class DecodeAudioStats(ctypes.Structure):
+	# nanoseconds per stage (filled with profile = True) and counters (always filled)
+	stages = ['open', 'stream_discovery', 'codec_open', 'graph_config', 'demux', 'decode', 'filter', 'copy_out']
+	_fields_ = [
+		('wall_ns', ctypes.c_uint64 * len(stages)),
+		('cpu_ns', ctypes.c_uint64 * len(stages)),
+		('num_packets', ctypes.c_uint64),
+		('num_frames', ctypes.c_uint64),
+		('bytes_in', ctypes.c_uint64),
+		('bytes_out', ctypes.c_uint64),
+		('alloc_bytes', ctypes.c_uint64),
+		('num_decodes', ctypes.c_uint64),
+		('num_errors', ctypes.c_uint64),
+		('num_cache_hits', ctypes.c_uint64)
+	]
+
+	def as_dict(self):
+		return dict(wall_ns = dict(zip(self.stages, self.wall_ns)), cpu_ns = dict(zip(self.stages, self.cpu_ns)), **{k : getattr(self, k) for k, t in self._fields_[2:]})
+
 class DecodeAudio(ctypes.Structure):
 	_fields_ = [
 		('error', ctypes.c_char * 128),
@@ -113,20 +145,157 @@ class DecodeAudio(ctypes.Structure):
 		('sample_rate', ctypes.c_ulonglong),
 		('num_channels', ctypes.c_ulonglong),
 		('num_samples', ctypes.c_ulonglong),
-		('duration', ctypes.c_double),
 		('itemsize', ctypes.c_ulonglong),
+		('duration', ctypes.c_double),
+		('offset', ctypes.c_double),
+		('io_buffer_size', ctypes.c_ulonglong),
+		('member_offset', ctypes.c_ulonglong),
+		('member_size', ctypes.c_ulonglong),
+		('channels_first', ctypes.c_int),
+		('normalize', ctypes.c_int),
+		('pad_value', ctypes.c_double),
+		('resample_filter_size', ctypes.c_int),
+		('resample_linear', ctypes.c_int),
+		('resample_cubic', ctypes.c_int),
+		('resample_soxr', ctypes.c_int),
+		('allocator', ctypes.c_void_p),
+		('cache', ctypes.c_void_p),
+		('n_mels', ctypes.c_int),
+		('n_fft', ctypes.c_int),
+		('win_length', ctypes.c_int),
+		('hop_length', ctypes.c_int),
+		('mel_slaney', ctypes.c_int),
+		('f_min', ctypes.c_double),
+		('f_max', ctypes.c_double),
+		('num_segments', ctypes.c_int),
+		('decoder_threads', ctypes.c_int),
+		('decoder_thread_type', ctypes.c_int),
+		('pipeline', ctypes.c_int),
+		('profile', ctypes.c_int),
+		('stats', DecodeAudioStats),
 		('data', DLManagedTensor)
 	]
 	
 	def __init__(self, lib_path = os.path.abspath('decode_audio_ffmpeg.so')):
-		self.lib = ctypes.CDLL(lib_path)
+		self.lib = ctypes.CDLL(lib_path, use_errno = True)
 		self.lib.decode_audio.argtypes = [ctypes.c_char_p, DecodeAudio, DecodeAudio, ctypes.c_char_p, ctypes.c_int, ctypes.c_int] 
 		self.lib.decode_audio.restype = DecodeAudio	
+		self.lib.decode_audio_batch.argtypes = [ctypes.c_int, ctypes.POINTER(ctypes.c_char_p), ctypes.POINTER(DecodeAudio), DecodeAudio, ctypes.c_char_p, ctypes.POINTER(ctypes.c_uint64), ctypes.c_int, ctypes.c_int]
+		self.lib.decode_audio_batch.restype = DecodeAudio
+		self.lib.decode_audio_session_create.argtypes = [DecodeAudio, ctypes.c_char_p, ctypes.c_int]
+		self.lib.decode_audio_session_create.restype = ctypes.c_void_p
+		self.lib.decode_audio_session_decode.argtypes = [ctypes.c_void_p, ctypes.c_char_p, DecodeAudio, ctypes.c_int]
+		self.lib.decode_audio_session_decode.restype = DecodeAudio
+		self.lib.decode_audio_session_destroy.argtypes = [ctypes.c_void_p]
+		self.lib.decode_audio_session_destroy.restype = None
+		self.lib.decode_audio_stream_open.argtypes = [ctypes.c_char_p, DecodeAudio, DecodeAudio, ctypes.c_char_p, ctypes.POINTER(DecodeAudio), ctypes.c_int]
+		self.lib.decode_audio_stream_open.restype = ctypes.c_void_p
+		self.lib.decode_audio_stream_read.argtypes = [ctypes.c_void_p, ctypes.c_uint64]
+		self.lib.decode_audio_stream_read.restype = DecodeAudio
+		self.lib.decode_audio_stream_close.argtypes = [ctypes.c_void_p]
+		self.lib.decode_audio_stream_close.restype = None
+		self.lib.decode_audio_probe.argtypes = [ctypes.c_int, ctypes.POINTER(ctypes.c_char_p), ctypes.POINTER(DecodeAudio), ctypes.c_char_p, ctypes.c_int, ctypes.c_int]
+		self.lib.decode_audio_probe.restype = ctypes.c_int
+		self.lib.decode_audio_seek_index_build.argtypes = [ctypes.c_int, ctypes.POINTER(ctypes.c_char_p), ctypes.POINTER(DecodeAudio), ctypes.c_int, ctypes.c_int]
+		self.lib.decode_audio_seek_index_build.restype = ctypes.c_int
+		self.lib.decode_audio_pool_create.argtypes = [ctypes.c_size_t]
+		self.lib.decode_audio_pool_create.restype = ctypes.c_void_p
+		self.lib.decode_audio_pool_destroy.argtypes = [ctypes.c_void_p]
+		self.lib.decode_audio_pool_destroy.restype = None
+		self.lib.decode_audio_stats_aggregate.argtypes = [ctypes.POINTER(DecodeAudioStats), ctypes.c_int]
+		self.lib.decode_audio_stats_aggregate.restype = None
+		self.lib.decode_audio_executor_create.argtypes = [ctypes.c_int]
+		self.lib.decode_audio_executor_create.restype = ctypes.c_void_p
+		self.lib.decode_audio_executor_destroy.argtypes = [ctypes.c_void_p]
+		self.lib.decode_audio_executor_destroy.restype = None
+		self.lib.decode_audio_executor_submit.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.POINTER(DecodeAudio), ctypes.POINTER(DecodeAudio), ctypes.c_char_p, ctypes.c_void_p, ctypes.c_void_p]
+		self.lib.decode_audio_executor_submit.restype = ctypes.c_int64
+		self.lib.decode_audio_executor_fd.argtypes = [ctypes.c_void_p]
+		self.lib.decode_audio_executor_fd.restype = ctypes.c_int
+		self.lib.decode_audio_executor_poll.argtypes = [ctypes.c_void_p, ctypes.POINTER(ctypes.c_int64), ctypes.c_int, ctypes.c_int]
+		self.lib.decode_audio_executor_poll.restype = ctypes.c_int
+		self.lib.decode_audio_executor_result.argtypes = [ctypes.c_void_p, ctypes.c_int64, ctypes.POINTER(DecodeAudio)]
+		self.lib.decode_audio_executor_result.restype = ctypes.c_int
+		self.lib.decode_audio_crops.argtypes = [ctypes.c_char_p, DecodeAudio, DecodeAudio, ctypes.c_char_p, ctypes.c_int, ctypes.c_uint64, ctypes.POINTER(ctypes.c_int64), ctypes.c_uint64, ctypes.POINTER(ctypes.c_int64), ctypes.POINTER(ctypes.c_uint64), ctypes.c_int]
+		self.lib.decode_audio_crops.restype = DecodeAudio
+		self.lib.decode_audio_streams.argtypes = [ctypes.c_char_p, DecodeAudio, DecodeAudio, ctypes.c_char_p, ctypes.POINTER(ctypes.c_int), ctypes.c_int, ctypes.POINTER(ctypes.c_int), ctypes.POINTER(DecodeAudio), ctypes.c_int, ctypes.c_int, ctypes.c_int]
+		self.lib.decode_audio_streams.restype = ctypes.c_int
+		self.lib.decode_audio_push_create.argtypes = [DecodeAudio, ctypes.c_char_p, ctypes.c_uint64, ctypes.c_uint64, ctypes.c_char_p, ctypes.c_int]
+		self.lib.decode_audio_push_create.restype = ctypes.c_void_p
+		self.lib.decode_audio_push_destroy.argtypes = [ctypes.c_void_p]
+		self.lib.decode_audio_push_destroy.restype = None
+		self.lib.decode_audio_push_feed.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_uint64]
+		self.lib.decode_audio_push_feed.restype = ctypes.c_uint64
+		self.lib.decode_audio_push_finish.argtypes = [ctypes.c_void_p]
+		self.lib.decode_audio_push_finish.restype = None
+		self.lib.decode_audio_push_poll.argtypes = [ctypes.c_void_p, ctypes.POINTER(DecodeAudio)]
+		self.lib.decode_audio_push_poll.restype = ctypes.c_int
+		self.lib.decode_audio_push_drain.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_uint64]
+		self.lib.decode_audio_push_drain.restype = ctypes.c_int64
+		self.lib.decode_audio_cache_create.argtypes = [ctypes.c_char_p, ctypes.c_uint64]
+		self.lib.decode_audio_cache_create.restype = ctypes.c_void_p
+		self.lib.decode_audio_cache_destroy.argtypes = [ctypes.c_void_p]
+		self.lib.decode_audio_cache_destroy.restype = None
+		self.lib.decode_audio_shard_open.argtypes = [ctypes.c_char_p, ctypes.c_char_p]
+		self.lib.decode_audio_shard_open.restype = ctypes.c_void_p
+		self.lib.decode_audio_shard_close.argtypes = [ctypes.c_void_p]
+		self.lib.decode_audio_shard_close.restype = None
+		self.lib.decode_audio_shard_num_members.argtypes = [ctypes.c_void_p]
+		self.lib.decode_audio_shard_num_members.restype = ctypes.c_int
+		self.lib.decode_audio_shard_member.argtypes = [ctypes.c_void_p, ctypes.c_int, ctypes.POINTER(ctypes.c_uint64), ctypes.POINTER(ctypes.c_uint64)]
+		self.lib.decode_audio_shard_member.restype = ctypes.c_char_p
+		self.lib.decode_audio_shard_find.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
+		self.lib.decode_audio_shard_find.restype = ctypes.c_int
+		self.lib.decode_audio_shard_decode.argtypes = [ctypes.c_void_p, ctypes.c_int, DecodeAudio, ctypes.c_char_p, ctypes.c_int, ctypes.c_int]
+		self.lib.decode_audio_shard_decode.restype = DecodeAudio
+
+	def set_resampler(self, resampler):
+		# resampler = dict(filter_size = 16, linear = True, cubic = False, soxr = False), used when resampling without filter_string
+		for k, v in (resampler or {}).items():
+			setattr(self, 'resample_' + k, int(v))
+
+	def set_threading(self, threading):
+		# threading = dict(segments = 4, decoder_threads = 2, decoder_thread_type = 'frame', pipeline = True): segments splits long seekable inputs into parallel time segments,
+		# decoder_threads / decoder_thread_type ('frame' or 'slice') configure libavcodec's own threading (-1 is one thread per core),
+		# pipeline runs demux, decode and conversion of one input on three threads
+		threading = dict(threading or {})
+		self.num_segments = threading.pop('segments', 0)
+		self.decoder_thread_type = dict(frame = 1, slice = 2).get(threading.pop('decoder_thread_type', None), 0)
+		self.decoder_threads = threading.pop('decoder_threads', 0)
+		self.pipeline = threading.pop('pipeline', False)
+		assert not threading, 'unknown threading options: ' + ', '.join(threading)
+
+	def set_features(self, features):
+		# features = dict(n_mels = 80, n_fft = 400, win_length = 400, hop_length = 160, mel_scale = 'htk', f_min = 0.0, f_max = None):
+		# the result is a [frames, n_mels] float32 log-mel tensor (log(mel + 1e-6) of the power spectrum, centered frames, mono downmix) computed while decoding;
+		# n_fft / win_length default to 25 ms and hop_length to 10 ms at the output sample rate, mel_scale 'slaney' also applies slaney area normalization
+		features = dict(features or {})
+		self.n_mels = features.pop('n_mels', 0)
+		self.n_fft = features.pop('n_fft', 0)
+		self.win_length = features.pop('win_length', 0)
+		self.hop_length = features.pop('hop_length', 0)
+		self.mel_slaney = dict(htk = 0, slaney = 1)[features.pop('mel_scale', 'htk')]
+		self.f_min = features.pop('f_min', 0.0)
+		self.f_max = features.pop('f_max', None) or 0.0
+		assert not features, 'unknown feature options: ' + ', '.join(features)
+
+	def set_allocator(self, allocator):
+		# a DecodeAudioAllocator or a DecodeAudioPool
+		if allocator is not None:
+			self.allocator = ctypes.addressof(allocator) if isinstance(allocator, DecodeAudioAllocator) else allocator.handle
+
+	def set_cache(self, cache):
+		# a DecodeAudioCache
+		if cache is not None:
+			self.cache = cache.handle
 
 	def __str__(self):
 		return f'num_samples={self.num_samples}, num_channels={self.num_channels}, sample_fmt={self.fmt.decode()}, {self.data.dl_tensor}'
 
-	def __call__(self, input_path = None,  input_buffer = None, output_buffer = None, filter_string = '', sample_rate = None, probe = False, verbose = False):
+	def __call__(self, input_path = None,  input_buffer = None, output_buffer = None, filter_string = '', sample_rate = None, fmt = None, offset = None, duration = None, io_buffer_size = None, member_offset = None, member_size = None, channels_first = False, normalize = False, resampler = None, threading = None, allocator = None, cache = None, features = None, profile = False, probe = False, verbose = False, output_tensor = None, pad_value = 0):
+		# output_tensor: a writable [T_max, C] (or [C, T_max]) array view with any strides, e.g. batch[b] of a preallocated [B, T_max, C] batch;
+		# samples are written into it directly, the tail is padded with pad_value (a raw sample value), fmt defaults to its dtype and audio.num_samples is the length
+		# normalize: clamp f32 / f64 output to [-1, 1] as it is written (no peak scaling, every chunk gets the same treatment), other formats are rejected
 		uint8 = DLDataType(lanes = 1, bits = 8, code = DLDataTypeCode.kDLUInt)
 		input_options = DecodeAudio()
 		output_options = DecodeAudio()
@@ -139,25 +308,571 @@ class DecodeAudio(ctypes.Structure):
 			input_options.data.dl_tensor.ndim = 1
 			input_options.data.dl_tensor.dtype = uint8
 
+		if offset is not None:
+			input_options.offset = offset
+
+		if duration is not None:
+			input_options.duration = duration
+
+		if io_buffer_size is not None:
+			input_options.io_buffer_size = io_buffer_size
+
+		if member_offset is not None:
+			input_options.member_offset = member_offset
+
+		if member_size is not None:
+			input_options.member_size = member_size
+
 		if output_buffer is not None:
 			output_options.data.dl_tensor.data = ctypes.cast((ctypes.c_char * len(input_buffer)).from_buffer(memoryview(output_buffer)), ctypes.c_void_p) 
 			output_options.data.dl_tensor.shape = (ctypes.c_int64 * 1)(len(output_buffer))
 			output_options.data.dl_tensor.ndim = 1
 			output_options.data.dl_tensor.dtype = uint8
 		
+		if output_tensor is not None:
+			interface = output_tensor.__array_interface__
+			typestr = interface['typestr']
+			assert interface['data'][1] is False and len(interface['shape']) == 2, 'output_tensor must be a writable 2-d array'
+			itemsize = int(typestr[2:])
+			fmt = fmt or {'u1' : 'u8', 'i2' : 's16le', 'i4' : 's32le', 'f4' : 'f32le', 'f8' : 'f64le'}[typestr[1:]]
+			strides = interface.get('strides') or (interface['shape'][1] * itemsize, itemsize)
+			output_options.data.dl_tensor.data = ctypes.c_void_p(interface['data'][0])
+			output_options.data.dl_tensor.ndim = 2
+			output_options.data.dl_tensor.shape = (ctypes.c_int64 * 2)(*interface['shape'])
+			output_options.data.dl_tensor.strides = (ctypes.c_int64 * 2)(*[stride // itemsize for stride in strides])
+			output_options.data.dl_tensor.dtype = DLDataType(lanes = 1, bits = 8 * itemsize, type_code = {'u' : DLDataTypeCode.kDLUInt, 'i' : DLDataTypeCode.kDLInt, 'f' : DLDataTypeCode.kDLFloat}[typestr[1]])
+			output_options.pad_value = pad_value
+
 		if sample_rate is not None:
 			output_options.sample_rate = sample_rate
 
+		if fmt is not None:
+			output_options.fmt = fmt.encode()
+
+		output_options.channels_first = channels_first
+		output_options.normalize = normalize
+		output_options.set_resampler(resampler)
+		output_options.set_threading(threading)
+		output_options.set_allocator(allocator)
+		output_options.set_cache(cache)
+		output_options.set_features(features)
+		output_options.profile = profile
+
 		audio = self.lib.decode_audio(input_path.encode() if input_path else None, input_options, output_options, filter_string.encode() if filter_string else None, probe, verbose)
 		if audio.error:
 			raise Exception(audio.error.decode())
+		# PCM WAV in input_buffer is returned as a view of it, the tensor (and arrays over it) keep the buffer alive
+		audio._input_buffer = input_buffer
 		return audio
 	
+	def batch(self, input_paths = None, input_buffers = None, filter_string = '', sample_rate = None, fmt = None, channels_first = False, normalize = False, resampler = None, threading = None, allocator = None, cache = None, features = None, max_samples = None, profile = False, num_threads = 0, verbose = False):
+		# one GIL-free call decoding all items, returns a padded [B, T, C] (or [B, C, T]) tensor and the per-item lengths;
+		# T is the longest item, or max_samples when given (longer items are truncated to it)
+		batch_size = len(input_paths if input_paths is not None else input_buffers)
+		uint8 = DLDataType(lanes = 1, bits = 8, type_code = DLDataTypeCode.kDLUInt)
+		output_options = DecodeAudio()
+		
+		paths = None
+		if input_paths is not None:
+			paths = (ctypes.c_char_p * batch_size)(*[input_path.encode() for input_path in input_paths])
+
+		input_options = None
+		if input_buffers is not None:
+			input_options = (DecodeAudio * batch_size)()
+			for i, input_buffer in enumerate(input_buffers):
+				input_options[i].data.dl_tensor.data = ctypes.c_void_p(input_buffer.__array_interface__['data'][0])
+				input_options[i].data.dl_tensor.shape = (ctypes.c_int64 * 1)(len(input_buffer))
+				input_options[i].data.dl_tensor.ndim = 1
+				input_options[i].data.dl_tensor.dtype = uint8
+
+		if sample_rate is not None:
+			output_options.sample_rate = sample_rate
+
+		if fmt is not None:
+			output_options.fmt = fmt.encode()
+
+		output_options.channels_first = channels_first
+		output_options.normalize = normalize
+		output_options.set_resampler(resampler)
+		output_options.set_threading(threading)
+		output_options.set_allocator(allocator)
+		output_options.set_cache(cache)
+		output_options.set_features(features)
+		output_options.profile = profile
+		if max_samples is not None:
+			output_options.num_samples = max_samples
+
+		num_samples = (ctypes.c_uint64 * batch_size)()
+		audio = self.lib.decode_audio_batch(batch_size, paths, input_options, output_options, filter_string.encode() if filter_string else None, num_samples, num_threads, verbose)
+		if audio.error:
+			raise Exception(audio.error.decode())
+		return audio, list(num_samples)
+	
+	def probe(self, input_paths, index_path = None, num_threads = 0, verbose = False):
+		# header-only metadata (sample_rate, num_channels, num_samples, duration, fmt, error) per path, no tensors;
+		# index_path names a metadata index that is consulted first and updated with newly probed files
+		batch_size = len(input_paths)
+		paths = (ctypes.c_char_p * batch_size)(*[input_path.encode() for input_path in input_paths])
+		results = (DecodeAudio * batch_size)()
+		self.lib.decode_audio_probe(batch_size, paths, results, index_path.encode() if index_path else None, num_threads, verbose)
+		return results
+
+	def build_seek_index(self, input_paths, num_threads = 0, verbose = False):
+		# one demux-only scan per file writes <path>.seekidx (packet byte offsets and first samples), later offset / crop / segment seeks in that file
+		# byte-seek through it sample-accurately; a sidecar is ignored once its file changes. Returns per-path results, error is set for files that failed
+		batch_size = len(input_paths)
+		paths = (ctypes.c_char_p * batch_size)(*[input_path.encode() for input_path in input_paths])
+		results = (DecodeAudio * batch_size)()
+		self.lib.decode_audio_seek_index_build(batch_size, paths, results, num_threads, verbose)
+		return results
+
+	def stream(self, input_path = None, input_buffer = None, chunk_size = 16000, filter_string = '', sample_rate = None, fmt = None, offset = None, duration = None, channels_first = False, resampler = None, threading = None, allocator = None, profile = False, verbose = False):
+		# yields fixed-size chunks, chunk.stats holds the counters of the stream so far, memory use is bounded by chunk_size rather than the input length
+		uint8 = DLDataType(lanes = 1, bits = 8, type_code = DLDataTypeCode.kDLUInt)
+		input_options = DecodeAudio.__new__(DecodeAudio)
+		output_options = DecodeAudio.__new__(DecodeAudio)
+		if input_buffer is not None:
+			input_options.data.dl_tensor.data = ctypes.c_void_p(input_buffer.__array_interface__['data'][0])
+			input_options.data.dl_tensor.shape = (ctypes.c_int64 * 1)(len(input_buffer))
+			input_options.data.dl_tensor.ndim = 1
+			input_options.data.dl_tensor.dtype = uint8
+		if offset is not None:
+			input_options.offset = offset
+		if duration is not None:
+			input_options.duration = duration
+		if sample_rate is not None:
+			output_options.sample_rate = sample_rate
+		if fmt is not None:
+			output_options.fmt = fmt.encode()
+		output_options.channels_first = channels_first
+		output_options.set_resampler(resampler)
+		output_options.set_threading(threading)
+		output_options.set_allocator(allocator)
+		output_options.profile = profile
+
+		audio = DecodeAudio.__new__(DecodeAudio)
+		handle = self.lib.decode_audio_stream_open(input_path.encode() if input_path else None, input_options, output_options, filter_string.encode() if filter_string else None, ctypes.byref(audio), verbose)
+		if not handle:
+			raise Exception(audio.error.decode())
+		try:
+			while True:
+				chunk = self.lib.decode_audio_stream_read(handle, chunk_size)
+				if chunk.num_samples == 0:
+					if chunk.data.deleter:
+						chunk.data.deleter(ctypes.byref(chunk.data))
+					if chunk.error:
+						raise Exception(chunk.error.decode())
+					break
+				yield chunk
+		finally:
+			self.lib.decode_audio_stream_close(handle)
+	
+	def crops(self, input_path = None, input_buffer = None, num_crops = 1, crop_samples = None, crop_duration = None, starts = None, seed = 0, filter_string = '', sample_rate = None, fmt = None, channels_first = False, resampler = None, threading = None, allocator = None, profile = False, verbose = False):
+		# num_crops windows of crop_samples (at the output sample rate) as a zero-padded [K, T, C] (or [K, C, T]) tensor, one seek per window or run of nearby windows;
+		# starts (in output samples) are given or drawn uniformly with seed, returns the tensor, the starts used and the valid length of every window
+		if crop_samples is None:
+			assert crop_duration is not None and sample_rate is not None, 'crop_duration needs an explicit sample_rate'
+			crop_samples = int(round(crop_duration * sample_rate))
+		if starts is not None:
+			num_crops = len(starts)
+		uint8 = DLDataType(lanes = 1, bits = 8, type_code = DLDataTypeCode.kDLUInt)
+		input_options = DecodeAudio()
+		output_options = DecodeAudio()
+		if input_buffer is not None:
+			input_options.data.dl_tensor.data = ctypes.c_void_p(input_buffer.__array_interface__['data'][0])
+			input_options.data.dl_tensor.shape = (ctypes.c_int64 * 1)(len(input_buffer))
+			input_options.data.dl_tensor.ndim = 1
+			input_options.data.dl_tensor.dtype = uint8
+		if sample_rate is not None:
+			output_options.sample_rate = sample_rate
+		if fmt is not None:
+			output_options.fmt = fmt.encode()
+		output_options.channels_first = channels_first
+		output_options.set_resampler(resampler)
+		output_options.set_threading(threading)
+		output_options.set_allocator(allocator)
+		output_options.profile = profile
+
+		crop_starts = (ctypes.c_int64 * num_crops)()
+		num_samples = (ctypes.c_uint64 * num_crops)()
+		audio = self.lib.decode_audio_crops(input_path.encode() if input_path else None, input_options, output_options, filter_string.encode() if filter_string else None, num_crops, crop_samples, (ctypes.c_int64 * num_crops)(*starts) if starts is not None else None, seed, crop_starts, num_samples, verbose)
+		if audio.error:
+			raise Exception(audio.error.decode())
+		return audio, list(crop_starts), list(num_samples)
+
+	def streams(self, input_path = None, input_buffer = None, streams = None, max_streams = 64, filter_string = '', sample_rate = None, fmt = None, offset = None, duration = None, channels_first = False, normalize = False, resampler = None, threading = None, allocator = None, profile = False, num_threads = 0, verbose = False):
+		# every audio stream of a multi-track container (or the container stream indices in streams) in one demuxing pass, num_threads > 1 decodes the streams in parallel;
+		# returns a dict from stream index to its decoded audio, a stream that failed on its own carries its error
+		uint8 = DLDataType(lanes = 1, bits = 8, type_code = DLDataTypeCode.kDLUInt)
+		input_options = DecodeAudio()
+		output_options = DecodeAudio()
+		if input_buffer is not None:
+			input_options.data.dl_tensor.data = ctypes.c_void_p(input_buffer.__array_interface__['data'][0])
+			input_options.data.dl_tensor.shape = (ctypes.c_int64 * 1)(len(input_buffer))
+			input_options.data.dl_tensor.ndim = 1
+			input_options.data.dl_tensor.dtype = uint8
+		if offset is not None:
+			input_options.offset = offset
+		if duration is not None:
+			input_options.duration = duration
+		if sample_rate is not None:
+			output_options.sample_rate = sample_rate
+		if fmt is not None:
+			output_options.fmt = fmt.encode()
+		output_options.channels_first = channels_first
+		output_options.normalize = normalize
+		output_options.set_resampler(resampler)
+		output_options.set_threading(threading)
+		output_options.set_allocator(allocator)
+		output_options.profile = profile
+
+		if streams is not None:
+			max_streams = len(streams)
+		stream_indices = (ctypes.c_int * max_streams)()
+		results = (DecodeAudio * max_streams)()
+		num_streams = self.lib.decode_audio_streams(input_path.encode() if input_path else None, input_options, output_options, filter_string.encode() if filter_string else None, (ctypes.c_int * max_streams)(*streams) if streams is not None else None, len(streams) if streams is not None else 0, stream_indices, results, max_streams, num_threads, verbose)
+		if num_streams < 0:
+			raise Exception(results[0].error.decode())
+		return {stream_indices[i] : results[i] for i in range(num_streams)}
+
+	def session(self, filter_string = '', sample_rate = None, fmt = None, channels_first = False, normalize = False, resampler = None, threading = None, allocator = None, cache = None, features = None, profile = False, verbose = False):
+		return DecodeAudioSession(self.lib, filter_string = filter_string, sample_rate = sample_rate, fmt = fmt, channels_first = channels_first, normalize = normalize, resampler = resampler, threading = threading, allocator = allocator, cache = cache, features = features, profile = profile, verbose = verbose)
+
+	def shard(self, path, filter_string = '', sample_rate = None, fmt = None, channels_first = False, normalize = False, resampler = None, threading = None, allocator = None, cache = None, features = None, profile = False, verbose = False):
+		return DecodeAudioShard(self.lib, path, filter_string = filter_string, sample_rate = sample_rate, fmt = fmt, channels_first = channels_first, normalize = normalize, resampler = resampler, threading = threading, allocator = allocator, cache = cache, features = features, profile = profile, verbose = verbose)
+
+	def push(self, filter_string = '', sample_rate = None, fmt = None, resampler = None, threading = None, allocator = None, max_input_bytes = 1 << 16, max_output_samples = 1 << 16, profile = False, verbose = False):
+		return DecodeAudioPush(self.lib, filter_string = filter_string, sample_rate = sample_rate, fmt = fmt, resampler = resampler, threading = threading, allocator = allocator, max_input_bytes = max_input_bytes, max_output_samples = max_output_samples, profile = profile, verbose = verbose)
+
+	def pool(self, max_cached_bytes = 1 << 30):
+		return DecodeAudioPool(self.lib, max_cached_bytes)
+
+	def pcm_cache(self, cache_dir, max_bytes = 64 << 30):
+		# not named cache, that is the struct field
+		return DecodeAudioCache(self.lib, cache_dir, max_bytes)
+
+	def executor(self, num_threads = 0):
+		return DecodeAudioExecutor(self.lib, num_threads)
+
+	def aggregate_stats(self, reset = False):
+		# process-wide sums over every decode so far, reset = True starts a new scrape interval
+		stats = DecodeAudioStats()
+		self.lib.decode_audio_stats_aggregate(ctypes.byref(stats), reset)
+		return stats.as_dict()
+	
 	def to_dlpack(self):
 		byte_order = 'little' if b'le' in self.fmt else 'big' if b'be' in self.fmt else 'native'
 		assert byte_order == 'native' or byte_order == sys.byteorder
 		return PyCapsule_New(ctypes.byref(self.data), b'dltensor', None)
 
+class DecodeAudioSession:
+	# keeps the opened decoder and resampler alive across calls with uniformly encoded inputs
+	def __init__(self, lib, filter_string = '', sample_rate = None, fmt = None, channels_first = False, normalize = False, resampler = None, threading = None, allocator = None, cache = None, features = None, profile = False, verbose = False):
+		self.lib = lib
+		# plain structs, __new__ skips loading the library again
+		output_options = DecodeAudio.__new__(DecodeAudio)
+		if sample_rate is not None:
+			output_options.sample_rate = sample_rate
+		if fmt is not None:
+			output_options.fmt = fmt.encode()
+		output_options.channels_first = channels_first
+		output_options.normalize = normalize
+		output_options.set_resampler(resampler)
+		output_options.set_threading(threading)
+		output_options.set_allocator(allocator)
+		output_options.set_cache(cache)
+		output_options.set_features(features)
+		output_options.profile = profile
+		self.handle = self.lib.decode_audio_session_create(output_options, filter_string.encode() if filter_string else None, verbose)
+		if not self.handle:
+			raise Exception('Cannot create session')
+
+	def __call__(self, input_path = None, input_buffer = None):
+		uint8 = DLDataType(lanes = 1, bits = 8, type_code = DLDataTypeCode.kDLUInt)
+		input_options = DecodeAudio.__new__(DecodeAudio)
+		if input_buffer is not None:
+			input_options.data.dl_tensor.data = ctypes.c_void_p(input_buffer.__array_interface__['data'][0])
+			input_options.data.dl_tensor.shape = (ctypes.c_int64 * 1)(len(input_buffer))
+			input_options.data.dl_tensor.ndim = 1
+			input_options.data.dl_tensor.dtype = uint8
+
+		audio = self.lib.decode_audio_session_decode(self.handle, input_path.encode() if input_path else None, input_options, False)
+		if audio.error:
+			raise Exception(audio.error.decode())
+		audio._input_buffer = input_buffer
+		return audio
+
+	def close(self):
+		if self.handle:
+			self.lib.decode_audio_session_destroy(self.handle)
+			self.handle = None
+
+	def __del__(self):
+		self.close()
+
+class DecodeAudioPush:
+	# live byte streams (Ogg / Opus, MP3, ADTS AAC): feed() chunks as they arrive, drain() the interleaved PCM that is ready into a caller buffer;
+	# a native thread demuxes and decodes as soon as a packet is complete, both directions are bounded and neither call waits for I/O
+	FAILED, OPENING, DECODING, STARVED, DONE = -1, 0, 1, 2, 3
+
+	def __init__(self, lib, filter_string = '', sample_rate = None, fmt = None, resampler = None, threading = None, allocator = None, max_input_bytes = 1 << 16, max_output_samples = 1 << 16, profile = False, verbose = False):
+		self.lib = lib
+		output_options = DecodeAudio.__new__(DecodeAudio)
+		if sample_rate is not None:
+			output_options.sample_rate = sample_rate
+		if fmt is not None:
+			output_options.fmt = fmt.encode()
+		output_options.set_resampler(resampler)
+		output_options.set_threading(threading)
+		output_options.set_allocator(allocator)
+		output_options.profile = profile
+		error = ctypes.create_string_buffer(128)
+		self.handle = self.lib.decode_audio_push_create(output_options, filter_string.encode() if filter_string else None, max_input_bytes, max_output_samples, error, verbose)
+		if not self.handle:
+			raise Exception(error.value.decode())
+
+	def feed(self, data):
+		# returns how many bytes were accepted, the rest has to be fed again once drain() made room
+		return self.lib.decode_audio_push_feed(self.handle, bytes(data), len(data))
+
+	def finish(self):
+		self.lib.decode_audio_push_finish(self.handle)
+
+	def poll(self):
+		# (state, metadata so far): sample_rate, num_channels, fmt and itemsize are known from DECODING on, error is set once FAILED
+		audio = DecodeAudio.__new__(DecodeAudio)
+		state = self.lib.decode_audio_push_poll(self.handle, ctypes.byref(audio))
+		return state, audio
+
+	def drain(self, output_buffer):
+		# copies the ready samples that fit into the writable output_buffer, returns their number or None once the stream ended and everything was drained
+		state, audio = self.poll()
+		if state == DecodeAudioPush.FAILED:
+			raise Exception(audio.error.decode())
+		buf = memoryview(output_buffer).cast('B')
+		frame_size = audio.itemsize * audio.num_channels
+		num_samples = self.lib.decode_audio_push_drain(self.handle, ctypes.addressof((ctypes.c_char * len(buf)).from_buffer(buf)), len(buf) // frame_size if frame_size else 0)
+		return num_samples if num_samples >= 0 else None
+
+	def close(self):
+		if self.handle:
+			self.lib.decode_audio_push_destroy(self.handle)
+			self.handle = None
+
+	def __del__(self):
+		self.close()
+
+class DecodeAudioCache:
+	# on-disk cache of decoded PCM keyed by input identity and output options, hits are zero-copy mappings of the entry;
+	# a directory may be shared by many loader processes, each keeps the total under max_bytes by evicting least recently used entries
+	def __init__(self, lib, cache_dir, max_bytes):
+		self.lib = lib
+		self.handle = self.lib.decode_audio_cache_create(cache_dir.encode(), max_bytes)
+		if not self.handle:
+			raise Exception('Cannot create cache directory')
+
+	def close(self):
+		if self.handle:
+			self.lib.decode_audio_cache_destroy(self.handle)
+			self.handle = None
+
+	def __del__(self):
+		self.close()
+
+class DecodeAudioShard:
+	# a tar / zip shard mmapped once, members are decoded in place without extraction; shard[name] and shard[i] are O(1) through the member index built at open,
+	# iterating yields (name, audio) for the audio members; zero-copy WAV tensors keep the mapping alive on their own
+	audio_extensions = ('.wav', '.flac', '.mp3', '.opus', '.ogg', '.m4a', '.aac', '.webm')
+
+	def __init__(self, lib, path, filter_string = '', sample_rate = None, fmt = None, channels_first = False, normalize = False, resampler = None, threading = None, allocator = None, cache = None, features = None, profile = False, verbose = False):
+		self.lib = lib
+		self.path = path
+		self.output_options = DecodeAudio.__new__(DecodeAudio)
+		if sample_rate is not None:
+			self.output_options.sample_rate = sample_rate
+		if fmt is not None:
+			self.output_options.fmt = fmt.encode()
+		self.output_options.channels_first = channels_first
+		self.output_options.normalize = normalize
+		self.output_options.set_resampler(resampler)
+		self.output_options.set_threading(threading)
+		self.output_options.set_allocator(allocator)
+		self.output_options.set_cache(cache)
+		self.output_options.set_features(features)
+		self.output_options.profile = profile
+		self.filter_string = filter_string.encode() if filter_string else None
+		self.verbose = verbose
+		error = ctypes.create_string_buffer(128)
+		self.handle = self.lib.decode_audio_shard_open(path.encode(), error)
+		if not self.handle:
+			raise Exception(error.value.decode())
+
+	def __len__(self):
+		return self.lib.decode_audio_shard_num_members(self.handle)
+
+	def index(self, key):
+		member_index = key if isinstance(key, int) else self.lib.decode_audio_shard_find(self.handle, key.encode())
+		if not 0 <= member_index < len(self):
+			raise KeyError(key)
+		return member_index
+
+	def member(self, key):
+		# (name, offset, size), DecodeAudio()(shard.path, member_offset = offset, member_size = size) decodes the same member without the index
+		offset, size = ctypes.c_uint64(), ctypes.c_uint64()
+		name = self.lib.decode_audio_shard_member(self.handle, self.index(key), ctypes.byref(offset), ctypes.byref(size))
+		return name.decode(), offset.value, size.value
+
+	def names(self):
+		return [self.lib.decode_audio_shard_member(self.handle, i, None, None).decode() for i in range(len(self))]
+
+	def __contains__(self, name):
+		return self.lib.decode_audio_shard_find(self.handle, name.encode()) >= 0
+
+	def __getitem__(self, key):
+		audio = self.lib.decode_audio_shard_decode(self.handle, self.index(key), self.output_options, self.filter_string, False, self.verbose)
+		if audio.error:
+			raise Exception(audio.error.decode())
+		return audio
+
+	def __iter__(self):
+		for i, name in enumerate(self.names()):
+			if name.lower().endswith(self.audio_extensions):
+				yield name, self[i]
+
+	def close(self):
+		if self.handle:
+			self.lib.decode_audio_shard_close(self.handle)
+			self.handle = None
+
+	def __del__(self):
+		self.close()
+
+class DecodeAudioPool:
+	# size-class buffer pool recycling released output tensors, destroy it only after every tensor taken from it is released
+	def __init__(self, lib, max_cached_bytes):
+		self.lib = lib
+		self.handle = self.lib.decode_audio_pool_create(max_cached_bytes)
+
+	def close(self):
+		if self.handle:
+			self.lib.decode_audio_pool_destroy(self.handle)
+			self.handle = None
+
+	def __del__(self):
+		self.close()
+
+class DecodeAudioExecutor:
+	# asynchronous decodes on a C worker pool: submit() returns a concurrent.futures.Future, decode() is awaitable;
+	# completions are collected in batches through the eventfd of the pool (asyncio) or by one dispatcher thread, never by per-job Python callbacks
+	def __init__(self, lib, num_threads = 0):
+		self.lib = lib
+		self.closed = False
+		self.handle = self.lib.decode_audio_executor_create(num_threads)
+		if not self.handle:
+			raise Exception('Cannot create executor')
+		self.fd = self.lib.decode_audio_executor_fd(self.handle)
+		self.pending = {}
+		self.lock = threading.Lock()
+		self.loops = set()
+		self.dispatcher = None
+
+	def _submit(self, input_path = None, input_buffer = None, filter_string = '', sample_rate = None, fmt = None, offset = None, duration = None, channels_first = False, normalize = False, resampler = None, threading = None, allocator = None, cache = None, features = None, profile = False):
+		uint8 = DLDataType(lanes = 1, bits = 8, type_code = DLDataTypeCode.kDLUInt)
+		input_options = DecodeAudio.__new__(DecodeAudio)
+		output_options = DecodeAudio.__new__(DecodeAudio)
+		shape = None
+		if input_buffer is not None:
+			shape = (ctypes.c_int64 * 1)(len(input_buffer))
+			input_options.data.dl_tensor.data = ctypes.c_void_p(input_buffer.__array_interface__['data'][0])
+			input_options.data.dl_tensor.shape = shape
+			input_options.data.dl_tensor.ndim = 1
+			input_options.data.dl_tensor.dtype = uint8
+		if offset is not None:
+			input_options.offset = offset
+		if duration is not None:
+			input_options.duration = duration
+		if sample_rate is not None:
+			output_options.sample_rate = sample_rate
+		if fmt is not None:
+			output_options.fmt = fmt.encode()
+		output_options.channels_first = channels_first
+		output_options.normalize = normalize
+		output_options.set_resampler(resampler)
+		output_options.set_threading(threading)
+		output_options.set_allocator(allocator)
+		output_options.set_cache(cache)
+		output_options.set_features(features)
+		output_options.profile = profile
+
+		future = concurrent.futures.Future()
+		with self.lock:
+			# options are copied by the C side, the input buffer, allocator and cache they point to must live until the job completes
+			job_id = self.lib.decode_audio_executor_submit(self.handle, input_path.encode() if input_path else None, ctypes.byref(input_options), ctypes.byref(output_options), filter_string.encode() if filter_string else None, None, None)
+			if job_id < 0:
+				raise Exception('Too long filter string')
+			self.pending[job_id] = (future, (input_buffer, shape, allocator, cache))
+		return future
+
+	def _dispatch(self, timeout_ms = 0):
+		job_ids = (ctypes.c_int64 * 256)()
+		while True:
+			num_jobs = self.lib.decode_audio_executor_poll(self.handle, job_ids, len(job_ids), timeout_ms)
+			if num_jobs < 0:
+				errno = ctypes.get_errno()
+				raise OSError(errno, 'Cannot clear the executor eventfd: ' + os.strerror(errno))
+			for job_id in job_ids[:num_jobs]:
+				audio = DecodeAudio.__new__(DecodeAudio)
+				self.lib.decode_audio_executor_result(self.handle, job_id, ctypes.byref(audio))
+				with self.lock:
+					future, keepalive = self.pending.pop(job_id)
+				if audio.error:
+					if audio.data.deleter:
+						audio.data.deleter(ctypes.byref(audio.data))
+					future.set_exception(Exception(audio.error.decode()))
+				else:
+					# PCM WAV in input_buffer comes back as a view of it, the buffer lives as long as the result
+					audio._input_buffer = keepalive[0]
+					future.set_result(audio)
+			if num_jobs < len(job_ids):
+				return
+			timeout_ms = 0
+
+	def _dispatch_thread(self):
+		while not self.closed:
+			self._dispatch(timeout_ms = 100)
+
+	def submit(self, input_path = None, input_buffer = None, **kwargs):
+		# kwargs as in DecodeAudio.__call__ (filter_string, sample_rate, fmt, offset, duration, channels_first, normalize, resampler, threading, allocator, profile)
+		if self.dispatcher is None:
+			self.dispatcher = threading.Thread(target = self._dispatch_thread, daemon = True)
+			self.dispatcher.start()
+		return self._submit(input_path, input_buffer, **kwargs)
+
+	async def decode(self, input_path = None, input_buffer = None, **kwargs):
+		loop = asyncio.get_running_loop()
+		if loop not in self.loops:
+			loop.add_reader(self.fd, self._dispatch)
+			self.loops.add(loop)
+		return await asyncio.wrap_future(self._submit(input_path, input_buffer, **kwargs), loop = loop)
+
+	def close(self):
+		# waits for submitted jobs, results nobody collected are released by the C side
+		if self.closed or not self.handle:
+			return
+		while self.pending:
+			self._dispatch(timeout_ms = 100)
+		self.closed = True
+		if self.dispatcher:
+			self.dispatcher.join()
+		for loop in self.loops:
+			if not loop.is_closed():
+				loop.remove_reader(self.fd)
+		self.lib.decode_audio_executor_destroy(self.handle)
+		self.handle = None
+
+	def __del__(self):
+		self.close()
+
 def numpy_from_dlpack(pycapsule):
 	data = ctypes.cast(PyCapsule_GetPointer(pycapsule, b'dltensor'), ctypes.POINTER(DLManagedTensor)).contents
 	wrapped = type('', (), dict(__array_interface__ = data.dl_tensor.__array_interface__, __del__ = lambda self: data.deleter(ctypes.byref(data)) if data.deleter else None))()
@@ -179,8 +894,18 @@ if __name__ == '__main__':
 	parser.add_argument('--sample-rate', type = int)
 	parser.add_argument('--filter', default = '')#volume=volume=3.0') 
 	parser.add_argument('--probe', action = 'store_true')
+	parser.add_argument('--profile', action = 'store_true')
 	parser.add_argument('--verbose', action = 'store_true')
+	parser.add_argument('--build-seek-index', nargs = '+', metavar = 'PATH')
+	parser.add_argument('--num-threads', type = int, default = 0)
 	args = parser.parse_args()
+
+	if args.build_seek_index:
+		results = DecodeAudio().build_seek_index(args.build_seek_index, num_threads = args.num_threads, verbose = args.verbose)
+		for input_path, result in zip(args.build_seek_index, results):
+			if result.error:
+				print(input_path, result.error.decode(), file = sys.stderr)
+		sys.exit(0 if not any(result.error for result in results) else 1)
 	
 	def measure(k, f, audio_path, K = 100, timer = time.process_time, **kwargs):
 		tic = timer()
@@ -197,9 +922,19 @@ if __name__ == '__main__':
 	input_buffer_ = open(args.input_path, 'rb').read()
 	input_buffer = numpy.frombuffer(input_buffer_, dtype = numpy.uint8)
 	output_buffer = bytearray(b'\0' * 1000000) #numpy.zeros((1_000_000), dtype = numpy.uint8)
-	audio = measure('ffmpeg', decode_audio, args.input_path if not args.buffer else None, input_buffer = input_buffer if args.buffer else None, output_buffer = output_buffer if args.buffer else None, filter_string = args.filter, sample_rate = args.sample_rate, probe = args.probe, verbose = args.verbose)
+	audio = measure('ffmpeg', decode_audio, args.input_path if not args.buffer else None, input_buffer = input_buffer if args.buffer else None, output_buffer = output_buffer if args.buffer else None, filter_string = args.filter, sample_rate = args.sample_rate, profile = args.profile, probe = args.probe, verbose = args.verbose)
 
+	if args.profile:
+		print('ffmpeg stats', audio.stats.as_dict())
 	print('ffplay', '-f', audio.fmt.decode(), '-ac', audio.num_channels, '-ar', audio.sample_rate, '-i', args.input_path, '#', audio)
+
+	if args.sample_rate and not args.filter and not args.probe:
+		# resample-only jobs go through libswresample, a no-op filter forces the aresample graph for comparison
+		session = decode_audio.session(sample_rate = args.sample_rate)
+		measure('ffmpeg resample swr session', lambda path: session(path), args.input_path)
+		measure('ffmpeg resample swr', decode_audio, args.input_path, sample_rate = args.sample_rate)
+		measure('ffmpeg resample swr linear', decode_audio, args.input_path, sample_rate = args.sample_rate, resampler = dict(filter_size = 16, linear = True))
+		measure('ffmpeg resample graph', decode_audio, args.input_path, sample_rate = args.sample_rate, filter_string = 'anull')
 	if not args.probe:
 		dlpack_tensor = audio.to_dlpack()
 		if 'numpy' in args.output_path:
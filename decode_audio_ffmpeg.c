@@ -2,9 +2,23 @@
 
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdbool.h>
+#include <errno.h>
 #include <string.h>
+#include <strings.h>
 #include <assert.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <inttypes.h>
 
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
@@ -14,6 +28,9 @@
 #include <libavfilter/buffersink.h>
 #include <libavfilter/buffersrc.h>
 #include <libavutil/opt.h>
+#include <libavutil/audio_fifo.h>
+#include <libavutil/intreadwrite.h>
+#include <libswresample/swresample.h>
 
 // https://github.com/dmlc/dlpack/blob/master/include/dlpack/dlpack.h
 #include "dlpack.h"
@@ -39,13 +56,214 @@ void deleter(struct DLManagedTensor* self)
 	}
 }
 
+void deleter_borrowed(struct DLManagedTensor* self)
+{
+	// data belongs to the caller (e.g. the input buffer), only shape and strides are ours
+	self->dl_tensor.data = NULL;
+	deleter(self);
+}
+
+struct mmap_ctx
+{
+	void* addr;
+	size_t length;
+};
+
+void deleter_mmap(struct DLManagedTensor* self)
+{
+	struct mmap_ctx* mapping = (struct mmap_ctx*)self->manager_ctx;
+	if(mapping)
+	{
+		munmap(mapping->addr, mapping->length);
+		free(mapping);
+		self->manager_ctx = NULL;
+	}
+	deleter_borrowed(self);
+}
+
+struct DecodeAudioAllocator
+{
+	// output tensors are taken from alloc and handed back to free when released, the allocator is their manager_ctx and must outlive them
+	void* (*alloc)(void* ctx, size_t size);
+	void (*free)(void* ctx, void* ptr);
+	void* ctx;
+};
+
+void deleter_allocator(struct DLManagedTensor* self)
+{
+	struct DecodeAudioAllocator* allocator = (struct DecodeAudioAllocator*)self->manager_ctx;
+	if(allocator && self->dl_tensor.data)
+		allocator->free(allocator->ctx, self->dl_tensor.data);
+	deleter_borrowed(self);
+}
+
+// size-class buffer pool: power-of-two classes, released buffers are cached up to max_cached_bytes and reused by later tensors
+
+#define POOL_HEADER_SIZE 64
+#define POOL_MIN_CLASS 12
+
+struct pool_block
+{
+	struct pool_block* next;
+	int size_class;
+};
+
+struct buffer_pool
+{
+	struct DecodeAudioAllocator allocator;
+	pthread_mutex_t lock;
+	struct pool_block* free_blocks[64];
+	size_t cached_bytes;
+	size_t max_cached_bytes;
+};
+
+static void* buffer_pool_alloc(void* ctx, size_t size)
+{
+	struct buffer_pool* pool = (struct buffer_pool*)ctx;
+	int size_class = POOL_MIN_CLASS;
+	while (((size_t)1 << size_class) < size)
+		size_class++;
+
+	pthread_mutex_lock(&pool->lock);
+	struct pool_block* block = pool->free_blocks[size_class];
+	if(block)
+	{
+		pool->free_blocks[size_class] = block->next;
+		pool->cached_bytes -= (size_t)1 << size_class;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	// the header keeps the payload 64-byte aligned for the SIMD kernels
+	if(!block && posix_memalign((void**)&block, POOL_HEADER_SIZE, POOL_HEADER_SIZE + ((size_t)1 << size_class)) != 0)
+		return NULL;
+	block->size_class = size_class;
+	return (uint8_t*)block + POOL_HEADER_SIZE;
+}
+
+static void buffer_pool_free(void* ctx, void* ptr)
+{
+	struct buffer_pool* pool = (struct buffer_pool*)ctx;
+	struct pool_block* block = (struct pool_block*)((uint8_t*)ptr - POOL_HEADER_SIZE);
+	size_t size = (size_t)1 << block->size_class;
+
+	pthread_mutex_lock(&pool->lock);
+	bool cache = pool->cached_bytes + size <= pool->max_cached_bytes;
+	if(cache)
+	{
+		block->next = pool->free_blocks[block->size_class];
+		pool->free_blocks[block->size_class] = block;
+		pool->cached_bytes += size;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	if(!cache)
+		free(block);
+}
+
+struct DecodeAudioAllocator* decode_audio_pool_create(size_t max_cached_bytes)
+{
+	struct buffer_pool* pool = calloc(1, sizeof(struct buffer_pool));
+	pthread_mutex_init(&pool->lock, NULL);
+	pool->max_cached_bytes = max_cached_bytes;
+	pool->allocator.alloc = buffer_pool_alloc;
+	pool->allocator.free = buffer_pool_free;
+	pool->allocator.ctx = pool;
+	return &pool->allocator;
+}
+
+void decode_audio_pool_destroy(struct DecodeAudioAllocator* allocator)
+{
+	// tensors allocated from the pool must be released before
+	if(!allocator)
+		return;
+	struct buffer_pool* pool = (struct buffer_pool*)allocator->ctx;
+	for (int k = 0; k < FF_ARRAY_ELEMS(pool->free_blocks); k++)
+	{
+		while (pool->free_blocks[k])
+		{
+			struct pool_block* block = pool->free_blocks[k];
+			pool->free_blocks[k] = block->next;
+			free(block);
+		}
+	}
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+static uint64_t hash_path(const char* path)
+{
+	// FNV-1a
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (; *path; path++)
+		hash = (hash ^ (uint8_t)*path) * 0x100000001b3ULL;
+	return hash;
+}
+
+static uint64_t hash_bytes(const uint8_t* data, size_t size)
+{
+	// FNV-1a over 64-bit words, the tail byte by byte
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (; size >= 8; data += 8, size -= 8)
+		hash = (hash ^ AV_RL64(data)) * 0x100000001b3ULL;
+	for (; size > 0; data++, size--)
+		hash = (hash ^ *data) * 0x100000001b3ULL;
+	return hash;
+}
+
+static bool map_file(const char* path, int prot, int flags, struct mmap_ctx* mapping)
+{
+	int fd = open(path, O_RDONLY);
+	if(fd < 0)
+		return false;
+	struct stat st;
+	mapping->addr = MAP_FAILED;
+	mapping->length = 0;
+	if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+	{
+		mapping->length = st.st_size;
+		mapping->addr = mmap(NULL, mapping->length, prot, flags, fd, 0);
+	}
+	close(fd);
+	if(mapping->addr == MAP_FAILED)
+	{
+		mapping->addr = NULL;
+		mapping->length = 0;
+		return false;
+	}
+	return true;
+}
+
+static void select_interleave_kernels();
+static void select_convert_kernels();
+
 void __attribute__ ((constructor)) onload()
 {
 	//needed before ffmpeg 4.0, deprecated in ffmpeg 4.0
 	av_register_all();
+	select_interleave_kernels();
+	select_convert_kernels();
 	avfilter_register_all();
 }
 
+enum { STAGE_OPEN, STAGE_STREAM_DISCOVERY, STAGE_CODEC_OPEN, STAGE_GRAPH_CONFIG, STAGE_DEMUX, STAGE_DECODE, STAGE_FILTER, STAGE_COPY_OUT, NUM_STAGES };
+static const char* stage_names[NUM_STAGES] = { "open", "stream_discovery", "codec_open", "graph_config", "demux", "decode", "filter", "copy_out" };
+
+struct DecodeAudioStats
+{
+	// per stage wall clock and thread CPU time, only collected with the profile option; every field is a uint64_t so that stats add up field by field
+	uint64_t wall_ns[NUM_STAGES];
+	uint64_t cpu_ns[NUM_STAGES];
+	uint64_t num_packets;
+	uint64_t num_frames;
+	// compressed bytes fed to the decoder, sample bytes written out, bytes allocated for the output tensor and the IO buffer
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t alloc_bytes;
+	uint64_t num_decodes;
+	uint64_t num_errors;
+	uint64_t num_cache_hits;
+};
+
 struct DecodeAudio
 {
 	char error[128];
@@ -55,75 +273,687 @@ struct DecodeAudio
 	uint64_t num_samples;
 	uint64_t itemsize;
 	double duration;
+	double offset;
+	// AVIO buffer of mapped and in-memory inputs; packet payloads and seeks bypass it (direct mode), it only batches the small reads of header parsing
+	uint64_t io_buffer_size;
+	// input_path is an archive (or any file) and the input is its member at [member_offset, member_offset + member_size), a zero size runs to the end of the file
+	uint64_t member_offset;
+	uint64_t member_size;
+	int channels_first;
+	// f32 / f64 output is clamped to [-1, 1] (resampling, filters and float decoders may overshoot), any other output format is an error
+	int normalize;
+	// caller output tensors are padded with this raw sample value past the decoded length
+	double pad_value;
+	// resample-only jobs: libswresample filter length (0 keeps the default), linear interpolation between phases, cubic filter, soxr engine
+	int resample_filter_size;
+	int resample_linear;
+	int resample_cubic;
+	int resample_soxr;
+	// output memory comes from this allocator when set (see decode_audio_pool_create), otherwise from malloc
+	struct DecodeAudioAllocator* allocator;
+	// decoded output is looked up in and stored to this cache when set (see decode_audio_cache_create)
+	struct DecodeAudioCache* cache;
+	// n_mels > 0 returns [frames, n_mels] float32 log-mel features of the mono downmix instead of samples: periodic Hann window of win_length,
+	// n_fft point STFT every hop_length samples centered with reflect padding, power spectrum, HTK (or Slaney) mel filterbank over [f_min, f_max], log(mel + 1e-6)
+	int n_mels;
+	int n_fft;
+	int win_length;
+	int hop_length;
+	int mel_slaney;
+	double f_min;
+	double f_max;
+	// num_segments > 1 decodes long seekable inputs as that many time segments in parallel; decoder_threads / decoder_thread_type (FF_THREAD_FRAME, FF_THREAD_SLICE) go to libavcodec
+	int num_segments;
+	int decoder_threads;
+	int decoder_thread_type;
+	// demux, decode and conversion run on three threads connected by packet / frame rings
+	int pipeline;
+	// per-stage timings in stats are only collected with profile set, counters always are
+	int profile;
+	struct DecodeAudioStats stats;
 	DLManagedTensor data;
 };
 
-void process_output_frame(uint8_t** data, AVFrame* frame, int num_samples, int num_channels, uint64_t* data_len, int itemsize)
+struct stage_timer
 {
-	if(num_channels == 1)
-		data = memcpy(*data, frame->data, itemsize * frame->nb_samples) + itemsize * frame->nb_samples;
-	else
+	bool enabled;
+	uint64_t wall_ns, cpu_ns;
+};
+
+static uint64_t clock_ns(clockid_t clock_id)
+{
+	struct timespec ts;
+	clock_gettime(clock_id, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void stage_begin(struct stage_timer* timer, bool enabled)
+{
+	// the thread CPU clock is a syscall per read, hence opt-in
+	timer->enabled = enabled;
+	if(enabled)
+	{
+		timer->wall_ns = clock_ns(CLOCK_MONOTONIC);
+		timer->cpu_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+	}
+}
+
+static void stage_end(struct DecodeAudioStats* stats, int stage, struct stage_timer* timer)
+{
+	// charges the time since the last begin / end to stage, the next stage starts right away
+	if(!timer->enabled)
+		return;
+	uint64_t wall_ns = clock_ns(CLOCK_MONOTONIC), cpu_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+	stats->wall_ns[stage] += wall_ns - timer->wall_ns;
+	stats->cpu_ns[stage] += cpu_ns - timer->cpu_ns;
+	timer->wall_ns = wall_ns;
+	timer->cpu_ns = cpu_ns;
+}
+
+static struct DecodeAudioStats aggregate_stats;
+
+static void add_stats(struct DecodeAudioStats* sum, const struct DecodeAudioStats* stats, bool atomic)
+{
+	uint64_t* dst = (uint64_t*)sum;
+	const uint64_t* src = (const uint64_t*)stats;
+	for (size_t i = 0; i < sizeof(struct DecodeAudioStats) / sizeof(uint64_t); i++)
+	{
+		if(atomic)
+			__atomic_fetch_add(&dst[i], src[i], __ATOMIC_RELAXED);
+		else
+			dst[i] += src[i];
+	}
+}
+
+void decode_audio_stats_aggregate(struct DecodeAudioStats* stats, int reset)
+{
+	// process-wide sums over every decode result so far, for scraping by long-running workers
+	uint64_t* dst = (uint64_t*)stats;
+	uint64_t* src = (uint64_t*)&aggregate_stats;
+	for (size_t i = 0; i < sizeof(struct DecodeAudioStats) / sizeof(uint64_t); i++)
+		dst[i] = reset ? __atomic_exchange_n(&src[i], 0, __ATOMIC_RELAXED) : __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+}
+
+static void print_stats(const struct DecodeAudioStats* stats)
+{
+	for (int k = 0; k < NUM_STAGES; k++)
+		printf("decode_audio_%s: %.2f microsec wall, %.2f microsec cpu\n", stage_names[k], stats->wall_ns[k] / 1000.0, stats->cpu_ns[k] / 1000.0);
+	printf("decode_audio: %"PRIu64" packets, %"PRIu64" frames, %"PRIu64" bytes in, %"PRIu64" bytes out, %"PRIu64" bytes allocated\n", stats->num_packets, stats->num_frames, stats->bytes_in, stats->bytes_out, stats->alloc_bytes);
+}
+
+static struct sample_fmt_entry {enum AVSampleFormat sample_fmt; const char *fmt_be, *fmt_le; DLDataType dtype;} supported_sample_fmt_entries[] =
+{
+	{ AV_SAMPLE_FMT_U8,  "u8"   ,    "u8" , { kDLUInt  , 8 , 1 }},
+	{ AV_SAMPLE_FMT_S16, "s16be", "s16le" , { kDLInt   , 16, 1 }},
+	{ AV_SAMPLE_FMT_S32, "s32be", "s32le" , { kDLInt   , 32, 1 }},
+	{ AV_SAMPLE_FMT_FLT, "f32be", "f32le" , { kDLFloat , 32, 1 }},
+	{ AV_SAMPLE_FMT_DBL, "f64be", "f64le" , { kDLFloat , 64, 1 }},
+};
+
+// interleave / deinterleave kernels: planar frames to [T, C] output and packed frames to [C, T] output
+// typed scalar loops for any channel count, SSE2 for stereo, for 16 / 32-bit groups of 4 channels and 64-bit pairs of channels, AVX2 stereo picked at load time;
+// channels left over by the groups (the last 2 of 5.1) and all multichannel 8-bit audio stay scalar
+
+#define DEFINE_INTERLEAVE_SCALAR(type) \
+typedef type __attribute__((aligned(1), may_alias)) type##_unaligned; \
+static void interleave_scalar_##type(uint8_t* dst, uint8_t* const* src, int num_channels, int first_channel, int num_samples) \
+{ \
+	type##_unaligned* d = (type##_unaligned*)dst; \
+	for (int c = first_channel; c < num_channels; c++) \
+	{ \
+		const type##_unaligned* s = (const type##_unaligned*)src[c]; \
+		for (int i = 0; i < num_samples; i++) \
+			d[i * num_channels + c] = s[i]; \
+	} \
+} \
+static void deinterleave_scalar_##type(uint8_t* const* dst, const uint8_t* src, int num_channels, int first_channel, int num_samples) \
+{ \
+	const type##_unaligned* s = (const type##_unaligned*)src; \
+	for (int c = first_channel; c < num_channels; c++) \
+	{ \
+		type##_unaligned* d = (type##_unaligned*)dst[c]; \
+		for (int i = 0; i < num_samples; i++) \
+			d[i] = s[i * num_channels + c]; \
+	} \
+}
+DEFINE_INTERLEAVE_SCALAR(uint8_t)
+DEFINE_INTERLEAVE_SCALAR(uint16_t)
+DEFINE_INTERLEAVE_SCALAR(uint32_t)
+DEFINE_INTERLEAVE_SCALAR(uint64_t)
+
+static void interleave_scalar(uint8_t* dst, uint8_t* const* src, int num_channels, int first_channel, int num_samples, int itemsize)
+{
+	switch(itemsize)
+	{
+		case 1: interleave_scalar_uint8_t(dst, src, num_channels, first_channel, num_samples); break;
+		case 2: interleave_scalar_uint16_t(dst, src, num_channels, first_channel, num_samples); break;
+		case 4: interleave_scalar_uint32_t(dst, src, num_channels, first_channel, num_samples); break;
+		case 8: interleave_scalar_uint64_t(dst, src, num_channels, first_channel, num_samples); break;
+	}
+}
+
+static void deinterleave_scalar(uint8_t* const* dst, const uint8_t* src, int num_channels, int first_channel, int num_samples, int itemsize)
+{
+	switch(itemsize)
+	{
+		case 1: deinterleave_scalar_uint8_t(dst, src, num_channels, first_channel, num_samples); break;
+		case 2: deinterleave_scalar_uint16_t(dst, src, num_channels, first_channel, num_samples); break;
+		case 4: deinterleave_scalar_uint32_t(dst, src, num_channels, first_channel, num_samples); break;
+		case 8: deinterleave_scalar_uint64_t(dst, src, num_channels, first_channel, num_samples); break;
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+#define DEFINE_INTERLEAVE2_SSE2(bits) \
+static int interleave2_sse2_##bits(uint8_t* dst, uint8_t* const* src, int num_samples) \
+{ \
+	int i = 0, n = num_samples * (bits / 8); \
+	for (; i + 16 <= n; i += 16) \
+	{ \
+		__m128i l = _mm_loadu_si128((const __m128i*)(src[0] + i)), r = _mm_loadu_si128((const __m128i*)(src[1] + i)); \
+		_mm_storeu_si128((__m128i*)(dst + 2 * i), _mm_unpacklo_epi##bits(l, r)); \
+		_mm_storeu_si128((__m128i*)(dst + 2 * i + 16), _mm_unpackhi_epi##bits(l, r)); \
+	} \
+	return i / (bits / 8); \
+}
+DEFINE_INTERLEAVE2_SSE2(8)
+DEFINE_INTERLEAVE2_SSE2(16)
+DEFINE_INTERLEAVE2_SSE2(32)
+DEFINE_INTERLEAVE2_SSE2(64)
+
+#define DEFINE_INTERLEAVE2_AVX2(bits) \
+__attribute__((target("avx2"))) static int interleave2_avx2_##bits(uint8_t* dst, uint8_t* const* src, int num_samples) \
+{ \
+	int i = 0, n = num_samples * (bits / 8); \
+	for (; i + 32 <= n; i += 32) \
+	{ \
+		__m256i l = _mm256_loadu_si256((const __m256i*)(src[0] + i)), r = _mm256_loadu_si256((const __m256i*)(src[1] + i)); \
+		__m256i lo = _mm256_unpacklo_epi##bits(l, r), hi = _mm256_unpackhi_epi##bits(l, r); \
+		_mm256_storeu_si256((__m256i*)(dst + 2 * i), _mm256_permute2x128_si256(lo, hi, 0x20)); \
+		_mm256_storeu_si256((__m256i*)(dst + 2 * i + 32), _mm256_permute2x128_si256(lo, hi, 0x31)); \
+	} \
+	return i / (bits / 8); \
+}
+DEFINE_INTERLEAVE2_AVX2(8)
+DEFINE_INTERLEAVE2_AVX2(16)
+DEFINE_INTERLEAVE2_AVX2(32)
+DEFINE_INTERLEAVE2_AVX2(64)
+
+static int deinterleave2_sse2(uint8_t* const* dst, const uint8_t* src, int num_samples, int itemsize)
+{
+	int i = 0, n = num_samples * itemsize;
+	for (; i + 16 <= n; i += 16)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i*)(src + 2 * i)), b = _mm_loadu_si128((const __m128i*)(src + 2 * i + 16)), l, r;
+		if(itemsize == 1)
+		{
+			__m128i mask = _mm_set1_epi16(0x00FF);
+			l = _mm_packus_epi16(_mm_and_si128(a, mask), _mm_and_si128(b, mask));
+			r = _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+		}
+		else if(itemsize == 2)
+		{
+			// gather even and odd 16-bit lanes into the low and high halves, then merge halves
+			a = _mm_shuffle_epi32(_mm_shufflehi_epi16(_mm_shufflelo_epi16(a, _MM_SHUFFLE(3, 1, 2, 0)), _MM_SHUFFLE(3, 1, 2, 0)), _MM_SHUFFLE(3, 1, 2, 0));
+			b = _mm_shuffle_epi32(_mm_shufflehi_epi16(_mm_shufflelo_epi16(b, _MM_SHUFFLE(3, 1, 2, 0)), _MM_SHUFFLE(3, 1, 2, 0)), _MM_SHUFFLE(3, 1, 2, 0));
+			l = _mm_unpacklo_epi64(a, b);
+			r = _mm_unpackhi_epi64(a, b);
+		}
+		else if(itemsize == 4)
+		{
+			l = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(a), _mm_castsi128_ps(b), _MM_SHUFFLE(2, 0, 2, 0)));
+			r = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(a), _mm_castsi128_ps(b), _MM_SHUFFLE(3, 1, 3, 1)));
+		}
+		else
+		{
+			l = _mm_unpacklo_epi64(a, b);
+			r = _mm_unpackhi_epi64(a, b);
+		}
+		_mm_storeu_si128((__m128i*)(dst[0] + i), l);
+		_mm_storeu_si128((__m128i*)(dst[1] + i), r);
+	}
+	return i / itemsize;
+}
+
+static int transpose4_sse2_32(uint8_t* interleaved, uint8_t** planes, int num_channels, int num_samples, bool to_interleaved)
+{
+	// 4x4 blocks of 32-bit samples: 4 consecutive samples of a group of 4 channels, returns number of channels handled
+	int num_groups = num_channels / 4, i = 0;
+	for (; i + 4 <= num_samples; i += 4)
+	{
+		for (int g = 0; g < num_groups; g++)
+		{
+			float* packed = (float*)interleaved + (size_t)i * num_channels + g * 4;
+			__m128 r0, r1, r2, r3;
+			if(to_interleaved)
+			{
+				r0 = _mm_loadu_ps((float*)planes[g * 4 + 0] + i);
+				r1 = _mm_loadu_ps((float*)planes[g * 4 + 1] + i);
+				r2 = _mm_loadu_ps((float*)planes[g * 4 + 2] + i);
+				r3 = _mm_loadu_ps((float*)planes[g * 4 + 3] + i);
+			}
+			else
+			{
+				r0 = _mm_loadu_ps(packed + 0 * num_channels);
+				r1 = _mm_loadu_ps(packed + 1 * num_channels);
+				r2 = _mm_loadu_ps(packed + 2 * num_channels);
+				r3 = _mm_loadu_ps(packed + 3 * num_channels);
+			}
+			_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+			if(to_interleaved)
+			{
+				_mm_storeu_ps(packed + 0 * num_channels, r0);
+				_mm_storeu_ps(packed + 1 * num_channels, r1);
+				_mm_storeu_ps(packed + 2 * num_channels, r2);
+				_mm_storeu_ps(packed + 3 * num_channels, r3);
+			}
+			else
+			{
+				_mm_storeu_ps((float*)planes[g * 4 + 0] + i, r0);
+				_mm_storeu_ps((float*)planes[g * 4 + 1] + i, r1);
+				_mm_storeu_ps((float*)planes[g * 4 + 2] + i, r2);
+				_mm_storeu_ps((float*)planes[g * 4 + 3] + i, r3);
+			}
+		}
+	}
+	return i;
+}
+
+static int transpose4_sse2_16(uint8_t* interleaved, uint8_t** planes, int num_channels, int num_samples, bool to_interleaved)
+{
+	// 8 consecutive samples of a group of 4 16-bit channels (5.1 / 7.1 s16p), every packed row of the group is one 64-bit lane
+	int num_groups = num_channels / 4, i = 0;
+	for (; i + 8 <= num_samples; i += 8)
 	{
-		for (int i = 0; i < num_samples; i++)
+		for (int g = 0; g < num_groups; g++)
 		{
-			for (int c = 0; c < num_channels; c++)
+			int16_t* packed = (int16_t*)interleaved + (size_t)i * num_channels + g * 4;
+			if(to_interleaved)
 			{
-				if(*data_len >= itemsize)
+				__m128i a = _mm_loadu_si128((const __m128i*)((int16_t*)planes[g * 4 + 0] + i)), b = _mm_loadu_si128((const __m128i*)((int16_t*)planes[g * 4 + 1] + i));
+				__m128i c = _mm_loadu_si128((const __m128i*)((int16_t*)planes[g * 4 + 2] + i)), d = _mm_loadu_si128((const __m128i*)((int16_t*)planes[g * 4 + 3] + i));
+				__m128i ab_lo = _mm_unpacklo_epi16(a, b), ab_hi = _mm_unpackhi_epi16(a, b), cd_lo = _mm_unpacklo_epi16(c, d), cd_hi = _mm_unpackhi_epi16(c, d);
+				__m128i rows[4] = { _mm_unpacklo_epi32(ab_lo, cd_lo), _mm_unpackhi_epi32(ab_lo, cd_lo), _mm_unpacklo_epi32(ab_hi, cd_hi), _mm_unpackhi_epi32(ab_hi, cd_hi) };
+				for (int k = 0; k < 4; k++)
 				{
-					*data = memcpy(*data, frame->data[c] + itemsize * i, itemsize) + itemsize;
-					*data_len -= itemsize;
+					_mm_storel_epi64((__m128i*)(packed + (2 * k) * num_channels), rows[k]);
+					_mm_storel_epi64((__m128i*)(packed + (2 * k + 1) * num_channels), _mm_unpackhi_epi64(rows[k], rows[k]));
 				}
 			}
+			else
+			{
+				__m128i r[8];
+				for (int k = 0; k < 8; k++)
+					r[k] = _mm_loadl_epi64((const __m128i*)(packed + k * num_channels));
+				__m128i t0 = _mm_unpacklo_epi16(r[0], r[1]), t1 = _mm_unpacklo_epi16(r[2], r[3]), t2 = _mm_unpacklo_epi16(r[4], r[5]), t3 = _mm_unpacklo_epi16(r[6], r[7]);
+				__m128i ab0 = _mm_unpacklo_epi32(t0, t1), cd0 = _mm_unpackhi_epi32(t0, t1), ab1 = _mm_unpacklo_epi32(t2, t3), cd1 = _mm_unpackhi_epi32(t2, t3);
+				_mm_storeu_si128((__m128i*)((int16_t*)planes[g * 4 + 0] + i), _mm_unpacklo_epi64(ab0, ab1));
+				_mm_storeu_si128((__m128i*)((int16_t*)planes[g * 4 + 1] + i), _mm_unpackhi_epi64(ab0, ab1));
+				_mm_storeu_si128((__m128i*)((int16_t*)planes[g * 4 + 2] + i), _mm_unpacklo_epi64(cd0, cd1));
+				_mm_storeu_si128((__m128i*)((int16_t*)planes[g * 4 + 3] + i), _mm_unpackhi_epi64(cd0, cd1));
+			}
 		}
 	}
+	return i;
 }
 
-int decode_packet(AVCodecContext *av_ctx, AVFilterContext* buffersrc_ctx, AVFilterContext* buffersink_ctx, AVPacket *pkt, uint8_t** data, uint64_t* data_len, int itemsize)
+static int transpose2_sse2_64(uint8_t* interleaved, uint8_t** planes, int num_channels, int num_samples, bool to_interleaved)
 {
-	AVFrame *frame = av_frame_alloc();
-	AVFrame *filt_frame = av_frame_alloc();
-
-	int ret = avcodec_send_packet(av_ctx, pkt);
-
-	int filtering = buffersrc_ctx != NULL && buffersink_ctx != NULL;
-	while (ret >= 0)
+	// 2x2 blocks of 64-bit samples: 2 consecutive samples of a pair of channels
+	int num_groups = num_channels / 2, i = 0;
+	for (; i + 2 <= num_samples; i += 2)
 	{
-		ret = avcodec_receive_frame(av_ctx, frame);
-		if (ret == 0)
+		for (int g = 0; g < num_groups; g++)
 		{
-			if(filtering)
+			int64_t* packed = (int64_t*)interleaved + (size_t)i * num_channels + g * 2;
+			__m128i r0, r1;
+			if(to_interleaved)
 			{
-				ret = av_buffersrc_add_frame_flags(buffersrc_ctx, frame, AV_BUFFERSRC_FLAG_KEEP_REF);
-				if(ret < 0)
-					goto end;
+				r0 = _mm_loadu_si128((const __m128i*)((int64_t*)planes[g * 2 + 0] + i));
+				r1 = _mm_loadu_si128((const __m128i*)((int64_t*)planes[g * 2 + 1] + i));
 			}
-			
-			while (filtering)
+			else
 			{
-				ret = av_buffersink_get_frame(buffersink_ctx, filt_frame);
-				if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
-					break;
-				if (ret < 0)
-					goto end;
-				process_output_frame(data, filt_frame, filt_frame->nb_samples, av_ctx->channels, data_len, itemsize);
-				av_frame_unref(filt_frame);
+				r0 = _mm_loadu_si128((const __m128i*)packed);
+				r1 = _mm_loadu_si128((const __m128i*)(packed + num_channels));
+			}
+			__m128i lo = _mm_unpacklo_epi64(r0, r1), hi = _mm_unpackhi_epi64(r0, r1);
+			if(to_interleaved)
+			{
+				_mm_storeu_si128((__m128i*)packed, lo);
+				_mm_storeu_si128((__m128i*)(packed + num_channels), hi);
 			}
-			
-			if(!filtering)
+			else
 			{
-				process_output_frame(data, frame, frame->nb_samples, av_ctx->channels, data_len, itemsize);
+				_mm_storeu_si128((__m128i*)((int64_t*)planes[g * 2 + 0] + i), lo);
+				_mm_storeu_si128((__m128i*)((int64_t*)planes[g * 2 + 1] + i), hi);
 			}
-			//av_frame_unref(frame);
 		}
 	}
+	return i;
+}
 
-end:
-	if (ret == AVERROR(EAGAIN))
-		ret = 0;
-	
-	av_frame_free(&frame);
-	av_frame_free(&filt_frame);
-	return ret;
+// multichannel kernels by itemsize and the channel group they transpose
+static int (*transpose_simd[9])(uint8_t* interleaved, uint8_t** planes, int num_channels, int num_samples, bool to_interleaved) = { NULL, NULL, transpose4_sse2_16, NULL, transpose4_sse2_32, NULL, NULL, NULL, transpose2_sse2_64 };
+static const int transpose_group[9] = { 0, 0, 4, 0, 4, 0, 0, 0, 2 };
+
+static int (*interleave2_simd[9])(uint8_t* dst, uint8_t* const* src, int num_samples) = { NULL, interleave2_sse2_8, interleave2_sse2_16, NULL, interleave2_sse2_32, NULL, NULL, NULL, interleave2_sse2_64 };
+
+static void select_interleave_kernels()
+{
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2"))
+	{
+		interleave2_simd[1] = interleave2_avx2_8;
+		interleave2_simd[2] = interleave2_avx2_16;
+		interleave2_simd[4] = interleave2_avx2_32;
+		interleave2_simd[8] = interleave2_avx2_64;
+	}
+}
+#else
+static void select_interleave_kernels()
+{
+}
+#endif
+
+void interleave(uint8_t* dst, uint8_t* const* src, int num_channels, int num_samples, int itemsize)
+{
+	int done = 0;
+#if defined(__x86_64__) || defined(__i386__)
+	if(num_channels == 2)
+		done = interleave2_simd[itemsize](dst, src, num_samples);
+	else if(transpose_simd[itemsize] && num_channels >= transpose_group[itemsize])
+	{
+		// SIMD over whole channel groups and sample blocks, the scalar loops below fill leftover channels and samples
+		int group = transpose_group[itemsize];
+		done = transpose_simd[itemsize](dst, (uint8_t**)src, num_channels, num_samples, true);
+		uint8_t* tail_src[num_channels];
+		for (int c = 0; c < num_channels; c++)
+			tail_src[c] = src[c] + (size_t)done * itemsize;
+		interleave_scalar(dst + (size_t)done * itemsize * num_channels, tail_src, num_channels, 0, num_samples - done, itemsize);
+		interleave_scalar(dst, src, num_channels, num_channels / group * group, done, itemsize);
+		return;
+	}
+#endif
+	uint8_t* tail_src[num_channels];
+	for (int c = 0; c < num_channels; c++)
+		tail_src[c] = src[c] + (size_t)done * itemsize;
+	interleave_scalar(dst + (size_t)done * itemsize * num_channels, tail_src, num_channels, 0, num_samples - done, itemsize);
+}
+
+void deinterleave(uint8_t* const* dst, const uint8_t* src, int num_channels, int num_samples, int itemsize)
+{
+	int done = 0;
+#if defined(__x86_64__) || defined(__i386__)
+	if(num_channels == 2)
+		done = deinterleave2_sse2(dst, src, num_samples, itemsize);
+	else if(transpose_simd[itemsize] && num_channels >= transpose_group[itemsize])
+	{
+		int group = transpose_group[itemsize];
+		done = transpose_simd[itemsize]((uint8_t*)src, (uint8_t**)dst, num_channels, num_samples, false);
+		uint8_t* tail_dst[num_channels];
+		for (int c = 0; c < num_channels; c++)
+			tail_dst[c] = dst[c] + (size_t)done * itemsize;
+		deinterleave_scalar(tail_dst, src + (size_t)done * itemsize * num_channels, num_channels, 0, num_samples - done, itemsize);
+		deinterleave_scalar(dst, src, num_channels, num_channels / group * group, done, itemsize);
+		return;
+	}
+#endif
+	uint8_t* tail_dst[num_channels];
+	for (int c = 0; c < num_channels; c++)
+		tail_dst[c] = dst[c] + (size_t)done * itemsize;
+	deinterleave_scalar(tail_dst, src + (size_t)done * itemsize * num_channels, num_channels, 0, num_samples - done, itemsize);
+}
+
+// sample format conversion kernels between the packed formats of supported_sample_fmt_entries, used instead of a filter graph
+// when only the format changes; scaling follows libswresample (integers map to [-1, 1) floats, floats are rounded and clipped)
+
+typedef int16_t __attribute__((aligned(1), may_alias)) int16_t_unaligned;
+typedef int32_t __attribute__((aligned(1), may_alias)) int32_t_unaligned;
+typedef float __attribute__((aligned(1), may_alias)) float_unaligned;
+typedef double __attribute__((aligned(1), may_alias)) double_unaligned;
+
+#define DEFINE_CONVERT(name, src_type, dst_type, expr) \
+static void convert_##name(uint8_t* dst, const uint8_t* src, int count) \
+{ \
+	const src_type##_unaligned* s = (const src_type##_unaligned*)src; \
+	dst_type##_unaligned* d = (dst_type##_unaligned*)dst; \
+	for (int i = 0; i < count; i++) \
+	{ \
+		src_type x = s[i]; \
+		d[i] = expr; \
+	} \
+}
+DEFINE_CONVERT(u8_s16, uint8_t, int16_t, (x - 0x80) * (1 << 8))
+DEFINE_CONVERT(u8_s32, uint8_t, int32_t, (x - 0x80) * (1 << 24))
+DEFINE_CONVERT(u8_flt, uint8_t, float, (x - 0x80) * (1.0f / (1 << 7)))
+DEFINE_CONVERT(u8_dbl, uint8_t, double, (x - 0x80) * (1.0 / (1 << 7)))
+DEFINE_CONVERT(s16_u8, int16_t, uint8_t, (x >> 8) + 0x80)
+DEFINE_CONVERT(s16_s32, int16_t, int32_t, x * (1 << 16))
+DEFINE_CONVERT(s16_flt, int16_t, float, x * (1.0f / (1 << 15)))
+DEFINE_CONVERT(s16_dbl, int16_t, double, x * (1.0 / (1 << 15)))
+DEFINE_CONVERT(s32_u8, int32_t, uint8_t, (x >> 24) + 0x80)
+DEFINE_CONVERT(s32_s16, int32_t, int16_t, x >> 16)
+DEFINE_CONVERT(s32_flt, int32_t, float, x * (1.0f / (1U << 31)))
+DEFINE_CONVERT(s32_dbl, int32_t, double, x * (1.0 / (1U << 31)))
+// far out of range values are clamped before rounding, the int / int64 conversions would overflow before the integer clip sees them
+DEFINE_CONVERT(flt_u8, float, uint8_t, av_clip_uint8(lrintf(av_clipf(x * (1 << 7), -512.0f, 512.0f)) + 0x80))
+DEFINE_CONVERT(flt_s16, float, int16_t, av_clip_int16(lrintf(av_clipf(x * (1 << 15), -65536.0f, 65536.0f))))
+DEFINE_CONVERT(flt_s32, float, int32_t, av_clipl_int32(llrintf(av_clipf(x * (1U << 31), -4294967296.0f, 4294967296.0f))))
+DEFINE_CONVERT(flt_dbl, float, double, x)
+DEFINE_CONVERT(dbl_u8, double, uint8_t, av_clip_uint8(lrint(av_clipd(x * (1 << 7), -512.0, 512.0)) + 0x80))
+DEFINE_CONVERT(dbl_s16, double, int16_t, av_clip_int16(lrint(av_clipd(x * (1 << 15), -65536.0, 65536.0))))
+DEFINE_CONVERT(dbl_s32, double, int32_t, av_clipl_int32(llrint(av_clipd(x * (1U << 31), -4294967296.0, 4294967296.0))))
+DEFINE_CONVERT(dbl_flt, double, float, x)
+
+// normalize: float output is clamped to [-1, 1] in place right after it was written, integer input already converts into that range;
+// NaN becomes 1 like in minps / maxps
+#define DEFINE_CLAMP(name, type) \
+static void clamp_##name(uint8_t* data, int count) \
+{ \
+	type##_unaligned* d = (type##_unaligned*)data; \
+	for (int i = 0; i < count; i++) \
+	{ \
+		type x = d[i] < 1 ? d[i] : 1; \
+		d[i] = x > -1 ? x : -1; \
+	} \
+}
+DEFINE_CLAMP(flt, float)
+DEFINE_CLAMP(dbl, double)
+
+static void (*clamp_samples[AV_SAMPLE_FMT_DBL + 1])(uint8_t* data, int count) = { [AV_SAMPLE_FMT_FLT] = clamp_flt, [AV_SAMPLE_FMT_DBL] = clamp_dbl };
+
+// indexed by [input][output] packed sample format, identical formats are plain copies and have no entry
+static void (*convert_samples[AV_SAMPLE_FMT_DBL + 1][AV_SAMPLE_FMT_DBL + 1])(uint8_t* dst, const uint8_t* src, int count) =
+{
+	[AV_SAMPLE_FMT_U8]  = { [AV_SAMPLE_FMT_S16] = convert_u8_s16,  [AV_SAMPLE_FMT_S32] = convert_u8_s32,  [AV_SAMPLE_FMT_FLT] = convert_u8_flt,  [AV_SAMPLE_FMT_DBL] = convert_u8_dbl  },
+	[AV_SAMPLE_FMT_S16] = { [AV_SAMPLE_FMT_U8]  = convert_s16_u8,  [AV_SAMPLE_FMT_S32] = convert_s16_s32, [AV_SAMPLE_FMT_FLT] = convert_s16_flt, [AV_SAMPLE_FMT_DBL] = convert_s16_dbl },
+	[AV_SAMPLE_FMT_S32] = { [AV_SAMPLE_FMT_U8]  = convert_s32_u8,  [AV_SAMPLE_FMT_S16] = convert_s32_s16, [AV_SAMPLE_FMT_FLT] = convert_s32_flt, [AV_SAMPLE_FMT_DBL] = convert_s32_dbl },
+	[AV_SAMPLE_FMT_FLT] = { [AV_SAMPLE_FMT_U8]  = convert_flt_u8,  [AV_SAMPLE_FMT_S16] = convert_flt_s16, [AV_SAMPLE_FMT_S32] = convert_flt_s32, [AV_SAMPLE_FMT_DBL] = convert_flt_dbl },
+	[AV_SAMPLE_FMT_DBL] = { [AV_SAMPLE_FMT_U8]  = convert_dbl_u8,  [AV_SAMPLE_FMT_S16] = convert_dbl_s16, [AV_SAMPLE_FMT_S32] = convert_dbl_s32, [AV_SAMPLE_FMT_FLT] = convert_dbl_flt },
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+// SSE2 versions of the conversions decoders actually produce and models actually consume, the scalar kernels finish the tail
+static void convert_u8_flt_sse2(uint8_t* dst, const uint8_t* src, int count)
+{
+	int i = 0;
+	const __m128 scale = _mm_set1_ps(1.0f / (1 << 7));
+	const __m128i bias = _mm_set1_epi16(0x80), zero = _mm_setzero_si128();
+	for (; i + 16 <= count; i += 16)
+	{
+		__m128i x = _mm_loadu_si128((const __m128i*)(src + i));
+		__m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(x, zero), bias), hi = _mm_sub_epi16(_mm_unpackhi_epi8(x, zero), bias);
+		_mm_storeu_ps((float*)(dst + 4 * i),      _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(lo, lo), 16)), scale));
+		_mm_storeu_ps((float*)(dst + 4 * i + 16), _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(lo, lo), 16)), scale));
+		_mm_storeu_ps((float*)(dst + 4 * i + 32), _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(hi, hi), 16)), scale));
+		_mm_storeu_ps((float*)(dst + 4 * i + 48), _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(hi, hi), 16)), scale));
+	}
+	convert_u8_flt(dst + 4 * i, src + i, count - i);
+}
+
+static void convert_s16_flt_sse2(uint8_t* dst, const uint8_t* src, int count)
+{
+	int i = 0;
+	const __m128 scale = _mm_set1_ps(1.0f / (1 << 15));
+	for (; i + 8 <= count; i += 8)
+	{
+		__m128i x = _mm_loadu_si128((const __m128i*)(src + 2 * i));
+		_mm_storeu_ps((float*)(dst + 4 * i),      _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16)), scale));
+		_mm_storeu_ps((float*)(dst + 4 * i + 16), _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16)), scale));
+	}
+	convert_s16_flt(dst + 4 * i, src + 2 * i, count - i);
+}
+
+static void convert_s32_flt_sse2(uint8_t* dst, const uint8_t* src, int count)
+{
+	int i = 0;
+	const __m128 scale = _mm_set1_ps(1.0f / (1U << 31));
+	for (; i + 4 <= count; i += 4)
+		_mm_storeu_ps((float*)(dst + 4 * i), _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)(src + 4 * i))), scale));
+	convert_s32_flt(dst + 4 * i, src + 4 * i, count - i);
+}
+
+static void convert_flt_s16_sse2(uint8_t* dst, const uint8_t* src, int count)
+{
+	// cvtps2dq rounds to nearest like lrintf, packssdw clips; the upper bound is clamped first because overflow converts to INT32_MIN
+	int i = 0;
+	const __m128 scale = _mm_set1_ps(1 << 15), max = _mm_set1_ps(INT16_MAX);
+	for (; i + 8 <= count; i += 8)
+	{
+		__m128i lo = _mm_cvtps_epi32(_mm_min_ps(_mm_mul_ps(_mm_loadu_ps((const float*)(src + 4 * i)), scale), max));
+		__m128i hi = _mm_cvtps_epi32(_mm_min_ps(_mm_mul_ps(_mm_loadu_ps((const float*)(src + 4 * i + 16)), scale), max));
+		_mm_storeu_si128((__m128i*)(dst + 2 * i), _mm_packs_epi32(lo, hi));
+	}
+	convert_flt_s16(dst + 2 * i, src + 4 * i, count - i);
+}
+
+static void convert_flt_s32_sse2(uint8_t* dst, const uint8_t* src, int count)
+{
+	// values of 2^31 and above convert to INT32_MIN, flipping all bits of those lanes turns it into INT32_MAX
+	int i = 0;
+	const __m128 scale = _mm_set1_ps(1U << 31);
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128 x = _mm_mul_ps(_mm_loadu_ps((const float*)(src + 4 * i)), scale);
+		__m128i overflow = _mm_castps_si128(_mm_cmpge_ps(x, scale));
+		_mm_storeu_si128((__m128i*)(dst + 4 * i), _mm_xor_si128(_mm_cvtps_epi32(x), overflow));
+	}
+	convert_flt_s32(dst + 4 * i, src + 4 * i, count - i);
+}
+
+static void clamp_flt_sse2(uint8_t* data, int count)
+{
+	int i = 0;
+	const __m128 one = _mm_set1_ps(1), minus_one = _mm_set1_ps(-1);
+	for (; i + 4 <= count; i += 4)
+		_mm_storeu_ps((float*)(data + 4 * i), _mm_max_ps(_mm_min_ps(_mm_loadu_ps((const float*)(data + 4 * i)), one), minus_one));
+	clamp_flt(data + 4 * i, count - i);
+}
+
+static void clamp_dbl_sse2(uint8_t* data, int count)
+{
+	int i = 0;
+	const __m128d one = _mm_set1_pd(1), minus_one = _mm_set1_pd(-1);
+	for (; i + 2 <= count; i += 2)
+		_mm_storeu_pd((double*)(data + 8 * i), _mm_max_pd(_mm_min_pd(_mm_loadu_pd((const double*)(data + 8 * i)), one), minus_one));
+	clamp_dbl(data + 8 * i, count - i);
+}
+
+static void select_convert_kernels()
+{
+	clamp_samples[AV_SAMPLE_FMT_FLT] = clamp_flt_sse2;
+	clamp_samples[AV_SAMPLE_FMT_DBL] = clamp_dbl_sse2;
+	convert_samples[AV_SAMPLE_FMT_U8][AV_SAMPLE_FMT_FLT] = convert_u8_flt_sse2;
+	convert_samples[AV_SAMPLE_FMT_S16][AV_SAMPLE_FMT_FLT] = convert_s16_flt_sse2;
+	convert_samples[AV_SAMPLE_FMT_S32][AV_SAMPLE_FMT_FLT] = convert_s32_flt_sse2;
+	convert_samples[AV_SAMPLE_FMT_FLT][AV_SAMPLE_FMT_S16] = convert_flt_s16_sse2;
+	convert_samples[AV_SAMPLE_FMT_FLT][AV_SAMPLE_FMT_S32] = convert_flt_s32_sse2;
+}
+#else
+static void select_convert_kernels()
+{
+}
+#endif
+
+void process_output_frame(uint8_t** data, AVFrame* frame, int sample_offset, int num_samples, int num_channels, uint64_t* data_len, int itemsize, enum AVSampleFormat sample_fmt, uint64_t plane_stride, bool clamp)
+{
+	// plane_stride == 0 means interleaved [T, C] output, otherwise channels-first [C, T] output with plane_stride bytes between channel rows
+	// frames in another format than the packed output sample_fmt are converted on the way, clamp limits float output to [-1, 1]
+	uint64_t frame_stride = plane_stride ? itemsize : (uint64_t)itemsize * num_channels;
+	num_samples = FFMIN((uint64_t)num_samples, *data_len / frame_stride);
+	bool planar_in = num_channels > 1 && av_sample_fmt_is_planar(frame->format);
+	bool planar_out = num_channels > 1 && plane_stride > 0;
+	enum AVSampleFormat in_sample_fmt = av_get_packed_sample_fmt(frame->format);
+	int in_itemsize = av_get_bytes_per_sample(in_sample_fmt);
+
+	uint8_t* planes[FFMAX(1, num_channels)];
+	if(in_sample_fmt != sample_fmt)
+	{
+		void (*convert)(uint8_t* dst, const uint8_t* src, int count) = convert_samples[in_sample_fmt][sample_fmt];
+		const uint8_t* packed = frame->extended_data[0] + (uint64_t)in_itemsize * sample_offset * num_channels;
+		if(planar_in == planar_out)
+		{
+			// layouts match, convert straight into the output
+			for (int c = 0; c < (planar_in ? num_channels : 1); c++)
+				convert(*data + c * plane_stride, planar_in ? frame->extended_data[c] + (uint64_t)in_itemsize * sample_offset : packed, planar_in ? num_samples : num_samples * num_channels);
+		}
+		else
+		{
+			// layouts differ, convert a block that stays in L1 then (de)interleave it into the output
+			uint8_t block[16384];
+			int block_samples = FFMAX(1, (int)(sizeof(block) / (8 * num_channels)));
+			uint8_t* block_planes[num_channels];
+			for (int i = 0; i < num_samples; i += block_samples)
+			{
+				int n = FFMIN(block_samples, num_samples - i);
+				for (int c = 0; c < num_channels; c++)
+				{
+					block_planes[c] = block + (uint64_t)c * n * itemsize;
+					planes[c] = *data + c * plane_stride + (uint64_t)i * itemsize;
+				}
+				if(planar_in)
+				{
+					for (int c = 0; c < num_channels; c++)
+						convert(block_planes[c], frame->extended_data[c] + (uint64_t)in_itemsize * (sample_offset + i), n);
+					interleave(*data + (uint64_t)i * frame_stride, block_planes, num_channels, n, itemsize);
+				}
+				else
+				{
+					convert(block, packed + (uint64_t)in_itemsize * i * num_channels, n * num_channels);
+					deinterleave(planes, block, num_channels, n, itemsize);
+				}
+			}
+		}
+	}
+	else if(planar_in && planar_out)
+	{
+		for (int c = 0; c < num_channels; c++)
+			memcpy(*data + c * plane_stride, frame->extended_data[c] + (uint64_t)itemsize * sample_offset, (uint64_t)itemsize * num_samples);
+	}
+	else if(planar_in)
+	{
+		for (int c = 0; c < num_channels; c++)
+			planes[c] = frame->extended_data[c] + (uint64_t)itemsize * sample_offset;
+		interleave(*data, planes, num_channels, num_samples, itemsize);
+	}
+	else if(planar_out)
+	{
+		for (int c = 0; c < num_channels; c++)
+			planes[c] = *data + c * plane_stride;
+		deinterleave(planes, frame->extended_data[0] + (uint64_t)itemsize * sample_offset * num_channels, num_channels, num_samples, itemsize);
+	}
+	else
+		memcpy(*data, frame->extended_data[0] + (uint64_t)itemsize * sample_offset * num_channels, num_samples * frame_stride);
+
+	if(clamp && clamp_samples[sample_fmt] && (in_sample_fmt == AV_SAMPLE_FMT_FLT || in_sample_fmt == AV_SAMPLE_FMT_DBL))
+		for (int c = 0; c < (planar_out ? num_channels : 1); c++)
+			clamp_samples[sample_fmt](*data + c * plane_stride, planar_out ? num_samples : num_samples * num_channels);
+
+	*data += num_samples * frame_stride;
+	*data_len -= num_samples * frame_stride;
 }
 
 struct buffer_cursor
@@ -151,8 +981,15 @@ static int buffer_read(void *opaque, uint8_t *buf, int buf_size)
 static int64_t buffer_seek(void* opaque, int64_t offset, int whence)
 {
     struct buffer_cursor *cursor = (struct buffer_cursor *)opaque;
+	whence &= ~AVSEEK_FORCE;
 	if(whence == AVSEEK_SIZE)
 		return cursor->size;
+	if(whence == SEEK_CUR)
+		offset += cursor->ptr - cursor->base;
+	else if(whence == SEEK_END)
+		offset += cursor->size;
+	if(offset < 0 || offset > cursor->size)
+		return AVERROR(EINVAL);
 
 	cursor->ptr = cursor->base + offset;
 	cursor->left = cursor->size - offset;
@@ -168,311 +1005,4775 @@ size_t nbytes(struct DecodeAudio* audio)
 	return size * itemsize;
 }
 
-struct DecodeAudio decode_audio(const char* input_path, struct DecodeAudio input_options, struct DecodeAudio output_options, const char* filter_string, int probe, int verbose)
+static bool member_range(struct DecodeAudio* input_options, size_t file_size, uint8_t** buf, size_t* size)
 {
-	av_log_set_level(verbose ? AV_LOG_DEBUG : AV_LOG_FATAL);
+	// narrows a mapped file to the member selected by the input options, false if the range is outside the file
+	if(input_options->member_offset > file_size || input_options->member_size > file_size - input_options->member_offset)
+		return false;
+	*buf += input_options->member_offset;
+	*size = input_options->member_size > 0 ? input_options->member_size : file_size - input_options->member_offset;
+	return true;
+}
+
+static void advise_range(void* addr, size_t offset, size_t size, int advice)
+{
+	// madvise wants a page-aligned start
+	size_t page_size = sysconf(_SC_PAGESIZE), begin = offset & ~(page_size - 1);
+	madvise((uint8_t*)addr + begin, offset + size - begin, advice);
+}
+
+void init_tensor(struct DecodeAudio* audio, DLDataType dtype, int channels_first)
+{
+	// contiguous [T, C] or [C, T] over num_samples x num_channels
+	audio->channels_first = channels_first;
+	audio->itemsize = dtype.lanes * dtype.bits / 8;
+	audio->data.dl_tensor.ctx.device_type = kDLCPU;
+	audio->data.dl_tensor.ndim = 2;
+	audio->data.dl_tensor.dtype = dtype;
+	audio->data.dl_tensor.shape = malloc(audio->data.dl_tensor.ndim * sizeof(int64_t));
+	audio->data.dl_tensor.shape[channels_first ? 1 : 0] = audio->num_samples;
+	audio->data.dl_tensor.shape[channels_first ? 0 : 1] = audio->num_channels;
+	audio->data.dl_tensor.strides = malloc(audio->data.dl_tensor.ndim * sizeof(int64_t));
+	audio->data.dl_tensor.strides[0] = audio->data.dl_tensor.shape[1];
+	audio->data.dl_tensor.strides[1] = 1;
+}
+
+void* alloc_output(struct DecodeAudio* audio, struct DecodeAudioAllocator* allocator, size_t size)
+{
+	// not zero-filled, callers write every sample the shape exposes and pad explicitly
+	size = FFMAX(1, size);
+	if(allocator)
+	{
+		audio->data.dl_tensor.data = allocator->alloc(allocator->ctx, size);
+		audio->data.manager_ctx = allocator;
+		audio->data.deleter = deleter_allocator;
+	}
+	else
+	{
+		audio->data.dl_tensor.data = malloc(size);
+		audio->data.deleter = deleter;
+	}
+	return audio->data.dl_tensor.data;
+}
+
+static void release_failed_output(struct DecodeAudio* audio)
+{
+	// a decode that failed after init_tensor hands back only its error, shape and strides are freed even before a deleter was set
+	if(audio->data.deleter)
+		audio->data.deleter(&audio->data);
+	else
+	{
+		free(audio->data.dl_tensor.shape);
+		free(audio->data.dl_tensor.strides);
+	}
+	audio->data.deleter = NULL;
+	audio->data.manager_ctx = NULL;
+	audio->data.dl_tensor.data = NULL;
+	audio->data.dl_tensor.shape = audio->data.dl_tensor.strides = NULL;
+}
+
+// caller-owned output slots (e.g. row b of a preallocated [B, T_max, C] batch): decoded samples go straight into the slot when it holds interleaved
+// or channel rows, any other strides go through a compact scratch; the tail past the decoded length is padded and the length reported
+
+struct output_slot
+{
+	uint8_t* base;
+	int64_t capacity;
+	int64_t time_stride;
+	int64_t channel_stride;
+	bool direct;
+};
+
+static bool output_slot(struct DecodeAudio* output_options, struct DecodeAudio* audio, struct output_slot* slot)
+{
+	// a flat buffer (ndim 1, as always), or [T_max, C] ([C, T_max] channels-first) of the output dtype with any strides (in elements) and byte_offset
+	DLTensor* dst = &output_options->data.dl_tensor;
+	int64_t itemsize = audio->itemsize, num_channels = audio->num_channels;
+	slot->base = (uint8_t*)dst->data + dst->byte_offset;
+	if(dst->ndim == 1)
+	{
+		slot->capacity = nbytes(output_options) / (itemsize * num_channels);
+		slot->time_stride = audio->channels_first ? itemsize : itemsize * num_channels;
+		slot->channel_stride = audio->channels_first ? slot->capacity * itemsize : itemsize;
+		slot->direct = true;
+		return true;
+	}
+
+	int t = audio->channels_first ? 1 : 0, c = 1 - t;
+	DLDataType dtype = audio->data.dl_tensor.dtype;
+	if(dst->ndim != 2 || dst->dtype.code != dtype.code || dst->dtype.bits != dtype.bits || dst->dtype.lanes != 1 || dst->shape[c] != num_channels)
+	{
+		snprintf(audio->error, sizeof(audio->error), "Output tensor must be %s of %s with %d channels", audio->channels_first ? "[C, T]" : "[T, C]", audio->fmt, (int)num_channels);
+		return false;
+	}
+	slot->capacity = dst->shape[t];
+	slot->time_stride = (dst->strides ? dst->strides[t] : t == 0 ? dst->shape[1] : 1) * itemsize;
+	slot->channel_stride = (dst->strides ? dst->strides[c] : c == 0 ? dst->shape[1] : 1) * itemsize;
+	if(audio->channels_first)
+		slot->direct = slot->time_stride == itemsize;
+	else
+		slot->direct = slot->time_stride == itemsize * num_channels && (num_channels == 1 || slot->channel_stride == itemsize);
+	return true;
+}
+
+static void copy_to_slot(struct output_slot* slot, const uint8_t* src, int64_t num_samples, int num_channels, int itemsize, uint64_t src_plane_stride)
+{
+	// compact interleaved samples (or channel rows src_plane_stride bytes apart) into the strided slot
+	for (int c = 0; c < num_channels; c++)
+	{
+		uint8_t* dst = slot->base + c * slot->channel_stride;
+		const uint8_t* s = src + (src_plane_stride ? c * src_plane_stride : (uint64_t)c * itemsize);
+		int64_t s_stride = src_plane_stride ? itemsize : num_channels * itemsize;
+		for (int64_t t = 0; t < num_samples; t++, dst += slot->time_stride, s += s_stride)
+			memcpy(dst, s, itemsize);
+	}
+}
+
+static void pad_slot(struct output_slot* slot, int64_t num_samples, int num_channels, DLDataType dtype, double pad_value)
+{
+	// pad_value is a raw sample of the output dtype (128 is silence for u8)
+	int itemsize = dtype.bits / 8;
+	uint8_t item[8] = { 0 };
+	if(dtype.code == kDLFloat && itemsize == 4)
+		*(float*)item = (float)pad_value;
+	else if(dtype.code == kDLFloat)
+		*(double*)item = pad_value;
+	else if(itemsize == 1)
+		item[0] = (uint8_t)pad_value;
+	else if(itemsize == 2)
+		*(int16_t*)item = (int16_t)pad_value;
+	else
+		*(int32_t*)item = (int32_t)pad_value;
+	bool zero = pad_value == 0 && !signbit(pad_value);
+
+	int64_t pad = slot->capacity - num_samples;
+	if(pad <= 0)
+		return;
+	if(zero && slot->time_stride == (int64_t)itemsize * num_channels && (num_channels == 1 || slot->channel_stride == itemsize))
+	{
+		memset(slot->base + num_samples * slot->time_stride, 0, pad * slot->time_stride);
+		return;
+	}
+	for (int c = 0; c < num_channels; c++)
+	{
+		uint8_t* dst = slot->base + c * slot->channel_stride + num_samples * slot->time_stride;
+		if(zero && slot->time_stride == itemsize)
+		{
+			memset(dst, 0, pad * itemsize);
+			continue;
+		}
+		for (int64_t t = 0; t < pad; t++, dst += slot->time_stride)
+			memcpy(dst, item, itemsize);
+	}
+}
+
+struct parallel_for_state
+{
+	void (*fn)(void* opaque, int i);
+	void* opaque;
+	int num_tasks;
+	int next;
+};
+
+static void* parallel_for_worker(void* arg)
+{
+	struct parallel_for_state* state = (struct parallel_for_state*)arg;
+	for(int i; (i = __atomic_fetch_add(&state->next, 1, __ATOMIC_RELAXED)) < state->num_tasks;)
+		state->fn(state->opaque, i);
+	return NULL;
+}
+
+void parallel_for(int num_tasks, int num_threads, void (*fn)(void* opaque, int i), void* opaque)
+{
+	// tasks are handed out one by one from a shared counter, the calling thread participates as well
+	if(num_threads <= 0)
+		num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	num_threads = FFMAX(1, FFMIN(num_threads, num_tasks));
 	
-	clock_t tic = clock();
+	struct parallel_for_state state = { fn, opaque, num_tasks, 0 };
+	pthread_t threads[num_threads];
+	int num_started = 0;
+	for(; num_started < num_threads - 1; num_started++)
+		if(pthread_create(&threads[num_started], NULL, parallel_for_worker, &state) != 0)
+			break;
+	parallel_for_worker(&state);
+	for(int t = 0; t < num_started; t++)
+		pthread_join(threads[t], NULL);
+}
 
-	struct DecodeAudio audio = { 0 };
+struct decode_pipeline;
+static void pipeline_destroy(struct decode_pipeline* pipeline);
+
+// seek index sidecar (<input>.seekidx): byte offsets and first input samples of packets at least a tenth of a second apart, written by one demux-only scan;
+// seeks binary search it and byte-seek to a packet whose first sample is known exactly, instead of VBR / non-indexed container seeking
+
+struct seek_index_header
+{
+	char magic[8];
+	int64_t size;
+	int64_t mtime_ns;
+	int64_t stream_index;
+	int64_t sample_rate;
+	// input samples decoded before a target to prime the decoder, and the scanned length
+	int64_t preroll;
+	int64_t num_samples;
+	uint64_t num_entries;
+};
+
+struct seek_index_entry
+{
+	int64_t pos;
+	int64_t sample;
+};
+
+static const char seek_index_magic[8] = "DASEEK1";
+
+struct seek_index
+{
+	struct mmap_ctx mapping;
+	struct seek_index_header* header;
+	struct seek_index_entry* entries;
+};
+
+static void seek_index_path(const char* input_path, char* path, size_t path_size)
+{
+	snprintf(path, path_size, "%s.seekidx", input_path);
+}
+
+static bool open_seek_index(const char* input_path, int stream_index, int sample_rate, struct seek_index* index)
+{
+	// only a sidecar written for this very file (size and mtime) and stream is used
+	memset(index, 0, sizeof(struct seek_index));
+	char path[4096];
+	struct stat st;
+	seek_index_path(input_path, path, sizeof(path));
+	if(stat(input_path, &st) != 0 || !map_file(path, PROT_READ, MAP_SHARED, &index->mapping))
+		return false;
+
+	struct seek_index_header* header = index->mapping.addr;
+	if(index->mapping.length < sizeof(struct seek_index_header) || memcmp(header->magic, seek_index_magic, sizeof(seek_index_magic)) != 0
+		|| (index->mapping.length - sizeof(struct seek_index_header)) % sizeof(struct seek_index_entry) != 0
+		|| header->num_entries == 0 || header->num_entries != (index->mapping.length - sizeof(struct seek_index_header)) / sizeof(struct seek_index_entry)
+		|| header->size != st.st_size || header->mtime_ns != (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec
+		|| header->stream_index != stream_index || header->sample_rate != sample_rate)
+	{
+		munmap(index->mapping.addr, index->mapping.length);
+		memset(index, 0, sizeof(struct seek_index));
+		return false;
+	}
+	index->header = header;
+	index->entries = (struct seek_index_entry*)(header + 1);
+	return true;
+}
+
+static void close_seek_index(struct seek_index* index)
+{
+	if(index->mapping.length > 0)
+		munmap(index->mapping.addr, index->mapping.length);
+	memset(index, 0, sizeof(struct seek_index));
+}
+
+static const struct seek_index_entry* find_seek_index_entry(const struct seek_index* index, int64_t sample)
+{
+	// the last entry starting at or before sample, the first one if none does
+	uint64_t lo = 1, hi = index->header->num_entries;
+	while (lo < hi)
+	{
+		uint64_t mid = lo + (hi - lo) / 2;
+		if(index->entries[mid].sample <= sample)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return &index->entries[lo - 1];
+}
+
+struct DecodeAudioSession
+{
+	struct DecodeAudio output_options;
+	char filter_string[513];
+	int verbose;
+
+	// AVIO buffer outlives the per-file AVIOContext, path inputs are read through an mmap with the same cursor
+	uint8_t* avio_ctx_buffer;
+	int avio_ctx_buffer_size;
+	struct buffer_cursor cursor;
+	struct mmap_ctx mapping;
+	// set by callers that only decode windows of the input (crops, segments), the mapping is then not read ahead as a whole
+	bool windowed;
+	// push decoding: bytes come from this callback instead of a path or buffer, the input is not seekable and its container is probed
+	int (*read_input)(void* opaque, uint8_t* buf, int buf_size);
+	void* read_input_opaque;
+
+	// decoder is kept open while consecutive files have identical codec parameters
+	AVCodecParameters* codecpar;
+	AVCodecContext* dec_ctx;
+
+	// graph exists only for a user filter or a sample rate change, it is stateful and rebuilt for every input
+	AVFilterGraph* graph;
+	AVFilterContext* buffersrc_ctx;
+	AVFilterContext* buffersink_ctx;
+	int64_t next_pts;
+
+	// resampler for jobs without a user filter, kept while rates, formats and layout are unchanged and only reset between inputs
+	struct SwrContext* swr;
+	char swr_key[256];
+	bool resample;
+
+	// current input, alive between session_open_input and session_close_input
+	AVFormatContext* fmt_ctx;
+	AVIOContext* io_ctx;
+	int stream_index;
+	// fmt_ctx is borrowed from the session that opened the container (multi-stream decoding), it is not seeked or closed by this one
+	bool shared_input;
+	bool eof;
+	enum AVSampleFormat out_sample_fmt;
+
+	// when set, decoded samples are queued here instead of being written to the output buffer (streaming mode)
+	AVAudioFifo* fifo;
+	uint8_t* fifo_scratch;
+	unsigned int fifo_scratch_size;
+
+	// time range selection: output samples still to drop after the seek and still to emit (negative means unbounded)
+	bool seek_pending;
+	// set when the first frame after a seek starts past the target, the gap cannot be filled
+	bool seek_gap;
+	int64_t seek_target;
+	// input sample the first frame after an indexed byte seek starts at (negative when timestamps tell), the index is mapped on the first seek
+	int64_t seek_origin;
+	// set when the first frame after an indexed seek disagreed with the index, the index is dropped and the seek is worth redoing by timestamp
+	bool seek_index_mismatch;
+	const char* seek_index_input;
+	bool seek_index_checked;
+	struct seek_index seek_index;
+	int64_t skip_samples;
+	int64_t max_samples;
+
+	// bytes between channel rows of a channels-first [C, T] output, 0 for interleaved [T, C]
+	uint64_t plane_stride;
+	bool streaming;
+
+	// packet and frames of the serial loop, reused for every packet and input
+	AVPacket* pkt;
+	AVFrame* frame;
+	AVFrame* filt_frame;
+	// rings and packet / frame pools of the pipelined loop, created on first use
+	struct decode_pipeline* pipeline;
+
+	// counters of the current input, stage times only with the profile option
+	struct DecodeAudioStats stats;
+	struct stage_timer timer;
+};
+
+static void output_frame(struct DecodeAudioSession* session, AVFrame* frame, uint8_t** data, uint64_t* data_len, int itemsize)
+{
+	int num_channels = session->dec_ctx->channels;
+	int sample_offset = FFMIN(session->skip_samples, frame->nb_samples);
+	int num_samples = frame->nb_samples - sample_offset;
+	session->skip_samples -= sample_offset;
+	if(session->max_samples >= 0)
+	{
+		num_samples = FFMIN(num_samples, session->max_samples);
+		session->max_samples -= num_samples;
+	}
+	if(num_samples <= 0)
+		return;
+
+	if(!session->fifo)
+	{
+		uint64_t len = *data_len;
+		process_output_frame(data, frame, sample_offset, num_samples, num_channels, data_len, itemsize, session->out_sample_fmt, session->plane_stride, session->output_options.normalize);
+		session->stats.bytes_out += (len - *data_len) * (session->plane_stride ? num_channels : 1);
+		return;
+	}
+	session->stats.bytes_out += (uint64_t)num_samples * num_channels * itemsize;
+
+	uint8_t* packed = frame->data[0] + (uint64_t)itemsize * sample_offset * num_channels;
+	if((num_channels > 1 && av_sample_fmt_is_planar(frame->format)) || av_get_packed_sample_fmt(frame->format) != session->out_sample_fmt || session->output_options.normalize)
+	{
+		uint64_t len = (uint64_t)num_samples * num_channels * itemsize;
+		av_fast_malloc(&session->fifo_scratch, &session->fifo_scratch_size, len);
+		packed = session->fifo_scratch;
+		process_output_frame(&packed, frame, sample_offset, num_samples, num_channels, &len, itemsize, session->out_sample_fmt, 0, session->output_options.normalize);
+		packed = session->fifo_scratch;
+	}
+	av_audio_fifo_write(session->fifo, (void**)&packed, num_samples);
+}
+
+static void resample_frame(struct DecodeAudioSession* session, AVFrame* frame, uint8_t** data, uint64_t* data_len, int itemsize)
+{
+	// converts straight into the output (or the FIFO scratch when streaming), frame == NULL drains the resampler delay
+	int num_channels = session->dec_ctx->channels;
+	if(session->skip_samples > 0)
+	{
+		swr_drop_output(session->swr, session->skip_samples);
+		session->skip_samples = 0;
+	}
+
+	uint64_t plane_stride = session->fifo ? 0 : session->plane_stride;
+	uint64_t frame_stride = plane_stride ? itemsize : (uint64_t)itemsize * num_channels;
+	do
+	{
+		int64_t out_count = swr_get_out_samples(session->swr, frame ? frame->nb_samples : 0);
+		if(session->max_samples >= 0)
+			out_count = FFMIN(out_count, session->max_samples);
+		if(session->fifo)
+			av_fast_malloc(&session->fifo_scratch, &session->fifo_scratch_size, FFMAX(1, out_count * frame_stride));
+		else
+			out_count = FFMIN(out_count, *data_len / frame_stride);
+
+		uint8_t* out[FFMAX(1, num_channels)];
+		uint8_t* base = session->fifo ? session->fifo_scratch : *data;
+		for (int c = 0; c < num_channels; c++)
+			out[c] = base + c * plane_stride;
+		int n = swr_convert(session->swr, out, (int)out_count, frame ? (const uint8_t**)frame->extended_data : NULL, frame ? frame->nb_samples : 0);
+		if(n <= 0)
+			return;
+		if(session->max_samples >= 0)
+			session->max_samples -= n;
+		session->stats.bytes_out += (uint64_t)n * num_channels * itemsize;
+		// interpolation overshoots even for integer input
+		if(session->output_options.normalize)
+			for (int c = 0; c < (plane_stride ? num_channels : 1); c++)
+				clamp_samples[session->out_sample_fmt](out[c], plane_stride ? n : n * num_channels);
+
+		if(session->fifo)
+			av_audio_fifo_write(session->fifo, (void**)out, n);
+		else
+		{
+			*data += n * frame_stride;
+			*data_len -= n * frame_stride;
+		}
+	}
+	while (frame == NULL);
+}
+
+static int process_frame(struct DecodeAudioSession* session, AVFrame* frame, uint8_t** data, uint64_t* data_len, int itemsize, struct stage_timer* timer)
+{
+	// everything after the decoder: seek trimming, filter graph or resampler, copy-out; frame == NULL flushes the resampler / graph at the end of the input
+	AVCodecContext* av_ctx = session->dec_ctx;
+	AVFilterContext* buffersrc_ctx = session->buffersrc_ctx;
+	AVFilterContext* buffersink_ctx = session->buffersink_ctx;
+	AVFrame *filt_frame = session->filt_frame;
+	struct DecodeAudioStats* stats = &session->stats;
+	int filtering = buffersrc_ctx != NULL && buffersink_ctx != NULL;
+	int ret = 0;
+
+	if(frame == NULL)
+	{
+		if (session->resample)
+		{
+			resample_frame(session, NULL, data, data_len, itemsize);
+			stage_end(stats, STAGE_FILTER, timer);
+		}
+		if (filtering)
+		{
+			// decoder is drained, push EOF through the graph to flush resampler delay, graph cannot be fed after that
+			ret = av_buffersrc_add_frame_flags(buffersrc_ctx, NULL, 0);
+			while (ret >= 0)
+			{
+				ret = av_buffersink_get_frame(buffersink_ctx, filt_frame);
+				stage_end(stats, STAGE_FILTER, timer);
+				if (ret < 0)
+					break;
+				output_frame(session, filt_frame, data, data_len, itemsize);
+				stage_end(stats, STAGE_COPY_OUT, timer);
+				av_frame_unref(filt_frame);
+			}
+		}
+		return ret == AVERROR_EOF ? 0 : ret;
+	}
+
+	if(session->seek_pending)
+	{
+		// the demuxer lands at or before the requested time, the remainder is trimmed sample-exactly
+		AVStream* stream = session->fmt_ctx->streams[session->stream_index];
+		int64_t ts = frame->best_effort_timestamp != AV_NOPTS_VALUE ? frame->best_effort_timestamp : frame->pts;
+		int64_t start_time = stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+		int64_t ts_pos = ts != AV_NOPTS_VALUE ? av_rescale_q(ts - start_time, stream->time_base, (AVRational){1, av_ctx->sample_rate}) : AV_NOPTS_VALUE;
+		if(session->seek_origin >= 0 && ts_pos != AV_NOPTS_VALUE && ts_pos != session->seek_origin)
+		{
+			// the demuxer disagrees with the seek index (stale or built from a packet in the middle of a page): the timestamp wins and later seeks
+			// of this input are timestamp seeks
+			close_seek_index(&session->seek_index);
+			session->seek_origin = -1;
+			session->seek_index_mismatch = true;
+		}
+		int64_t pos = session->seek_origin >= 0 ? session->seek_origin : ts_pos != AV_NOPTS_VALUE ? ts_pos : session->seek_target;
+		session->skip_samples = FFMAX(0, av_rescale(session->seek_target - pos, session->output_options.sample_rate > 0 ? session->output_options.sample_rate : av_ctx->sample_rate, av_ctx->sample_rate));
+		session->seek_gap = pos > session->seek_target;
+		session->seek_pending = false;
+	}
+
+	if(filtering)
+	{
+		// timestamps are renumbered from zero in the 1/sample_rate time base of the graph source, seeks and start offsets do not matter
+		frame->pts = session->next_pts;
+		session->next_pts += frame->nb_samples;
+		ret = av_buffersrc_add_frame_flags(buffersrc_ctx, frame, AV_BUFFERSRC_FLAG_KEEP_REF);
+		stage_end(stats, STAGE_FILTER, timer);
+		if(ret < 0)
+			return ret;
+	}
+
+	while (filtering)
+	{
+		ret = av_buffersink_get_frame(buffersink_ctx, filt_frame);
+		stage_end(stats, STAGE_FILTER, timer);
+		if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+			return 0;
+		if (ret < 0)
+			return ret;
+		output_frame(session, filt_frame, data, data_len, itemsize);
+		stage_end(stats, STAGE_COPY_OUT, timer);
+		av_frame_unref(filt_frame);
+	}
+
+	if(session->resample)
+	{
+		// swr_convert writes the output itself, it is all charged to filtering
+		resample_frame(session, frame, data, data_len, itemsize);
+		stage_end(stats, STAGE_FILTER, timer);
+	}
+	else
+	{
+		output_frame(session, frame, data, data_len, itemsize);
+		stage_end(stats, STAGE_COPY_OUT, timer);
+	}
+	return 0;
+}
+
+int decode_packet(struct DecodeAudioSession* session, AVPacket *pkt, uint8_t** data, uint64_t* data_len, int itemsize)
+{
+	AVCodecContext* av_ctx = session->dec_ctx;
+	AVFrame *frame = session->frame;
+	struct DecodeAudioStats* stats = &session->stats;
+	struct stage_timer* timer = &session->timer;
+
+	int ret = avcodec_send_packet(av_ctx, pkt);
+	if(pkt->data)
+	{
+		stats->num_packets++;
+		stats->bytes_in += pkt->size;
+	}
+	stage_end(stats, STAGE_DECODE, timer);
+
+	while (ret >= 0)
+	{
+		ret = avcodec_receive_frame(av_ctx, frame);
+		stage_end(stats, STAGE_DECODE, timer);
+		if (ret == 0)
+		{
+			stats->num_frames++;
+			ret = process_frame(session, frame, data, data_len, itemsize, timer);
+		}
+	}
+
+	if (ret == AVERROR_EOF)
+		ret = process_frame(session, NULL, data, data_len, itemsize, timer);
+
+	if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+		ret = 0;
+	return ret;
+}
+
+static bool same_codec_parameters(AVCodecParameters* a, AVCodecParameters* b)
+{
+	return a->codec_id == b->codec_id && a->format == b->format && a->sample_rate == b->sample_rate && a->channels == b->channels && a->channel_layout == b->channel_layout && a->bits_per_coded_sample == b->bits_per_coded_sample && a->block_align == b->block_align && a->extradata_size == b->extradata_size && (a->extradata_size == 0 || memcmp(a->extradata, b->extradata, a->extradata_size) == 0);
+}
+
+static int open_decoder(struct DecodeAudioSession* session, AVCodecParameters* codecpar, char* error)
+{
+	if(session->dec_ctx && same_codec_parameters(session->codecpar, codecpar))
+	{
+		// the decoder was drained at the end of the previous file, resetting it is enough
+		avcodec_flush_buffers(session->dec_ctx);
+		return 0;
+	}
+
+	avcodec_free_context(&session->dec_ctx);
+
+	AVCodec *codec = avcodec_find_decoder(codecpar->codec_id);
+	if (!codec)
+	{
+		strcpy(error, "Codec not found");
+		return -1;
+	}
+
+	session->dec_ctx = avcodec_alloc_context3(codec);
+	if (!session->dec_ctx)
+	{
+		strcpy(error, "Cannot allocate audio codec context");
+		return -1;
+	}
+
+	if (avcodec_parameters_to_context(session->dec_ctx, codecpar) < 0)
+	{
+		strcpy(error, "Failed to copy audio codec parameters to decoder context");
+		goto fail;
+	}
+
+	// among audio decoders only a few (FLAC, ALAC, WavPack) do frame threading, the others ignore it; negative means one thread per core
+	if(session->output_options.decoder_threads != 0)
+		session->dec_ctx->thread_count = FFMAX(0, session->output_options.decoder_threads);
+	if(session->output_options.decoder_thread_type != 0)
+		session->dec_ctx->thread_type = session->output_options.decoder_thread_type;
+
+	if (avcodec_open2(session->dec_ctx, codec, NULL) < 0)
+	{
+		strcpy(error, "Cannot open codec");
+		goto fail;
+	}
+
+	if (avcodec_parameters_copy(session->codecpar, codecpar) < 0)
+	{
+		strcpy(error, "Cannot copy codec parameters");
+		goto fail;
+	}
+	return 0;
+
+fail:
+	avcodec_free_context(&session->dec_ctx);
+	return -1;
+}
+
+static int configure_graph(struct DecodeAudioSession* session, int in_sample_rate, enum AVSampleFormat in_sample_fmt, uint64_t channel_layout, int out_sample_rate, enum AVSampleFormat out_sample_fmt, char* error)
+{
+	const char* filter_string = session->filter_string;
+	char buffersrc_args[256], filter_args[1024 + 512];
+	bool need_filter = strlen(filter_string) > 0;
+	bool need_resample = out_sample_rate != in_sample_rate;
+	avfilter_graph_free(&session->graph);
+	session->buffersrc_ctx = session->buffersink_ctx = NULL;
+	if(!need_filter && !need_resample)
+	{
+		// sample format conversion alone is done by process_output_frame
+		return 0;
+	}
+
+	// frame timestamps are renumbered in decode_packet, so the source runs in 1/sample_rate
+	sprintf(buffersrc_args, "sample_rate=%d:sample_fmt=%s:channel_layout=0x%"PRIx64":time_base=%d/%d", in_sample_rate, av_get_sample_fmt_name(in_sample_fmt), channel_layout, 1, in_sample_rate);
+
+	const char* out_sample_fmt_name = av_get_sample_fmt_name(out_sample_fmt);
+	if(need_resample)
+	{
+		sprintf(filter_args, "%s%saresample=out_sample_rate=%d:out_sample_fmt=%s,aformat=sample_rates=%d:sample_fmts=%s:channel_layouts=0x%"PRIx64, need_filter ? filter_string : "", need_filter ? "," : "", out_sample_rate, out_sample_fmt_name, out_sample_rate, out_sample_fmt_name, channel_layout);
+	}
+	else
+	{
+		sprintf(filter_args, "%s%saformat=sample_rates=%d:sample_fmts=%s:channel_layouts=0x%"PRIx64, need_filter ? filter_string : "", need_filter ? "," : "", out_sample_rate, out_sample_fmt_name, channel_layout);
+	}
+
+	session->next_pts = 0;
 
-	AVIOContext* io_ctx = NULL;
-	AVFormatContext* fmt_ctx = avformat_alloc_context();
-	AVCodecContext* dec_ctx = NULL;
-	AVPacket* pkt = NULL;
-	char filter_args[1024];
-	AVFilterGraph *graph = NULL;
 	AVFilterInOut *gis = avfilter_inout_alloc();
     AVFilterInOut *gos = avfilter_inout_alloc();
-	AVFilterContext *buffersrc_ctx = NULL;
-    AVFilterContext *buffersink_ctx = NULL;
 	AVFilter *buffersrc  = avfilter_get_by_name("abuffer");
     AVFilter *buffersink = avfilter_get_by_name("abuffersink");
 	assert(buffersrc != NULL && buffersink != NULL);
-	uint8_t* avio_ctx_buffer = NULL;
-    struct buffer_cursor cursor = { 0 };
-	int buffer_multiple = 1;
-	
-	if(filter_string != NULL && strlen(filter_string) > 512)
+	int ret = -1;
+
+	session->graph = avfilter_graph_alloc();
+	if(!session->graph)
 	{
-		strcpy(audio.error, "Too long filter string");
+		strcpy(error, "Cannot allocate filter graph");
+		goto end;
+	}
+
+	if (avfilter_graph_create_filter(&session->buffersrc_ctx, buffersrc, "in", buffersrc_args, NULL, session->graph) < 0)
+	{
+		strcpy(error, "Cannot create buffer source");
+		goto end;
+	}
+	if (avfilter_graph_create_filter(&session->buffersink_ctx, buffersink, "out", NULL, NULL, session->graph) < 0)
+	{
+		strcpy(error, "Cannot create buffer sink");
+		goto end;
+	}
+	const enum AVSampleFormat out_sample_fmts[] = { out_sample_fmt, -1 };
+	if (av_opt_set_int_list(session->buffersink_ctx, "sample_fmts", out_sample_fmts, -1, AV_OPT_SEARCH_CHILDREN) < 0)
+	{
+		strcpy(error, "Cannot set output sample format");
+		goto end;
+	}
+	const int64_t out_channel_layouts[] = { channel_layout , -1 };
+	if (av_opt_set_int_list(session->buffersink_ctx, "channel_layouts", out_channel_layouts, -1, AV_OPT_SEARCH_CHILDREN) < 0)
+	{
+		strcpy(error, "Cannot set output channel layout");
+		goto end;
+	}
+	const int out_sample_rates[] = { out_sample_rate, -1 };
+	if (av_opt_set_int_list(session->buffersink_ctx, "sample_rates", out_sample_rates, -1, AV_OPT_SEARCH_CHILDREN) < 0)
+	{
+		strcpy(error, "Cannot set output sample rate");
+		goto end;
+	}
+
+	gis->name = av_strdup("out");
+	gis->filter_ctx = session->buffersink_ctx;
+	gis->pad_idx = 0;
+	gis->next = NULL;
+
+	gos->name = av_strdup("in");
+	gos->filter_ctx = session->buffersrc_ctx;
+	gos->pad_idx = 0;
+	gos->next = NULL;
+
+	if(avfilter_graph_parse_ptr(session->graph, filter_args, &gis, &gos, NULL) < 0)
+	{
+		strcpy(error, "Cannot parse graph");
+		goto end;
+	}
+
+	if(avfilter_graph_config(session->graph, NULL) < 0)
+	{
+		strcpy(error, "Cannot configure graph.");
 		goto end;
 	}
 
-	if(input_path == NULL)
+	ret = 0;
+
+end:
+	if(ret < 0)
+	{
+		avfilter_graph_free(&session->graph);
+		session->buffersrc_ctx = session->buffersink_ctx = NULL;
+	}
+	avfilter_inout_free(&gis);
+	avfilter_inout_free(&gos);
+	return ret;
+}
+
+static int configure_resampler(struct DecodeAudioSession* session, int in_sample_rate, enum AVSampleFormat in_sample_fmt, uint64_t channel_layout, int out_sample_rate, enum AVSampleFormat out_sample_fmt, char* error)
+{
+	struct DecodeAudio* options = &session->output_options;
+	char swr_key[sizeof(session->swr_key)];
+	snprintf(swr_key, sizeof(swr_key), "%d:%s:%d:%s:0x%"PRIx64":%d:%d:%d:%d", in_sample_rate, av_get_sample_fmt_name(in_sample_fmt), out_sample_rate, av_get_sample_fmt_name(out_sample_fmt), channel_layout, options->resample_filter_size, options->resample_linear, options->resample_cubic, options->resample_soxr);
+
+	if(!session->swr || strcmp(session->swr_key, swr_key) != 0)
+	{
+		session->swr_key[0] = '\0';
+		session->swr = swr_alloc_set_opts(session->swr, channel_layout, out_sample_fmt, out_sample_rate, channel_layout, in_sample_fmt, in_sample_rate, 0, NULL);
+		if(!session->swr)
+		{
+			strcpy(error, "Cannot allocate resampler");
+			return -1;
+		}
+		if(options->resample_filter_size > 0)
+			av_opt_set_int(session->swr, "filter_size", options->resample_filter_size, 0);
+		if(options->resample_linear)
+			av_opt_set_int(session->swr, "linear_interp", 1, 0);
+		if(options->resample_cubic)
+			av_opt_set_int(session->swr, "filter_type", SWR_FILTER_TYPE_CUBIC, 0);
+		if(options->resample_soxr)
+			av_opt_set_int(session->swr, "resampler", SWR_ENGINE_SOXR, 0);
+	}
+
+	// re-initializing resets the delay line and the flush state but keeps the filter bank when parameters did not change,
+	// it fails for soxr when libswresample was built without it
+	if(swr_init(session->swr) < 0)
+	{
+		strcpy(error, "Cannot initialize resampler");
+		return -1;
+	}
+	strcpy(session->swr_key, swr_key);
+	return 0;
+}
+
+struct DecodeAudioSession* decode_audio_session_create(struct DecodeAudio output_options, const char* filter_string, int verbose)
+{
+	if(filter_string != NULL && strlen(filter_string) > 512)
+		return NULL;
+
+	struct DecodeAudioSession* session = calloc(1, sizeof(struct DecodeAudioSession));
+	if(output_options.n_mels > 0)
+	{
+		// features are computed from interleaved f32 samples taken from the FIFO as they are decoded
+		strcpy(output_options.fmt, AV_NE("f32be", "f32le"));
+		output_options.channels_first = output_options.normalize = 0;
+		session->streaming = true;
+	}
+	session->output_options = output_options;
+	strcpy(session->filter_string, filter_string != NULL ? filter_string : "");
+	session->verbose = verbose;
+	session->codecpar = avcodec_parameters_alloc();
+	session->pkt = av_packet_alloc();
+	session->frame = av_frame_alloc();
+	session->filt_frame = av_frame_alloc();
+	return session;
+}
+
+void decode_audio_session_destroy(struct DecodeAudioSession* session)
+{
+	if(!session)
+		return;
+	avfilter_graph_free(&session->graph);
+	avcodec_free_context(&session->dec_ctx);
+	avcodec_parameters_free(&session->codecpar);
+	av_packet_free(&session->pkt);
+	av_frame_free(&session->frame);
+	av_frame_free(&session->filt_frame);
+	pipeline_destroy(session->pipeline);
+	av_freep(&session->avio_ctx_buffer);
+	av_freep(&session->fifo_scratch);
+	swr_free(&session->swr);
+	free(session);
+}
+
+static int64_t seek_preroll(AVStream* stream)
+{
+	// lossy codecs start a couple of frames early so that the decoder is primed (MDCT overlap, bit reservoir) once the target is reached
+	const AVCodecDescriptor* desc = avcodec_descriptor_get(stream->codecpar->codec_id);
+	int64_t preroll = stream->codecpar->seek_preroll;
+	if(desc && (desc->props & AV_CODEC_PROP_LOSSY))
+		preroll = FFMAX(preroll, stream->codecpar->frame_size > 0 ? 2 * stream->codecpar->frame_size : 4096);
+	return preroll;
+}
+
+static int session_seek(struct DecodeAudioSession* session, int64_t target, char* error)
+{
+	// target is in input samples
+	AVStream* stream = session->fmt_ctx->streams[session->stream_index];
+	int64_t preroll = seek_preroll(stream);
+	session->seek_pending = true;
+	session->seek_gap = false;
+	session->seek_target = target;
+	session->seek_origin = -1;
+
+	if(session->seek_index_input && !session->seek_index_checked)
+	{
+		session->seek_index_checked = true;
+		open_seek_index(session->seek_index_input, session->stream_index, stream->codecpar->sample_rate, &session->seek_index);
+	}
+	if(session->seek_index.header)
+	{
+		const struct seek_index_entry* entry = find_seek_index_entry(&session->seek_index, target - FFMAX(preroll, session->seek_index.header->preroll));
+		if(av_seek_frame(session->fmt_ctx, session->stream_index, entry->pos, AVSEEK_FLAG_BYTE) >= 0)
+		{
+			session->seek_origin = entry->sample;
+			return 0;
+		}
+	}
+
+	int64_t start_time = stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+	int64_t ts = start_time + av_rescale_q(FFMAX(0, target - preroll), (AVRational){1, session->dec_ctx->sample_rate}, stream->time_base);
+	if (av_seek_frame(session->fmt_ctx, session->stream_index, ts, AVSEEK_FLAG_BACKWARD) < 0)
+	{
+		strcpy(error, "Cannot seek");
+		return -1;
+	}
+	return 0;
+}
+
+// container detection: magic bytes, then the extension, pick the demuxer directly and full FFmpeg probing only runs when neither is conclusive;
+// demuxers are looked up once, raw elementary streams (MPEG audio, ADTS) whose headers leave codec parameters open get a short stream analysis
+
+struct input_format_entry
+{
+	const char* name;
+	const char* extensions;
+	bool parse_frames;
+	// resolved on first use, av_find_input_format walks every registered demuxer
+	AVInputFormat* format;
+};
+
+enum { FORMAT_WAV, FORMAT_W64, FORMAT_FLAC, FORMAT_OGG, FORMAT_MP3, FORMAT_AAC, FORMAT_MOV, FORMAT_MATROSKA, FORMAT_AIFF, FORMAT_CAF, FORMAT_AMR, FORMAT_WV, FORMAT_APE, FORMAT_AU, NUM_FORMATS };
+
+static struct input_format_entry input_format_entries[NUM_FORMATS] =
+{
+	[FORMAT_WAV]      = { "wav"     , "wav,wave,bwf"          },
+	[FORMAT_W64]      = { "w64"     , "w64"                   },
+	[FORMAT_FLAC]     = { "flac"    , "flac"                  },
+	[FORMAT_OGG]      = { "ogg"     , "ogg,oga,opus,spx"      },
+	[FORMAT_MP3]      = { "mp3"     , "mp3,mp2,mpga"   , true },
+	[FORMAT_AAC]      = { "aac"     , "aac,adts"       , true },
+	[FORMAT_MOV]      = { "mov"     , "m4a,mp4,m4b,mov,3gp"   },
+	[FORMAT_MATROSKA] = { "matroska", "mka,mkv,webm"          },
+	[FORMAT_AIFF]     = { "aiff"    , "aif,aiff,aifc"         },
+	[FORMAT_CAF]      = { "caf"     , "caf"                   },
+	[FORMAT_AMR]      = { "amr"     , "amr"                   },
+	[FORMAT_WV]       = { "wv"      , "wv"                    },
+	[FORMAT_APE]      = { "ape"     , "ape"                   },
+	[FORMAT_AU]       = { "au"      , "au,snd"                },
+};
+
+static bool match_extension(const char* path, const char* extensions)
+{
+	const char* ext = path ? strrchr(path, '.') : NULL;
+	if(!ext || strchr(ext, '/'))
+		return false;
+	size_t len = strlen(++ext);
+	for(const char* p = extensions; *p; p += strcspn(p, ","), p += *p == ',')
+		if(strcspn(p, ",") == len && strncasecmp(p, ext, len) == 0)
+			return true;
+	return false;
+}
+
+static int detect_input_format(const uint8_t* buf, size_t size, const char* path)
+{
+	// returns a FORMAT_* or -1; buf holds the first bytes of the input (NULL for paths that are not mapped)
+	if(buf != NULL && size >= 10 && memcmp(buf, "ID3", 3) == 0)
+	{
+		// ID3v2 tags precede MPEG audio (sometimes ADTS or FLAC), detection continues behind the tag when it is within reach
+		size_t tag_size = 10 + ((buf[6] & 0x7f) << 21 | (buf[7] & 0x7f) << 14 | (buf[8] & 0x7f) << 7 | (buf[9] & 0x7f)) + (buf[5] & 0x10 ? 10 : 0);
+		if(tag_size + 8 > size)
+			return match_extension(path, input_format_entries[FORMAT_FLAC].extensions) ? FORMAT_FLAC : match_extension(path, input_format_entries[FORMAT_AAC].extensions) ? FORMAT_AAC : FORMAT_MP3;
+		buf += tag_size;
+		size -= tag_size;
+	}
+
+	if(buf != NULL && size >= 12)
+	{
+		if((memcmp(buf, "RIFF", 4) == 0 || memcmp(buf, "RF64", 4) == 0 || memcmp(buf, "BW64", 4) == 0) && memcmp(buf + 8, "WAVE", 4) == 0)
+			return FORMAT_WAV;
+		if(memcmp(buf, "riff\x2e\x91\xcf\x11", 8) == 0)
+			return FORMAT_W64;
+		if(memcmp(buf, "fLaC", 4) == 0)
+			return FORMAT_FLAC;
+		if(memcmp(buf, "OggS", 4) == 0)
+			return FORMAT_OGG;
+		if(memcmp(buf + 4, "ftyp", 4) == 0)
+			return FORMAT_MOV;
+		if(memcmp(buf, "\x1a\x45\xdf\xa3", 4) == 0)
+			return FORMAT_MATROSKA;
+		if(memcmp(buf, "FORM", 4) == 0 && (memcmp(buf + 8, "AIFF", 4) == 0 || memcmp(buf + 8, "AIFC", 4) == 0))
+			return FORMAT_AIFF;
+		if(memcmp(buf, "caff", 4) == 0)
+			return FORMAT_CAF;
+		if(memcmp(buf, "#!AMR", 5) == 0)
+			return FORMAT_AMR;
+		if(memcmp(buf, "wvpk", 4) == 0)
+			return FORMAT_WV;
+		if(memcmp(buf, "MAC ", 4) == 0)
+			return FORMAT_APE;
+		if(memcmp(buf, ".snd", 4) == 0)
+			return FORMAT_AU;
+
+		// frame syncs are only 12 bits: an ADTS header must be followed by another one where its frame length says (when that is within reach),
+		// MPEG audio needs a valid layer, bitrate and sample rate index
+		if(buf[0] == 0xff && (buf[1] & 0xf6) == 0xf0)
+		{
+			size_t frame_size = (buf[3] & 0x03) << 11 | buf[4] << 3 | buf[5] >> 5;
+			if(frame_size >= 7 && (frame_size + 2 > size || (buf[frame_size] == 0xff && (buf[frame_size + 1] & 0xf6) == 0xf0)))
+				return FORMAT_AAC;
+		}
+		if(buf[0] == 0xff && (buf[1] & 0xe0) == 0xe0 && (buf[1] & 0x06) != 0 && (buf[1] & 0x18) != 0x08 && (buf[2] & 0xf0) != 0xf0 && (buf[2] & 0x0c) != 0x0c)
+			return FORMAT_MP3;
+	}
+
+	for(int k = 0; k < NUM_FORMATS; k++)
+		if(match_extension(path, input_format_entries[k].extensions))
+			return k;
+	return -1;
+}
+
+static AVInputFormat* input_format_of(int k)
+{
+	struct input_format_entry* entry = &input_format_entries[k];
+	AVInputFormat* format = __atomic_load_n(&entry->format, __ATOMIC_ACQUIRE);
+	if(!format)
+	{
+		format = av_find_input_format(entry->name);
+		__atomic_store_n(&entry->format, format, __ATOMIC_RELEASE);
+	}
+	return format;
+}
+
+static bool peek_frame_header(AVIOContext* pb, AVCodecParameters* codecpar)
+{
+	// sample rate, channels and bitrate of a raw MPEG audio / ADTS stream from the first frame header at the demuxer position, the bytes are put back
+	static const int adts_sample_rates[13] = { 96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350 };
+	static const int mpa_sample_rates[3] = { 44100, 48000, 32000 };
+	// kbit/s by bitrate index: MPEG-1 layers I, II, III, MPEG-2/2.5 layer I, layers II and III
+	static const short mpa_bit_rates[5][15] =
+	{
+		{ 0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448 },
+		{ 0, 32, 48, 56,  64,  80,  96, 112, 128, 160, 192, 224, 256, 320, 384 },
+		{ 0, 32, 40, 48,  56,  64,  80,  96, 112, 128, 160, 192, 224, 256, 320 },
+		{ 0, 32, 48, 56,  64,  80,  96, 112, 128, 144, 160, 176, 192, 224, 256 },
+		{ 0,  8, 16, 24,  32,  40,  48,  56,  64,  80,  96, 112, 128, 144, 160 },
+	};
+	uint8_t buf[4096];
+	int64_t pos = avio_tell(pb);
+	int size = avio_read(pb, buf, sizeof(buf));
+	if(avio_seek(pb, pos, SEEK_SET) < 0)
+		return false;
+	for (int i = 0; i + 7 <= size; i++)
+	{
+		const uint8_t* h = buf + i;
+		if(h[0] != 0xff || (h[1] & 0xe0) != 0xe0)
+			continue;
+		if(codecpar->codec_id == AV_CODEC_ID_AAC)
+		{
+			int rate_index = (h[2] >> 2) & 0x0f, channels = (h[2] & 0x01) << 2 | h[3] >> 6;
+			int frame_size = (h[3] & 0x03) << 11 | h[4] << 3 | h[5] >> 5;
+			// channel configuration 0 leaves the layout to a PCE inside the frame, only the decoder knows
+			if((h[1] & 0xf6) != 0xf0 || rate_index >= 13 || channels == 0 || frame_size < 7)
+				continue;
+			codecpar->sample_rate = adts_sample_rates[rate_index];
+			codecpar->channels = channels == 7 ? 8 : channels;
+			codecpar->bit_rate = (int64_t)frame_size * 8 * codecpar->sample_rate / (1024 * ((h[6] & 0x03) + 1));
+			return true;
+		}
+		int version = (h[1] >> 3) & 0x03, layer = 4 - ((h[1] >> 1) & 0x03), bit_rate_index = h[2] >> 4, rate_index = (h[2] >> 2) & 0x03;
+		if(version == 1 || layer == 4 || bit_rate_index == 0 || bit_rate_index == 15 || rate_index == 3)
+			continue;
+		codecpar->sample_rate = mpa_sample_rates[rate_index] >> (version == 3 ? 0 : version == 2 ? 1 : 2);
+		codecpar->channels = h[3] >> 6 == 3 ? 1 : 2;
+		codecpar->bit_rate = 1000 * mpa_bit_rates[version == 3 ? layer - 1 : layer == 1 ? 3 : 4][bit_rate_index];
+		return true;
+	}
+	return false;
+}
+
+static int session_open_container(struct DecodeAudioSession* session, const char* input_path, struct DecodeAudio input_options, struct DecodeAudio* audio, int probe)
+{
+	int verbose = session->verbose;
+	struct DecodeAudio output_options = session->output_options;
+	av_log_set_level(verbose ? AV_LOG_DEBUG : AV_LOG_FATAL);
+
+	memset(&session->stats, 0, sizeof(session->stats));
+	stage_begin(&session->timer, output_options.profile);
+	session->fmt_ctx = avformat_alloc_context();
+	session->eof = false;
+	session->seek_pending = false;
+	session->seek_gap = false;
+	session->seek_origin = -1;
+	session->seek_index_mismatch = false;
+	// members of archives have no sidecar of their own
+	session->seek_index_input = input_path != NULL && input_options.member_offset == 0 && input_options.member_size == 0 ? input_path : NULL;
+	session->skip_samples = 0;
+	session->max_samples = -1;
+	int buffer_multiple = input_path == NULL ? 1 : 16;
+
+	uint8_t* input_buffer = input_options.data.dl_tensor.data;
+	size_t input_buffer_size = input_path == NULL ? nbytes(&input_options) : 0;
+	if(input_path != NULL && map_file(input_path, PROT_READ, MAP_PRIVATE, &session->mapping))
+	{
+		// page cache hot inputs: no read() syscalls, the kernel is told to read ahead the whole input (only the member of an archive) when all of it gets decoded;
+		// header-only opens and time ranges leave readahead to the pages actually touched, so their cost scales with the window
+		input_buffer = session->mapping.addr;
+		input_buffer_size = session->mapping.length;
+		if(!member_range(&input_options, session->mapping.length, &input_buffer, &input_buffer_size))
+		{
+			strcpy(audio->error, "Member range is outside the file");
+			return -1;
+		}
+		bool whole_input = !probe && !session->windowed && input_options.offset <= 0 && input_options.duration <= 0;
+		advise_range(session->mapping.addr, input_buffer - (uint8_t*)session->mapping.addr, input_buffer_size, probe ? MADV_RANDOM : whole_input ? MADV_SEQUENTIAL : MADV_NORMAL);
+		if(whole_input)
+			advise_range(session->mapping.addr, input_buffer - (uint8_t*)session->mapping.addr, input_buffer_size, MADV_WILLNEED);
+	}
+	else if(input_path != NULL && (input_options.member_offset > 0 || input_options.member_size > 0))
+	{
+		strcpy(audio->error, "Cannot map file for member access");
+		return -1;
+	}
+
+	if(input_path == NULL || session->mapping.length > 0)
+	{
+		int avio_ctx_buffer_size = input_options.io_buffer_size > 0 ? input_options.io_buffer_size : 4096 * buffer_multiple;
+		if(session->avio_ctx_buffer_size != avio_ctx_buffer_size)
+			av_freep(&session->avio_ctx_buffer);
+		if(!session->avio_ctx_buffer)
+		{
+			session->avio_ctx_buffer_size = avio_ctx_buffer_size;
+			session->avio_ctx_buffer = av_malloc(session->avio_ctx_buffer_size);
+			session->stats.alloc_bytes += session->avio_ctx_buffer_size;
+			assert(session->avio_ctx_buffer);
+		}
+
+		session->cursor.base = session->cursor.ptr  = input_buffer;
+    	session->cursor.size = session->cursor.left = input_buffer_size;
+		if(session->read_input)
+			session->io_ctx = avio_alloc_context(session->avio_ctx_buffer, session->avio_ctx_buffer_size, 0, session->read_input_opaque, session->read_input, NULL, NULL);
+		else
+			session->io_ctx = avio_alloc_context(session->avio_ctx_buffer, session->avio_ctx_buffer_size, 0, &session->cursor, &buffer_read, NULL, &buffer_seek);
+		if(!session->io_ctx)
+		{
+			strcpy(audio->error, "Cannot allocate IO context");
+			return -1;
+		}
+		// direct mode: every avio_read (whatever its size) is one copy from the cursor straight into the caller, and every avio_seek goes to buffer_seek;
+		// both only move a pointer over memory, the AVIO buffer (io_buffer_size) is left to byte-wise header parsing (avio_r8, avio_rl32, ...)
+		session->io_ctx->direct = session->read_input == NULL;
+
+		session->fmt_ctx->pb = session->io_ctx;
+	}
+
+	// pushed live streams (Ogg, MP3, ADTS) have no bytes yet and are probed, which only delays the first PCM
+	int format_index = session->read_input ? -1 : detect_input_format(input_path == NULL || session->mapping.length > 0 ? input_buffer : NULL, input_buffer_size, input_path);
+	AVInputFormat* input_format = format_index >= 0 ? input_format_of(format_index) : NULL;
+	bool analyze = input_format == NULL || input_format_entries[format_index].parse_frames;
+	if(analyze)
+	{
+		session->fmt_ctx->probesize = 1 << 16;
+		session->fmt_ctx->max_analyze_duration = AV_TIME_BASE / 2;
+	}
+	if (avformat_open_input(&session->fmt_ctx, input_path, input_format, NULL) != 0)
+	{
+		strcpy(audio->error, "Cannot open file");
+		return -1;
+	}
+	AVFormatContext* fmt_ctx = session->fmt_ctx;
+	if (analyze && probe && format_index >= 0 && fmt_ctx->nb_streams == 1 && peek_frame_header(fmt_ctx->pb, fmt_ctx->streams[0]->codecpar))
+	{
+		// probing a raw elementary stream stops at its first frame header, the stream analysis would open a decoder; without a Xing / VBRI
+		// header the duration is estimated from the bitrate, as the analysis would have done
+		AVStream* stream = fmt_ctx->streams[0];
+		int64_t size = avio_size(fmt_ctx->pb) - avio_tell(fmt_ctx->pb);
+		if (stream->duration == AV_NOPTS_VALUE && size > 0)
+			stream->duration = av_rescale(size, 8 * (int64_t)stream->time_base.den, stream->codecpar->bit_rate * stream->time_base.num);
+		analyze = false;
+	}
+	// a header that leaves the codec parameters open is completed from the first frames, packets read meanwhile are kept for decoding
+	for (unsigned int k = 0; !analyze && k < fmt_ctx->nb_streams; k++)
+		analyze = fmt_ctx->streams[k]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO && (fmt_ctx->streams[k]->codecpar->sample_rate <= 0 || fmt_ctx->streams[k]->codecpar->channels <= 0);
+	if (analyze && avformat_find_stream_info(fmt_ctx, NULL) < 0)
+	{
+		strcpy(audio->error, "Cannot find stream information");
+		return -1;
+	}
+	stage_end(&session->stats, STAGE_OPEN, &session->timer);
+	return 0;
+}
+
+static int session_open_stream(struct DecodeAudioSession* session, struct DecodeAudio input_options, struct DecodeAudio* audio, int probe)
+{
+	// decoder, output format and resampler / graph for session->stream_index of the open container
+	struct DecodeAudio output_options = session->output_options;
+	AVFormatContext* fmt_ctx = session->fmt_ctx;
+	AVStream *stream = fmt_ctx->streams[session->stream_index];
+	//stream->codecpar->block_align = 4096 * buffer_multiple;
+
+	AVCodecContext* dec_ctx = NULL;
+	enum AVSampleFormat decoder_sample_fmt;
+	int in_sample_rate, in_num_channels;
+	if(probe)
+	{
+		// header only: codec parameters as filled by the demuxer, codecs that pick the sample format while decoding report their preferred one
+		AVCodecParameters* codecpar = stream->codecpar;
+		AVCodec* codec = avcodec_find_decoder(codecpar->codec_id);
+		decoder_sample_fmt = codecpar->format;
+		if (decoder_sample_fmt == AV_SAMPLE_FMT_NONE && codec && codec->sample_fmts)
+			decoder_sample_fmt = codec->sample_fmts[0];
+		in_sample_rate = codecpar->sample_rate;
+		in_num_channels = codecpar->channels;
+	}
+	else
+	{
+		if (open_decoder(session, stream->codecpar, audio->error) < 0)
+			return -1;
+		stage_end(&session->stats, STAGE_CODEC_OPEN, &session->timer);
+		dec_ctx = session->dec_ctx;
+		decoder_sample_fmt = dec_ctx->sample_fmt;
+		in_sample_rate = dec_ctx->sample_rate;
+		in_num_channels = dec_ctx->channels;
+	}
+
+	// planar decoder output is interleaved (and converted) by process_output_frame or by the filter graph
+	enum AVSampleFormat sample_fmt = av_get_packed_sample_fmt(decoder_sample_fmt);
+
+	double in_duration = stream->duration != AV_NOPTS_VALUE ? av_q2d(stream->time_base) * stream->duration : fmt_ctx->duration != AV_NOPTS_VALUE ? fmt_ctx->duration / (double)AV_TIME_BASE : 0;
+	double offset = FFMAX(0, input_options.offset);
+	double out_duration = FFMAX(0, in_duration - offset);
+	if(input_options.duration > 0)
+		out_duration = in_duration > 0 ? FFMIN(input_options.duration, out_duration) : input_options.duration;
+	int out_sample_rate = output_options.sample_rate > 0 ? output_options.sample_rate : in_sample_rate;
+	uint64_t out_num_samples  = out_duration * out_sample_rate;
+	int out_num_channels = in_num_channels;
+
+	DLDataType in_dtype, out_dtype;
+	enum AVSampleFormat in_sample_fmt = AV_SAMPLE_FMT_NONE, out_sample_fmt = AV_SAMPLE_FMT_NONE;
+	const char* out_fmt = NULL;
+	for (int k = 0; k < FF_ARRAY_ELEMS(supported_sample_fmt_entries); k++)
+	{
+		struct sample_fmt_entry* entry = &supported_sample_fmt_entries[k];
+
+		if (sample_fmt == entry->sample_fmt)
+		{
+			in_dtype = entry->dtype;
+			in_sample_fmt = entry->sample_fmt;
+            strcpy(audio->fmt, AV_NE(entry->fmt_be, entry->fmt_le));
+		}
+
+		if (strcmp(output_options.fmt, entry->fmt_le) == 0 || strcmp(output_options.fmt, entry->fmt_be) == 0)
+		{
+			out_dtype = entry->dtype;
+			out_sample_fmt = entry->sample_fmt;
+			out_fmt = AV_NE(entry->fmt_be, entry->fmt_le);
+		}
+	}
+	if (in_sample_fmt == AV_SAMPLE_FMT_NONE)
+	{
+		strcpy(audio->error, "Cannot deduce format");
+		return -1;
+	}
+	if (out_sample_fmt == AV_SAMPLE_FMT_NONE)
+	{
+		out_sample_fmt = in_sample_fmt;
+		out_dtype = in_dtype;
+	}
+	else
+		strcpy(audio->fmt, out_fmt);
+	session->out_sample_fmt = out_sample_fmt;
+	if (output_options.normalize && out_sample_fmt != AV_SAMPLE_FMT_FLT && out_sample_fmt != AV_SAMPLE_FMT_DBL)
+	{
+		strcpy(audio->error, "Normalization needs f32 or f64 output");
+		return -1;
+	}
+
+	audio->duration = out_duration;
+	audio->sample_rate = out_sample_rate;
+	audio->num_channels = out_num_channels;
+	audio->num_samples = out_num_samples;
+	if(probe)
+	{
+		// metadata only, no tensor
+		audio->itemsize = out_dtype.bits / 8;
+		return 0;
+	}
+	init_tensor(audio, out_dtype, output_options.channels_first);
+
+	if (!dec_ctx->channel_layout)
+		dec_ctx->channel_layout = av_get_default_channel_layout(dec_ctx->channels);
+	uint64_t channel_layout = dec_ctx->channel_layout;
+
+	// resample-only jobs skip libavfilter, channels-first output comes straight out of swr_convert as planar rows
+	session->resample = strlen(session->filter_string) == 0 && out_sample_rate != in_sample_rate;
+	enum AVSampleFormat swr_sample_fmt = output_options.channels_first && !session->streaming ? av_get_planar_sample_fmt(out_sample_fmt) : out_sample_fmt;
+	if (session->resample && configure_resampler(session, in_sample_rate, dec_ctx->sample_fmt, channel_layout, out_sample_rate, swr_sample_fmt, audio->error) < 0)
+		return -1;
+	if (!session->resample && configure_graph(session, in_sample_rate, dec_ctx->sample_fmt, channel_layout, out_sample_rate, out_sample_fmt, audio->error) < 0)
+		return -1;
+	stage_end(&session->stats, STAGE_GRAPH_CONFIG, &session->timer);
+
+	if(input_options.duration > 0)
+		session->max_samples = out_num_samples;
+	if(offset > 0 && session->shared_input)
+	{
+		// the demuxer shared with other streams is positioned once by its owner, this stream only trims up to its own target
+		session->seek_pending = true;
+		session->seek_target = llrint(offset * in_sample_rate);
+	}
+	else if(offset > 0)
+	{
+		if (session_seek(session, llrint(offset * in_sample_rate), audio->error) < 0)
+			return -1;
+		stage_end(&session->stats, STAGE_DEMUX, &session->timer);
+	}
+
+	return 0;
+}
+
+static int session_open_input(struct DecodeAudioSession* session, const char* input_path, struct DecodeAudio input_options, struct DecodeAudio* audio, int probe)
+{
+	if(session_open_container(session, input_path, input_options, audio, probe) < 0)
+		return -1;
+	session->stream_index = av_find_best_stream(session->fmt_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+	stage_end(&session->stats, STAGE_STREAM_DISCOVERY, &session->timer);
+	if (session->stream_index < 0)
+	{
+		strcpy(audio->error, "Cannot find audio stream");
+		return -1;
+	}
+	return session_open_stream(session, input_options, audio, probe);
+}
+
+static void session_close_input(struct DecodeAudioSession* session)
+{
+	// graph has seen EOF (or an error) and cannot be fed again
+	avfilter_graph_free(&session->graph);
+	session->buffersrc_ctx = session->buffersink_ctx = NULL;
+	if(session->fmt_ctx && !session->shared_input)
+		avformat_close_input(&session->fmt_ctx);
+	session->fmt_ctx = NULL;
+	av_packet_unref(session->pkt);
+	av_frame_unref(session->frame);
+	if(session->fifo)
+	{
+		av_audio_fifo_free(session->fifo);
+		session->fifo = NULL;
+	}
+    if(session->io_ctx)
+	{
+		// AVIO may have reallocated the buffer while probing, the session keeps whatever it ended up with
+		session->avio_ctx_buffer = session->io_ctx->buffer;
+		session->avio_ctx_buffer_size = session->io_ctx->buffer_size;
+		av_freep(&session->io_ctx);
+	}
+	if(session->mapping.length > 0)
+	{
+		munmap(session->mapping.addr, session->mapping.length);
+		session->mapping.addr = NULL;
+		session->mapping.length = 0;
+	}
+	close_seek_index(&session->seek_index);
+	session->seek_index_input = NULL;
+	session->seek_index_checked = false;
+}
+
+static int session_read_packet(struct DecodeAudioSession* session, uint8_t** data, uint64_t* data_len, int itemsize)
+{
+	// demuxes and decodes the next packet of the selected stream, flushes the decoder once the input is exhausted or the time range is filled
+	if(session->eof || session->max_samples == 0)
+		return AVERROR_EOF;
+
+	// time spent by the caller between packets is not charged to any stage
+	stage_begin(&session->timer, session->output_options.profile);
+	AVPacket* pkt = session->pkt;
+	while (av_read_frame(session->fmt_ctx, pkt) >= 0)
+	{
+		stage_end(&session->stats, STAGE_DEMUX, &session->timer);
+		if(pkt->stream_index != session->stream_index)
+		{
+			av_packet_unref(pkt);
+			continue;
+		}
+		int ret = decode_packet(session, pkt, data, data_len, itemsize);
+		av_packet_unref(pkt);
+		if(ret >= 0)
+			return ret;
+		break;
+	}
+
+	stage_end(&session->stats, STAGE_DEMUX, &session->timer);
+	pkt->data = NULL;
+	pkt->size = 0;
+	decode_packet(session, pkt, data, data_len, itemsize);
+	session->eof = true;
+	return 0;
+}
+
+struct spsc_ring
+{
+	// bounded single-producer single-consumer queue, lock-free unless one side has to wait for the other
+	void** slots;
+	unsigned int capacity;
+	unsigned int head;
+	unsigned int tail;
+	int waiters;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+static void ring_init(struct spsc_ring* ring, unsigned int capacity)
+{
+	ring->slots = calloc(capacity, sizeof(void*));
+	ring->capacity = capacity;
+	ring->head = ring->tail = ring->waiters = 0;
+	pthread_mutex_init(&ring->mutex, NULL);
+	pthread_cond_init(&ring->cond, NULL);
+}
+
+static void ring_destroy(struct spsc_ring* ring)
+{
+	free(ring->slots);
+	pthread_mutex_destroy(&ring->mutex);
+	pthread_cond_destroy(&ring->cond);
+}
+
+static void ring_wait(struct spsc_ring* ring, bool pushing)
+{
+	// spins briefly, then sleeps until the other side moves; seq_cst on waiters / head / tail makes sure that either side sees the other
+	for (int spin = 0; spin < 128; spin++)
+	{
+		unsigned int used = __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) - __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);
+		if(pushing ? used < ring->capacity : used > 0)
+			return;
+		sched_yield();
+	}
+	pthread_mutex_lock(&ring->mutex);
+	__atomic_fetch_add(&ring->waiters, 1, __ATOMIC_SEQ_CST);
+	for (;;)
+	{
+		unsigned int used = __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) - __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);
+		if(pushing ? used < ring->capacity : used > 0)
+			break;
+		pthread_cond_wait(&ring->cond, &ring->mutex);
+	}
+	__atomic_fetch_sub(&ring->waiters, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&ring->mutex);
+}
+
+static void ring_wake(struct spsc_ring* ring)
+{
+	if(__atomic_load_n(&ring->waiters, __ATOMIC_SEQ_CST) == 0)
+		return;
+	pthread_mutex_lock(&ring->mutex);
+	pthread_cond_broadcast(&ring->cond);
+	pthread_mutex_unlock(&ring->mutex);
+}
+
+static void ring_push(struct spsc_ring* ring, void* item)
+{
+	unsigned int tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	if(tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) >= ring->capacity)
+		ring_wait(ring, true);
+	ring->slots[tail & (ring->capacity - 1)] = item;
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_SEQ_CST);
+	ring_wake(ring);
+}
+
+static void* ring_pop(struct spsc_ring* ring)
+{
+	unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	if(__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == head)
+		ring_wait(ring, false);
+	void* item = ring->slots[head & (ring->capacity - 1)];
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_SEQ_CST);
+	ring_wake(ring);
+	return item;
+}
+
+// packets and frames in flight per stage, rings hold the whole pool plus the NULL end marker
+#define PIPELINE_POOL_SIZE 16
+
+struct decode_pipeline
+{
+	struct DecodeAudioSession* session;
+	AVPacket* packets[PIPELINE_POOL_SIZE];
+	AVFrame* frames[PIPELINE_POOL_SIZE];
+	struct spsc_ring packet_ring, free_packet_ring, frame_ring, free_frame_ring;
+	// set by any stage that wants the input to end early (error, output full), the others drain their rings and exit
+	int stop;
+};
+
+static void pipeline_destroy(struct decode_pipeline* pipeline)
+{
+	if(!pipeline)
+		return;
+	for (int i = 0; i < PIPELINE_POOL_SIZE; i++)
+	{
+		av_packet_free(&pipeline->packets[i]);
+		av_frame_free(&pipeline->frames[i]);
+	}
+	ring_destroy(&pipeline->packet_ring);
+	ring_destroy(&pipeline->free_packet_ring);
+	ring_destroy(&pipeline->frame_ring);
+	ring_destroy(&pipeline->free_frame_ring);
+	free(pipeline);
+}
+
+static struct decode_pipeline* pipeline_create(struct DecodeAudioSession* session)
+{
+	struct decode_pipeline* pipeline = calloc(1, sizeof(struct decode_pipeline));
+	pipeline->session = session;
+	ring_init(&pipeline->packet_ring, 2 * PIPELINE_POOL_SIZE);
+	ring_init(&pipeline->free_packet_ring, 2 * PIPELINE_POOL_SIZE);
+	ring_init(&pipeline->frame_ring, 2 * PIPELINE_POOL_SIZE);
+	ring_init(&pipeline->free_frame_ring, 2 * PIPELINE_POOL_SIZE);
+	for (int i = 0; i < PIPELINE_POOL_SIZE; i++)
+	{
+		pipeline->packets[i] = av_packet_alloc();
+		pipeline->frames[i] = av_frame_alloc();
+		if(!pipeline->packets[i] || !pipeline->frames[i])
+		{
+			pipeline_destroy(pipeline);
+			return NULL;
+		}
+	}
+	return pipeline;
+}
+
+static void pipeline_reset(struct decode_pipeline* pipeline)
+{
+	// every packet and frame goes back to its free ring, whatever stage held it when the previous input ended
+	pipeline->stop = 0;
+	struct spsc_ring* rings[] = { &pipeline->packet_ring, &pipeline->free_packet_ring, &pipeline->frame_ring, &pipeline->free_frame_ring };
+	for (int r = 0; r < FF_ARRAY_ELEMS(rings); r++)
+		rings[r]->head = rings[r]->tail = 0;
+	for (int i = 0; i < PIPELINE_POOL_SIZE; i++)
+	{
+		av_packet_unref(pipeline->packets[i]);
+		av_frame_unref(pipeline->frames[i]);
+		ring_push(&pipeline->free_packet_ring, pipeline->packets[i]);
+		ring_push(&pipeline->free_frame_ring, pipeline->frames[i]);
+	}
+}
+
+static void* pipeline_demux(void* arg)
+{
+	struct decode_pipeline* pipeline = (struct decode_pipeline*)arg;
+	struct DecodeAudioSession* session = pipeline->session;
+	struct stage_timer timer;
+	AVPacket* pkt = NULL;
+	while (!__atomic_load_n(&pipeline->stop, __ATOMIC_RELAXED))
+	{
+		if(!pkt)
+			pkt = ring_pop(&pipeline->free_packet_ring);
+		stage_begin(&timer, session->output_options.profile);
+		int ret = av_read_frame(session->fmt_ctx, pkt);
+		stage_end(&session->stats, STAGE_DEMUX, &timer);
+		if(ret < 0)
+			break;
+		if(pkt->stream_index != session->stream_index)
+		{
+			av_packet_unref(pkt);
+			continue;
+		}
+		ring_push(&pipeline->packet_ring, pkt);
+		pkt = NULL;
+	}
+	ring_push(&pipeline->packet_ring, NULL);
+	return NULL;
+}
+
+static void* pipeline_decode(void* arg)
+{
+	struct decode_pipeline* pipeline = (struct decode_pipeline*)arg;
+	struct DecodeAudioSession* session = pipeline->session;
+	struct DecodeAudioStats* stats = &session->stats;
+	struct stage_timer timer;
+	AVFrame* frame = NULL;
+	for (;;)
+	{
+		AVPacket* pkt = ring_pop(&pipeline->packet_ring);
+		if(pkt && __atomic_load_n(&pipeline->stop, __ATOMIC_RELAXED))
+		{
+			av_packet_unref(pkt);
+			ring_push(&pipeline->free_packet_ring, pkt);
+			continue;
+		}
+
+		// a NULL packet is the end of the input and drains the decoder, like the serial loop
+		stage_begin(&timer, session->output_options.profile);
+		int ret = avcodec_send_packet(session->dec_ctx, pkt);
+		if(pkt)
+		{
+			stats->num_packets++;
+			stats->bytes_in += pkt->size;
+			av_packet_unref(pkt);
+			ring_push(&pipeline->free_packet_ring, pkt);
+		}
+		stage_end(stats, STAGE_DECODE, &timer);
+
+		while (ret >= 0)
+		{
+			if(!frame)
+				frame = ring_pop(&pipeline->free_frame_ring);
+			stage_begin(&timer, session->output_options.profile);
+			ret = avcodec_receive_frame(session->dec_ctx, frame);
+			stage_end(stats, STAGE_DECODE, &timer);
+			if(ret == 0)
+			{
+				stats->num_frames++;
+				ring_push(&pipeline->frame_ring, frame);
+				frame = NULL;
+			}
+		}
+		if(ret != AVERROR(EAGAIN) && ret != AVERROR_EOF)
+			__atomic_store_n(&pipeline->stop, 1, __ATOMIC_RELAXED);
+		if(!pkt)
+			break;
+	}
+	ring_push(&pipeline->frame_ring, NULL);
+	return NULL;
+}
+
+static void decode_pipelined(struct DecodeAudioSession* session, uint8_t** data, uint64_t* data_len, int itemsize)
+{
+	// demux and decode run on their own threads, the calling thread trims, filters and copies frames out as they arrive
+	if(!session->pipeline)
+		session->pipeline = pipeline_create(session);
+	struct decode_pipeline* pipeline = session->pipeline;
+	pthread_t demux_thread, decode_thread;
+	if(pipeline)
+		pipeline_reset(pipeline);
+	if(!pipeline || pthread_create(&decode_thread, NULL, pipeline_decode, pipeline) != 0)
+	{
+		while (session_read_packet(session, data, data_len, itemsize) >= 0);
+		return;
+	}
+	if(pthread_create(&demux_thread, NULL, pipeline_demux, pipeline) != 0)
+	{
+		// nothing was read yet: end the decode thread and fall back to the serial loop
+		ring_push(&pipeline->packet_ring, NULL);
+		while (ring_pop(&pipeline->frame_ring) != NULL);
+		pthread_join(decode_thread, NULL);
+		avcodec_flush_buffers(session->dec_ctx);
+		while (session_read_packet(session, data, data_len, itemsize) >= 0);
+		return;
+	}
+
+	for (AVFrame* frame; (frame = ring_pop(&pipeline->frame_ring)) != NULL;)
+	{
+		// once the output is full the remaining frames are only recycled, like the serial loop stops reading
+		if(session->max_samples != 0)
+		{
+			stage_begin(&session->timer, session->output_options.profile);
+			if(process_frame(session, frame, data, data_len, itemsize, &session->timer) < 0 || session->max_samples == 0)
+				__atomic_store_n(&pipeline->stop, 1, __ATOMIC_RELAXED);
+		}
+		av_frame_unref(frame);
+		ring_push(&pipeline->free_frame_ring, frame);
+	}
+	pthread_join(demux_thread, NULL);
+	pthread_join(decode_thread, NULL);
+
+	if(session->max_samples != 0)
+	{
+		stage_begin(&session->timer, session->output_options.profile);
+		process_frame(session, NULL, data, data_len, itemsize, &session->timer);
+	}
+	session->eof = true;
+}
+
+static struct sample_fmt_entry* parse_wav_header(uint8_t* buf, size_t size, uint8_t** data, uint64_t* data_size, int* num_channels, int* sample_rate)
+{
+	// accepts plain little-endian PCM / IEEE float WAV (including WAVE_FORMAT_EXTENSIBLE) whose layout matches an output dtype
+	if(size < 12 || memcmp(buf, "RIFF", 4) != 0 || memcmp(buf + 8, "WAVE", 4) != 0)
+		return NULL;
+
+	int format_tag = 0, block_align = 0, bits = 0;
+	*data = NULL;
+	for(size_t pos = 12; pos + 8 <= size;)
+	{
+		uint8_t* chunk = buf + pos + 8;
+		uint32_t chunk_size = AV_RL32(buf + pos + 4);
+		if(memcmp(buf + pos, "fmt ", 4) == 0 && chunk_size >= 16 && pos + 8 + chunk_size <= size)
+		{
+			format_tag = AV_RL16(chunk);
+			*num_channels = AV_RL16(chunk + 2);
+			*sample_rate = AV_RL32(chunk + 4);
+			block_align = AV_RL16(chunk + 12);
+			bits = AV_RL16(chunk + 14);
+			if(format_tag == 0xFFFE && chunk_size >= 40)
+				format_tag = AV_RL16(chunk + 24);
+		}
+		else if(memcmp(buf + pos, "data", 4) == 0)
+		{
+			// streamed WAVs leave the size at 0xFFFFFFFF, the file size bounds it
+			*data = chunk;
+			*data_size = FFMIN(chunk_size, size - pos - 8);
+			break;
+		}
+		pos += 8 + (uint64_t)chunk_size + (chunk_size & 1);
+	}
+
+	enum AVSampleFormat sample_fmt = AV_SAMPLE_FMT_NONE;
+	if(format_tag == 1)
+		sample_fmt = bits == 8 ? AV_SAMPLE_FMT_U8 : bits == 16 ? AV_SAMPLE_FMT_S16 : bits == 32 ? AV_SAMPLE_FMT_S32 : AV_SAMPLE_FMT_NONE;
+	else if(format_tag == 3)
+		sample_fmt = bits == 32 ? AV_SAMPLE_FMT_FLT : bits == 64 ? AV_SAMPLE_FMT_DBL : AV_SAMPLE_FMT_NONE;
+	if(*data == NULL || sample_fmt == AV_SAMPLE_FMT_NONE || *num_channels <= 0 || *sample_rate <= 0 || block_align != *num_channels * bits / 8)
+		return NULL;
+
+	for (int k = 0; k < FF_ARRAY_ELEMS(supported_sample_fmt_entries); k++)
+		if(supported_sample_fmt_entries[k].sample_fmt == sample_fmt)
+			return &supported_sample_fmt_entries[k];
+	return NULL;
+}
+
+static bool decode_wav_fast(const char* input_path, struct DecodeAudio input_options, struct DecodeAudio output_options, const char* filter_string, struct DecodeAudio* audio)
+{
+	// zero-copy path: PCM WAV that needs no conversion is returned as a view of the input buffer or of an mmap of the file;
+	// a custom allocator (e.g. pinned memory) asks for outputs in its own memory, which a view cannot be
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+	return false;
+#endif
+	if((filter_string != NULL && strlen(filter_string) > 0) || output_options.data.dl_tensor.data != NULL || output_options.normalize || output_options.n_mels > 0 || output_options.allocator != NULL)
+		return false;
+
+	struct mmap_ctx* mapping = NULL;
+	uint8_t* buf = input_options.data.dl_tensor.data;
+	size_t size = 0;
+	if(input_path != NULL)
+	{
+		// private writable mapping: consumers may write into the tensor without touching the file
+		struct mmap_ctx file_mapping;
+		if(!map_file(input_path, PROT_READ | PROT_WRITE, MAP_PRIVATE, &file_mapping))
+			return false;
+		mapping = malloc(sizeof(struct mmap_ctx));
+		*mapping = file_mapping;
+		buf = mapping->addr;
+		size = mapping->length;
+		if(!member_range(&input_options, mapping->length, &buf, &size))
+			size = 0;
+	}
+	else if(buf != NULL)
+		size = nbytes(&input_options);
+
+	uint8_t* data;
+	uint64_t data_size;
+	int num_channels, sample_rate;
+	struct sample_fmt_entry* entry = buf != NULL ? parse_wav_header(buf, size, &data, &data_size, &num_channels, &sample_rate) : NULL;
+	int itemsize = entry != NULL ? entry->dtype.bits / 8 : 0;
+	bool eligible = entry != NULL
+		&& (output_options.sample_rate == 0 || output_options.sample_rate == sample_rate)
+		&& (output_options.fmt[0] == '\0' || strcmp(output_options.fmt, entry->fmt_le) == 0)
+		&& (uintptr_t)data % itemsize == 0;
+	if(!eligible)
+	{
+		if(mapping)
+		{
+			munmap(mapping->addr, mapping->length);
+			free(mapping);
+		}
+		return false;
+	}
+
+	uint64_t total_samples = data_size / (itemsize * num_channels);
+	uint64_t start = FFMIN(total_samples, (uint64_t)llrint(FFMAX(0, input_options.offset) * sample_rate));
+	uint64_t num_samples = total_samples - start;
+	if(input_options.duration > 0)
+		num_samples = FFMIN(num_samples, (uint64_t)llrint(input_options.duration * sample_rate));
+
+	strcpy(audio->fmt, entry->fmt_le);
+	audio->sample_rate = sample_rate;
+	audio->num_channels = num_channels;
+	audio->num_samples = num_samples;
+	audio->duration = (double)num_samples / sample_rate;
+	init_tensor(audio, entry->dtype, output_options.channels_first);
+	if(audio->channels_first)
+	{
+		// channels-first is a transposed view of the interleaved file data
+		audio->data.dl_tensor.strides[0] = 1;
+		audio->data.dl_tensor.strides[1] = num_channels;
+	}
+	audio->data.dl_tensor.data = data + start * itemsize * num_channels;
+	audio->data.manager_ctx = mapping;
+	audio->data.deleter = mapping ? deleter_mmap : deleter_borrowed;
+	return true;
+}
+
+struct decode_segments_state
+{
+	struct DecodeAudioSession* session;
+	const char* input_path;
+	struct DecodeAudio input_options;
+	struct DecodeAudio* audio;
+	int num_segments;
+	int64_t first_sample;
+	int64_t segment_len;
+	int64_t capacity;
+	int64_t* num_decoded;
+	int failed;
+	char error[128];
+};
+
+static void decode_segment(void* opaque, int i)
+{
+	// every segment gets its own demuxer and decoder, seeks to its first sample and fills exactly its slice of the output
+	struct decode_segments_state* state = (struct decode_segments_state*)opaque;
+	struct DecodeAudio* audio = state->audio;
+	struct DecodeAudio input_options = state->input_options, segment = { 0 };
+	input_options.offset = input_options.duration = 0;
+	// segments are the parallelism already, they decode serially
+	struct DecodeAudio output_options = state->session->output_options;
+	output_options.pipeline = 0;
+	struct DecodeAudioSession* session = decode_audio_session_create(output_options, NULL, false);
+	session->windowed = true;
+
+	bool last = i == state->num_segments - 1;
+	int64_t start = i * state->segment_len, len = last ? state->capacity - start : state->segment_len;
+	uint64_t frame_stride = audio->channels_first ? audio->itemsize : audio->num_channels * audio->itemsize;
+	uint8_t* data_ptr = (uint8_t*)audio->data.dl_tensor.data + start * frame_stride;
+	uint64_t data_len = len * frame_stride;
+
+	if(session_open_input(session, state->input_path, input_options, &segment, false) < 0)
+		goto end;
+	if(state->first_sample + start > 0 && session_seek(session, state->first_sample + start, segment.error) < 0)
+		goto end;
+	session->max_samples = len;
+	session->plane_stride = state->session->plane_stride;
+	while (session_read_packet(session, &data_ptr, &data_len, audio->itemsize) >= 0);
+
+	// the last segment may end early (duration estimates overshoot), the others must not leave gaps
+	state->num_decoded[i] = len - data_len / frame_stride;
+	if(session->seek_gap || (!last && state->num_decoded[i] != len))
+		strcpy(segment.error, "Segment boundary is not sample-exact");
+
+end:
+	if(segment.error[0] && !__atomic_exchange_n(&state->failed, 1, __ATOMIC_RELAXED))
+		strcpy(state->error, segment.error);
+	session_close_input(session);
+	add_stats(&state->session->stats, &session->stats, true);
+	decode_audio_session_destroy(session);
+	free(segment.data.dl_tensor.shape);
+	free(segment.data.dl_tensor.strides);
+}
+
+static int64_t decode_segments(struct DecodeAudioSession* session, const char* input_path, struct DecodeAudio input_options, struct DecodeAudio* audio, uint64_t capacity)
+{
+	// returns the number of samples decoded, -1 leaves the input to the serial loop (short, unseekable, filtered or resampled inputs, inexact seeks)
+	const int64_t min_segment_duration = 10;
+	int64_t num_samples = FFMIN(audio->num_samples, capacity);
+	int num_segments = FFMIN(session->output_options.num_segments, num_samples / FFMAX(1, min_segment_duration * (int64_t)audio->sample_rate));
+	AVIOContext* pb = session->fmt_ctx->pb;
+	if(num_segments < 2 || session->graph || session->resample || !pb || !(pb->seekable & AVIO_SEEKABLE_NORMAL))
+		return -1;
+
+	int64_t num_decoded[num_segments];
+	struct decode_segments_state state = { session, input_path, input_options, audio, num_segments, session->seek_pending ? session->seek_target : 0, num_samples / num_segments, capacity, num_decoded };
+	parallel_for(num_segments, num_segments, decode_segment, &state);
+	if(state.failed)
+	{
+		if(session->verbose)
+			printf("decode_audio: falling back to serial decoding: %s\n", state.error);
+		return -1;
+	}
+	return (num_segments - 1) * state.segment_len + num_decoded[num_segments - 1];
+}
+
+// decoded-PCM cache: one file per (input identity, output options) holding a header, the key and the raw samples, hits are mmapped zero-copy;
+// entries are written to a temp file and renamed into place so concurrent loaders never see partial files, hits refresh mtime for LRU eviction
+
+struct DecodeAudioCache
+{
+	char* dir;
+	uint64_t max_bytes;
+	// estimate of the directory size, recounted when it passes max_bytes since other processes write too
+	uint64_t num_bytes;
+	uint64_t num_writes;
+	pthread_mutex_t evict_lock;
+};
+
+struct cache_header
+{
+	char magic[8];
+	uint64_t key_size;
+	uint64_t data_offset;
+	uint64_t sample_rate;
+	uint64_t num_channels;
+	uint64_t num_samples;
+	DLDataType dtype;
+	int32_t channels_first;
+	char fmt[8];
+};
+
+static const char cache_magic[8] = "DACACH1";
+
+struct cache_file
+{
+	char* name;
+	uint64_t size;
+	int64_t mtime_ns;
+};
+
+static int compare_cache_files(const void* a, const void* b)
+{
+	int64_t x = ((const struct cache_file*)a)->mtime_ns, y = ((const struct cache_file*)b)->mtime_ns;
+	return (x > y) - (x < y);
+}
+
+static void cache_evict(struct DecodeAudioCache* cache)
+{
+	// least recently used entries go first until the cache is at 90% of its limit, temp files of crashed writers are dropped after an hour;
+	// unlinking is safe while other processes still map an entry
+	if(pthread_mutex_trylock(&cache->evict_lock) != 0)
+		return;
+	DIR* dir = opendir(cache->dir);
+	if(dir)
+	{
+		int num_files = 0, max_files = 0;
+		struct cache_file* files = NULL;
+		uint64_t total = 0;
+		int64_t now_ns = (int64_t)time(NULL) * 1000000000LL;
+		char path[4096];
+		for(struct dirent* entry; (entry = readdir(dir)) != NULL; )
+		{
+			bool is_tmp = strstr(entry->d_name, ".pcm.tmp.") != NULL;
+			struct stat st;
+			snprintf(path, sizeof(path), "%s/%s", cache->dir, entry->d_name);
+			if((!is_tmp && !strstr(entry->d_name, ".pcm")) || stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+				continue;
+			int64_t mtime_ns = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+			if(is_tmp)
+			{
+				if(now_ns - mtime_ns > 3600 * 1000000000LL)
+					unlink(path);
+				continue;
+			}
+			if(num_files == max_files)
+			{
+				max_files = FFMAX(256, 2 * max_files);
+				files = realloc(files, max_files * sizeof(struct cache_file));
+			}
+			files[num_files++] = (struct cache_file){ strdup(entry->d_name), st.st_size, mtime_ns };
+			total += st.st_size;
+		}
+		closedir(dir);
+
+		qsort(files, num_files, sizeof(struct cache_file), compare_cache_files);
+		for(int i = 0; i < num_files; i++)
+		{
+			if(total > cache->max_bytes / 10 * 9)
+			{
+				snprintf(path, sizeof(path), "%s/%s", cache->dir, files[i].name);
+				if(unlink(path) == 0)
+					total -= files[i].size;
+			}
+			free(files[i].name);
+		}
+		free(files);
+		__atomic_store_n(&cache->num_bytes, total, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&cache->evict_lock);
+}
+
+struct DecodeAudioCache* decode_audio_cache_create(const char* dir, uint64_t max_bytes)
+{
+	if(mkdir(dir, 0755) != 0 && errno != EEXIST)
+		return NULL;
+	struct DecodeAudioCache* cache = calloc(1, sizeof(struct DecodeAudioCache));
+	cache->dir = strdup(dir);
+	cache->max_bytes = max_bytes;
+	pthread_mutex_init(&cache->evict_lock, NULL);
+	// counts what is already there (and trims it to the limit)
+	cache->num_bytes = max_bytes + 1;
+	cache_evict(cache);
+	return cache;
+}
+
+void decode_audio_cache_destroy(struct DecodeAudioCache* cache)
+{
+	// cached tensors are plain mappings and outlive the cache object
+	if(!cache)
+		return;
+	pthread_mutex_destroy(&cache->evict_lock);
+	free(cache->dir);
+	free(cache);
+}
+
+static bool cache_key(const char* input_path, struct DecodeAudio* input_options, struct DecodeAudio* output_options, const char* filter_string, char* key, size_t key_size)
+{
+	// files are identified by device, inode, size and mtime (hard links and renames hit, rewrites miss), buffers by a hash of their content;
+	// every option that changes the samples is part of the key, threading options are not since all modes decode identically
+	int len;
+	if(input_path != NULL)
+	{
+		struct stat st;
+		if(stat(input_path, &st) != 0 || !S_ISREG(st.st_mode))
+			return false;
+		len = snprintf(key, key_size, "file=%llx:%llx:%lld:%lld.%09ld:%"PRIu64":%"PRIu64, (unsigned long long)st.st_dev, (unsigned long long)st.st_ino, (long long)st.st_size, (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec, input_options->member_offset, input_options->member_size);
+	}
+	else if(input_options->data.dl_tensor.data != NULL)
+	{
+		size_t size = nbytes(input_options);
+		len = snprintf(key, key_size, "buffer=%016"PRIx64":%zu", hash_bytes(input_options->data.dl_tensor.data, size), size);
+	}
+	else
+		return false;
+
+	len += snprintf(key + len, key_size - len, ";offset=%a;duration=%a;sample_rate=%"PRIu64";fmt=%s;channels_first=%d;normalize=%d;resample=%d,%d,%d,%d;filter=%s",
+		input_options->offset, input_options->duration, output_options->sample_rate, output_options->fmt, output_options->channels_first, output_options->normalize,
+		output_options->resample_filter_size, output_options->resample_linear, output_options->resample_cubic, output_options->resample_soxr, filter_string != NULL ? filter_string : "");
+	return len < key_size;
+}
+
+static void cache_entry_path(struct DecodeAudioCache* cache, const char* key, char* path, size_t path_size)
+{
+	// 64-bit name, collisions are caught by the full key stored in the entry
+	snprintf(path, path_size, "%s/%016"PRIx64".pcm", cache->dir, hash_path(key));
+}
+
+static bool cache_lookup(struct DecodeAudioCache* cache, const char* key, struct DecodeAudioAllocator* allocator, struct DecodeAudio* audio)
+{
+	char path[4096];
+	cache_entry_path(cache, key, path, sizeof(path));
+	struct mmap_ctx mapping;
+	// private writable mapping like the WAV fast path: consumers may write into the tensor without touching the entry
+	if(!map_file(path, PROT_READ | PROT_WRITE, MAP_PRIVATE, &mapping))
+		return false;
+
+	struct cache_header* header = mapping.addr;
+	size_t key_size = strlen(key);
+	int itemsize = mapping.length >= sizeof(struct cache_header) ? header->dtype.lanes * header->dtype.bits / 8 : 0;
+	bool valid = itemsize > 0 && memcmp(header->magic, cache_magic, sizeof(cache_magic)) == 0
+		&& header->key_size == key_size && sizeof(struct cache_header) + key_size <= mapping.length
+		&& memcmp((char*)mapping.addr + sizeof(struct cache_header), key, key_size) == 0
+		&& header->data_offset <= mapping.length && header->num_channels > 0
+		&& (mapping.length - header->data_offset) / itemsize / header->num_channels == header->num_samples;
+	if(!valid)
+	{
+		munmap(mapping.addr, mapping.length);
+		return false;
+	}
+
+	// a hit makes the entry the most recently used one
+	utimensat(AT_FDCWD, path, NULL, 0);
+	madvise(mapping.addr, mapping.length, MADV_WILLNEED);
+	memcpy(audio->fmt, header->fmt, sizeof(audio->fmt));
+	audio->sample_rate = header->sample_rate;
+	audio->num_channels = header->num_channels;
+	audio->num_samples = header->num_samples;
+	audio->duration = (double)header->num_samples / header->sample_rate;
+	init_tensor(audio, header->dtype, header->channels_first);
+	if(allocator)
+	{
+		// the hit is copied into allocator memory (e.g. pinned) instead of being returned as a view of the pageable entry
+		size_t size = mapping.length - header->data_offset;
+		if(alloc_output(audio, allocator, size))
+			memcpy(audio->data.dl_tensor.data, (uint8_t*)mapping.addr + header->data_offset, size);
+		else
+			release_failed_output(audio);
+		munmap(mapping.addr, mapping.length);
+		return audio->data.dl_tensor.data != NULL;
+	}
+	audio->data.dl_tensor.data = (uint8_t*)mapping.addr + header->data_offset;
+	audio->data.manager_ctx = malloc(sizeof(struct mmap_ctx));
+	*(struct mmap_ctx*)audio->data.manager_ctx = mapping;
+	audio->data.deleter = deleter_mmap;
+	return true;
+}
+
+static bool write_all(int fd, const void* buf, size_t size)
+{
+	for(ssize_t written; size > 0; buf = (const uint8_t*)buf + written, size -= written)
+		if((written = write(fd, buf, size)) <= 0)
+			return false;
+	return true;
+}
+
+static void cache_store(struct DecodeAudioCache* cache, const char* key, struct DecodeAudio* audio)
+{
+	// rows are written contiguously, the channels-first capacity padding is dropped
+	DLTensor* tensor = &audio->data.dl_tensor;
+	if(tensor->strides[1] != 1 || audio->num_channels == 0)
+		return;
+
+	char path[4096], tmp_path[4096 + 64];
+	cache_entry_path(cache, key, path, sizeof(path));
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp.%d.%"PRIu64, path, (int)getpid(), __atomic_fetch_add(&cache->num_writes, 1, __ATOMIC_RELAXED));
+	int fd = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if(fd < 0)
+		return;
+
+	struct cache_header header = { 0 };
+	memcpy(header.magic, cache_magic, sizeof(cache_magic));
+	header.key_size = strlen(key);
+	header.data_offset = (sizeof(struct cache_header) + header.key_size + 63) / 64 * 64;
+	header.sample_rate = audio->sample_rate;
+	header.num_channels = audio->num_channels;
+	header.num_samples = audio->num_samples;
+	header.dtype = tensor->dtype;
+	header.channels_first = audio->channels_first;
+	memcpy(header.fmt, audio->fmt, sizeof(header.fmt));
+	static const uint8_t padding[64];
+
+	uint64_t row_size = tensor->shape[1] * audio->itemsize;
+	bool ok = write_all(fd, &header, sizeof(header)) && write_all(fd, key, header.key_size) && write_all(fd, padding, header.data_offset - sizeof(header) - header.key_size);
+	for(int64_t row = 0; ok && row < tensor->shape[0]; row++)
+		ok = write_all(fd, (uint8_t*)tensor->data + row * tensor->strides[0] * audio->itemsize, row_size);
+	close(fd);
+	if(!ok || rename(tmp_path, path) != 0)
+	{
+		unlink(tmp_path);
+		return;
+	}
+
+	uint64_t entry_size = header.data_offset + tensor->shape[0] * row_size;
+	if(__atomic_add_fetch(&cache->num_bytes, entry_size, __ATOMIC_RELAXED) > cache->max_bytes)
+		cache_evict(cache);
+}
+
+// log-mel features computed while decoding: samples leave the FIFO a hop at a time, so only about one window of audio is ever held;
+// real FFT of any even size: complex mixed-radix FFT (radix 4, 2, 3, generic) of half the size plus a split step, after kissfft
+
+struct cpx
+{
+	float re, im;
+};
+
+static inline struct cpx cpx_mul(struct cpx a, struct cpx b)
+{
+	return (struct cpx){ a.re * b.re - a.im * b.im, a.re * b.im + a.im * b.re };
+}
+
+struct fft_plan
+{
+	int n;
+	// (radix, remaining length) pairs
+	int factors[64];
+	struct cpx* twiddles;
+	struct cpx* scratch;
+};
+
+static void fft_plan_init(struct fft_plan* plan, int n)
+{
+	plan->n = n;
+	plan->twiddles = malloc(n * sizeof(struct cpx));
+	for(int i = 0; i < n; i++)
+		plan->twiddles[i] = (struct cpx){ cos(-2 * M_PI * i / n), sin(-2 * M_PI * i / n) };
+	int* factors = plan->factors, p = 4, max_radix = 1;
+	for(double root = floor(sqrt(n)); n > 1; )
+	{
+		while (n % p != 0)
+		{
+			p = p == 4 ? 2 : p == 2 ? 3 : p + 2;
+			if(p > root)
+				p = n;
+		}
+		n /= p;
+		*factors++ = p;
+		*factors++ = n;
+		max_radix = FFMAX(max_radix, p);
+	}
+	plan->scratch = malloc(max_radix * sizeof(struct cpx));
+}
+
+static void fft_plan_free(struct fft_plan* plan)
+{
+	free(plan->twiddles);
+	free(plan->scratch);
+}
+
+static void fft_butterfly2(struct cpx* out, int stride, const struct fft_plan* plan, int m)
+{
+	const struct cpx* tw = plan->twiddles;
+	for(int k = 0; k < m; k++, tw += stride)
+	{
+		struct cpx t = cpx_mul(out[k + m], *tw);
+		out[k + m] = (struct cpx){ out[k].re - t.re, out[k].im - t.im };
+		out[k] = (struct cpx){ out[k].re + t.re, out[k].im + t.im };
+	}
+}
+
+static void fft_butterfly4(struct cpx* out, int stride, const struct fft_plan* plan, int m)
+{
+	const struct cpx* twiddles = plan->twiddles;
+	for(int k = 0; k < m; k++)
+	{
+		struct cpx s0 = cpx_mul(out[k + m], twiddles[k * stride]), s1 = cpx_mul(out[k + 2 * m], twiddles[2 * k * stride]), s2 = cpx_mul(out[k + 3 * m], twiddles[3 * k * stride]);
+		struct cpx s5 = { out[k].re - s1.re, out[k].im - s1.im }, s3 = { s0.re + s2.re, s0.im + s2.im }, s4 = { s0.re - s2.re, s0.im - s2.im };
+		struct cpx x0 = { out[k].re + s1.re, out[k].im + s1.im };
+		out[k + 2 * m] = (struct cpx){ x0.re - s3.re, x0.im - s3.im };
+		out[k] = (struct cpx){ x0.re + s3.re, x0.im + s3.im };
+		out[k + m] = (struct cpx){ s5.re + s4.im, s5.im - s4.re };
+		out[k + 3 * m] = (struct cpx){ s5.re - s4.im, s5.im + s4.re };
+	}
+}
+
+static void fft_butterfly3(struct cpx* out, int stride, const struct fft_plan* plan, int m)
+{
+	const struct cpx* twiddles = plan->twiddles;
+	float epi3 = twiddles[stride * m].im;
+	for(int k = 0; k < m; k++)
+	{
+		struct cpx s1 = cpx_mul(out[k + m], twiddles[k * stride]), s2 = cpx_mul(out[k + 2 * m], twiddles[2 * k * stride]);
+		struct cpx s3 = { s1.re + s2.re, s1.im + s2.im }, s0 = { (s1.re - s2.re) * epi3, (s1.im - s2.im) * epi3 };
+		struct cpx mid = { out[k].re - s3.re * 0.5f, out[k].im - s3.im * 0.5f };
+		out[k] = (struct cpx){ out[k].re + s3.re, out[k].im + s3.im };
+		out[k + 2 * m] = (struct cpx){ mid.re + s0.im, mid.im - s0.re };
+		out[k + m] = (struct cpx){ mid.re - s0.im, mid.im + s0.re };
+	}
+}
+
+static void fft_butterfly_generic(struct cpx* out, int stride, const struct fft_plan* plan, int m, int p)
+{
+	struct cpx* scratch = plan->scratch;
+	for(int u = 0; u < m; u++)
+	{
+		for(int q = 0; q < p; q++)
+			scratch[q] = out[u + q * m];
+		for(int q1 = 0, k = u; q1 < p; q1++, k += m)
+		{
+			struct cpx sum = scratch[0];
+			for(int q = 1, twiddle = 0; q < p; q++)
+			{
+				twiddle = (twiddle + stride * k) % plan->n;
+				struct cpx t = cpx_mul(scratch[q], plan->twiddles[twiddle]);
+				sum.re += t.re;
+				sum.im += t.im;
+			}
+			out[k] = sum;
+		}
+	}
+}
+
+static void fft_work(struct cpx* out, const struct cpx* in, int stride, const int* factors, const struct fft_plan* plan)
+{
+	int p = factors[0], m = factors[1];
+	if(m == 1)
+		for(int i = 0; i < p; i++)
+			out[i] = in[i * stride];
+	else
+		for(int i = 0; i < p; i++)
+			fft_work(out + i * m, in + i * stride, stride * p, factors + 2, plan);
+
+	if(p == 2)
+		fft_butterfly2(out, stride, plan, m);
+	else if(p == 4)
+		fft_butterfly4(out, stride, plan, m);
+	else if(p == 3)
+		fft_butterfly3(out, stride, plan, m);
+	else
+		fft_butterfly_generic(out, stride, plan, m, p);
+}
+
+struct log_mel
+{
+	int n_fft, hop_length, n_mels, num_bins;
+	// window of win_length centered in n_fft, zero elsewhere
+	float* window;
+	struct fft_plan fft;
+	// split step twiddles, then the work buffers of one frame
+	struct cpx* split_twiddles;
+	float* frame;
+	struct cpx* spectrum;
+	float* power;
+	// sparse triangular filters: weights of band b cover bins [band_start[b], band_start[b] + band_len[b])
+	int* band_start;
+	int* band_len;
+	float** band_weights;
+	// mono samples [signal_base, signal_base + signal_len), with reflection at both ends of the input
+	float* signal;
+	int64_t signal_base, signal_len, signal_capacity;
+	int64_t num_frames;
+};
+
+static double hz_to_mel(double hz, bool slaney)
+{
+	if(!slaney)
+		return 2595 * log10(1 + hz / 700);
+	return hz < 1000 ? hz * 3 / 200 : 15 + log(hz / 1000) * 27 / log(6.4);
+}
+
+static double mel_to_hz(double mel, bool slaney)
+{
+	if(!slaney)
+		return 700 * (pow(10, mel / 2595) - 1);
+	return mel < 15 ? mel * 200 / 3 : 1000 * exp((mel - 15) * log(6.4) / 27);
+}
+
+static void log_mel_free(struct log_mel* mel)
+{
+	fft_plan_free(&mel->fft);
+	for(int b = 0; b < mel->n_mels; b++)
+		free(mel->band_weights[b]);
+	free(mel->band_weights);
+	free(mel->band_start);
+	free(mel->band_len);
+	free(mel->window);
+	free(mel->split_twiddles);
+	free(mel->frame);
+	free(mel->spectrum);
+	free(mel->power);
+	free(mel->signal);
+}
+
+static int log_mel_init(struct log_mel* mel, struct DecodeAudio* options, int sample_rate, char* error)
+{
+	// defaults are 25 ms windows every 10 ms, f_max defaults to the Nyquist frequency; the filterbank matches torchaudio's melscale_fbanks (htk, or slaney with slaney norm)
+	memset(mel, 0, sizeof(struct log_mel));
+	int win_length = options->win_length > 0 ? options->win_length : options->n_fft > 0 ? options->n_fft : sample_rate / 40;
+	mel->n_fft = options->n_fft > 0 ? options->n_fft : (win_length + 1) / 2 * 2;
+	mel->hop_length = options->hop_length > 0 ? options->hop_length : sample_rate / 100;
+	mel->n_mels = options->n_mels;
+	if(mel->n_fft % 2 != 0 || mel->n_fft < 4 || win_length > mel->n_fft || mel->hop_length <= 0)
+	{
+		strcpy(error, "Invalid STFT options: n_fft must be even and at least win_length");
+		return -1;
+	}
+	mel->num_bins = mel->n_fft / 2 + 1;
+
+	mel->window = calloc(mel->n_fft, sizeof(float));
+	for(int i = 0, left = (mel->n_fft - win_length) / 2; i < win_length; i++)
+		mel->window[left + i] = 0.5 - 0.5 * cos(2 * M_PI * i / win_length);
+
+	int half = mel->n_fft / 2;
+	fft_plan_init(&mel->fft, half);
+	mel->split_twiddles = malloc(half * sizeof(struct cpx));
+	for(int i = 0; i < half; i++)
+	{
+		double phase = -M_PI * ((double)(i + 1) / half + 0.5);
+		mel->split_twiddles[i] = (struct cpx){ cos(phase), sin(phase) };
+	}
+	mel->frame = malloc(mel->n_fft * sizeof(float));
+	mel->spectrum = malloc((half + 1) * sizeof(struct cpx));
+	mel->power = malloc(mel->num_bins * sizeof(float));
+
+	bool slaney = options->mel_slaney;
+	double f_max = options->f_max > 0 ? options->f_max : sample_rate / 2.0, mel_min = hz_to_mel(options->f_min, slaney), mel_max = hz_to_mel(f_max, slaney);
+	mel->band_start = malloc(mel->n_mels * sizeof(int));
+	mel->band_len = malloc(mel->n_mels * sizeof(int));
+	mel->band_weights = calloc(mel->n_mels, sizeof(float*));
+	for(int b = 0; b < mel->n_mels; b++)
+	{
+		double f_left = mel_to_hz(mel_min + (mel_max - mel_min) * b / (mel->n_mels + 1), slaney);
+		double f_center = mel_to_hz(mel_min + (mel_max - mel_min) * (b + 1) / (mel->n_mels + 1), slaney);
+		double f_right = mel_to_hz(mel_min + (mel_max - mel_min) * (b + 2) / (mel->n_mels + 1), slaney);
+		double norm = slaney ? 2 / (f_right - f_left) : 1;
+		mel->band_weights[b] = malloc(mel->num_bins * sizeof(float));
+		mel->band_start[b] = mel->num_bins;
+		mel->band_len[b] = 0;
+		for(int k = 0; k < mel->num_bins; k++)
+		{
+			double f = (double)sample_rate / 2 * k / (mel->num_bins - 1);
+			double weight = FFMAX(0, FFMIN((f - f_left) / (f_center - f_left), (f_right - f) / (f_right - f_center)));
+			if(weight <= 0)
+				continue;
+			if(mel->band_len[b] == 0)
+				mel->band_start[b] = k;
+			// the triangle is contiguous, bins between are stored as they come
+			mel->band_len[b] = k - mel->band_start[b] + 1;
+			mel->band_weights[b][k - mel->band_start[b]] = weight * norm;
+		}
+	}
+	return 0;
+}
+
+static void log_mel_frame(struct log_mel* mel, int64_t total_samples, float* out)
+{
+	// frame t covers samples [t * hop - n_fft / 2, t * hop + n_fft / 2), reflected at both ends like torch.stft(center = True, pad_mode = "reflect");
+	// total_samples is -1 until the input has ended
+	int64_t first = mel->num_frames * mel->hop_length - mel->n_fft / 2;
+	for(int i = 0; i < mel->n_fft; i++)
+	{
+		int64_t t = first + i;
+		if(t < 0)
+			t = -t;
+		if(total_samples >= 0 && t >= total_samples)
+			t = FFMAX(0, 2 * (total_samples - 1) - t);
+		t -= mel->signal_base;
+		mel->frame[i] = (t >= 0 && t < mel->signal_len ? mel->signal[t] : 0) * mel->window[i];
+	}
+
+	int half = mel->n_fft / 2;
+	struct cpx* packed = (struct cpx*)mel->frame;
+	fft_work(mel->spectrum, packed, 1, mel->fft.factors, &mel->fft);
+	struct cpx dc = mel->spectrum[0];
+	mel->power[0] = (dc.re + dc.im) * (dc.re + dc.im);
+	mel->power[half] = (dc.re - dc.im) * (dc.re - dc.im);
+	for(int k = 1; k <= half / 2; k++)
+	{
+		struct cpx a = mel->spectrum[k], b = { mel->spectrum[half - k].re, -mel->spectrum[half - k].im };
+		struct cpx sum = { a.re + b.re, a.im + b.im }, tw = cpx_mul((struct cpx){ a.re - b.re, a.im - b.im }, mel->split_twiddles[k - 1]);
+		float re = 0.5f * (sum.re + tw.re), im = 0.5f * (sum.im + tw.im);
+		mel->power[k] = re * re + im * im;
+		re = 0.5f * (sum.re - tw.re);
+		im = 0.5f * (tw.im - sum.im);
+		mel->power[half - k] = re * re + im * im;
+	}
+
+	for(int b = 0; b < mel->n_mels; b++)
+	{
+		const float* weights = mel->band_weights[b];
+		const float* power = mel->power + mel->band_start[b];
+		float energy = 0;
+		for(int k = 0; k < mel->band_len[b]; k++)
+			energy += weights[k] * power[k];
+		out[b] = logf(energy + 1e-6f);
+	}
+	mel->num_frames++;
+}
+
+static int decode_log_mel(struct DecodeAudioSession* session, struct DecodeAudio* audio)
+{
+	// the session decodes to interleaved f32 in streaming mode, channels are averaged; output is [frames, n_mels] float32
+	struct log_mel mel;
+	if(log_mel_init(&mel, &session->output_options, audio->sample_rate, audio->error) < 0)
+	{
+		log_mel_free(&mel);
+		return -1;
+	}
+	session->fifo = av_audio_fifo_alloc(AV_SAMPLE_FMT_FLT, audio->num_channels, 1);
+	if(!session->fifo)
+	{
+		strcpy(audio->error, "Cannot allocate FIFO");
+		log_mel_free(&mel);
+		return -1;
+	}
+
+	// the frame count estimate from the duration sizes the output, it grows if the estimate falls short
+	int64_t max_frames = 1 + audio->num_samples / mel.hop_length, chunk_len = 16 * mel.hop_length, num_samples = 0;
+	float* features = malloc(max_frames * mel.n_mels * sizeof(float));
+	float* chunk = malloc(chunk_len * audio->num_channels * sizeof(float));
+	mel.signal_capacity = mel.n_fft + 2 * chunk_len;
+	mel.signal = malloc(mel.signal_capacity * sizeof(float));
+	bool eof = false;
+	while (!eof)
+	{
+		while (av_audio_fifo_size(session->fifo) < chunk_len && session_read_packet(session, NULL, NULL, sizeof(float)) >= 0);
+		stage_begin(&session->timer, session->output_options.profile);
+		int n = av_audio_fifo_read(session->fifo, (void**)&chunk, chunk_len);
+		eof = n < chunk_len;
+
+		// drop samples no future frame reaches back to, then append the downmixed chunk
+		int64_t keep_from = FFMAX(0, mel.num_frames * mel.hop_length - mel.n_fft);
+		if(keep_from > mel.signal_base)
+		{
+			int64_t drop = FFMIN(keep_from - mel.signal_base, mel.signal_len);
+			memmove(mel.signal, mel.signal + drop, (mel.signal_len - drop) * sizeof(float));
+			mel.signal_base += drop;
+			mel.signal_len -= drop;
+		}
+		if(mel.signal_len + FFMAX(n, 0) > mel.signal_capacity)
+		{
+			mel.signal_capacity = mel.signal_len + FFMAX(n, 0);
+			mel.signal = realloc(mel.signal, mel.signal_capacity * sizeof(float));
+		}
+		for(int i = 0; i < n; i++)
+		{
+			float sum = 0;
+			for(int c = 0; c < audio->num_channels; c++)
+				sum += chunk[i * audio->num_channels + c];
+			mel.signal[mel.signal_len + i] = sum / audio->num_channels;
+		}
+		mel.signal_len += FFMAX(n, 0);
+		num_samples += FFMAX(n, 0);
+
+		// a frame is ready once its right half is decoded, after the end of input the remaining frames (1 + num_samples / hop in total) use the reflection
+		int64_t total_frames = 1 + num_samples / mel.hop_length;
+		while ((eof ? mel.num_frames < total_frames : mel.num_frames * mel.hop_length + mel.n_fft / 2 <= num_samples))
+		{
+			if(mel.num_frames == max_frames)
+			{
+				max_frames *= 2;
+				features = realloc(features, max_frames * mel.n_mels * sizeof(float));
+			}
+			log_mel_frame(&mel, eof ? num_samples : -1, features + mel.num_frames * mel.n_mels);
+		}
+		// features are charged to the filter stage
+		stage_end(&session->stats, STAGE_FILTER, &session->timer);
+	}
+
+	audio->num_samples = num_samples;
+	audio->duration = (double)num_samples / audio->sample_rate;
+	free(audio->data.dl_tensor.shape);
+	free(audio->data.dl_tensor.strides);
+	audio->data.dl_tensor.ndim = 2;
+	audio->data.dl_tensor.dtype = (DLDataType){ kDLFloat, 32, 1 };
+	audio->data.dl_tensor.shape = malloc(2 * sizeof(int64_t));
+	audio->data.dl_tensor.shape[0] = mel.num_frames;
+	audio->data.dl_tensor.shape[1] = mel.n_mels;
+	audio->data.dl_tensor.strides = malloc(2 * sizeof(int64_t));
+	audio->data.dl_tensor.strides[0] = mel.n_mels;
+	audio->data.dl_tensor.strides[1] = 1;
+	audio->itemsize = sizeof(float);
+	strcpy(audio->fmt, AV_NE("f32be", "f32le"));
+
+	size_t features_len = mel.num_frames * mel.n_mels * sizeof(float);
+	if(session->output_options.allocator)
+	{
+		if(alloc_output(audio, session->output_options.allocator, features_len))
+			memcpy(audio->data.dl_tensor.data, features, features_len);
+		else
+			strcpy(audio->error, "Cannot allocate output");
+		free(features);
+	}
+	else
+	{
+		audio->data.dl_tensor.data = features;
+		audio->data.deleter = deleter;
+	}
+	session->stats.alloc_bytes += features_len;
+	free(chunk);
+	log_mel_free(&mel);
+	return audio->error[0] ? -1 : 0;
+}
+
+static int session_restart(struct DecodeAudioSession* session, struct DecodeAudio* audio)
+{
+	// before another seek on the open input: decoder, resampler and graph start over as right after opening
+	AVCodecContext* dec_ctx = session->dec_ctx;
+	avcodec_flush_buffers(dec_ctx);
+	session->eof = false;
+	session->skip_samples = 0;
+	if(session->resample)
+		return configure_resampler(session, dec_ctx->sample_rate, dec_ctx->sample_fmt, dec_ctx->channel_layout, audio->sample_rate, session->output_options.channels_first && !session->streaming ? av_get_planar_sample_fmt(session->out_sample_fmt) : session->out_sample_fmt, audio->error);
+	return configure_graph(session, dec_ctx->sample_rate, dec_ctx->sample_fmt, dec_ctx->channel_layout, audio->sample_rate, session->out_sample_fmt, audio->error);
+}
+
+static int session_decode_output(struct DecodeAudioSession* session, const char* input_path, struct DecodeAudio input_options, struct DecodeAudio* audio, const char* cache_key)
+{
+	// decodes the opened input into what the session's output options ask for (its own allocation, the caller slot or features),
+	// stores the result under cache_key when set
+	struct DecodeAudio output_options = session->output_options;
+	struct output_slot slot = { 0 };
+	uint8_t* scratch = NULL;
+
+	if(output_options.n_mels > 0)
+	{
+		decode_log_mel(session, audio);
+		goto end;
+	}
+
+	uint64_t data_len = 0;
+	if(output_options.data.dl_tensor.data)
+	{
+		if(!output_slot(&output_options, audio, &slot))
+			goto end;
+		// nothing past the slot is decoded at all
+		session->max_samples = session->max_samples >= 0 ? FFMIN(session->max_samples, slot.capacity) : slot.capacity;
+		data_len = slot.capacity * audio->num_channels * audio->itemsize;
+		if(!slot.direct)
+		{
+			scratch = malloc(FFMAX(1, data_len));
+			session->stats.alloc_bytes += data_len;
+		}
+		audio->data.dl_tensor.data = slot.direct ? slot.base : scratch;
+	}
+	else
+	{
+		data_len = audio->num_samples * audio->num_channels * audio->itemsize;
+		if(!alloc_output(audio, output_options.allocator, data_len))
+		{
+			strcpy(audio->error, "Cannot allocate output");
+			goto end;
+		}
+		session->stats.alloc_bytes += data_len;
+	}
+
+	// channel rows span the whole capacity (or follow the slot), row stride stays put if fewer samples get decoded
+	session->plane_stride = 0;
+	if(audio->channels_first)
+	{
+		data_len /= audio->num_channels;
+		session->plane_stride = slot.direct ? slot.channel_stride : data_len;
+		audio->data.dl_tensor.strides[0] = session->plane_stride / audio->itemsize;
+	}
+
+	uint8_t* data_ptr = audio->data.dl_tensor.data;
+	uint64_t frame_stride = audio->channels_first ? audio->itemsize : audio->num_channels * audio->itemsize;
+	int64_t num_decoded = decode_segments(session, input_path, input_options, audio, data_len / frame_stride);
+	if(num_decoded >= 0)
+		data_ptr += num_decoded * frame_stride;
+	int64_t max_samples = session->max_samples;
+	uint64_t capacity = data_len;
+	bool from_start = false;
+	for (int attempt = 0; num_decoded < 0 && attempt < 3; attempt++)
+	{
+		if(attempt > 0)
+		{
+			// a seek index the demuxer disagreed with is retried as a timestamp seek, otherwise the demuxer landed past the start of the range
+			// (estimated seeks without a TOC or index) and the range is decoded again from the beginning of the input
+			int64_t target = session->seek_target;
+			from_start = !session->seek_index_mismatch;
+			session->seek_index_mismatch = false;
+			data_ptr = audio->data.dl_tensor.data;
+			data_len = capacity;
+			if(session_restart(session, audio) < 0 || session_seek(session, from_start ? 0 : target, audio->error) < 0)
+				goto end;
+			session->seek_target = target;
+			session->max_samples = max_samples;
+		}
+		if(output_options.pipeline)
+			decode_pipelined(session, &data_ptr, &data_len, audio->itemsize);
+		else
+			while (session_read_packet(session, &data_ptr, &data_len, audio->itemsize) >= 0);
+		if(!session->seek_gap || from_start)
+			break;
+	}
+	if(session->seek_gap)
+	{
+		strcpy(audio->error, "Cannot seek sample-exactly");
+		goto end;
+	}
+
+	// the duration-based estimate may overshoot, report what was actually decoded
+	audio->num_samples = (data_ptr - (uint8_t*)audio->data.dl_tensor.data) / frame_stride;
+	audio->data.dl_tensor.shape[audio->channels_first ? 1 : 0] = audio->num_samples;
+	if(output_options.data.dl_tensor.ndim == 2)
+	{
+		// the returned tensor is the filled part of the slot
+		if(!slot.direct)
+			copy_to_slot(&slot, scratch, audio->num_samples, audio->num_channels, audio->itemsize, session->plane_stride);
+		pad_slot(&slot, audio->num_samples, audio->num_channels, audio->data.dl_tensor.dtype, output_options.pad_value);
+		audio->data.dl_tensor.data = slot.base;
+		audio->data.dl_tensor.strides[audio->channels_first ? 1 : 0] = slot.time_stride / audio->itemsize;
+		audio->data.dl_tensor.strides[audio->channels_first ? 0 : 1] = slot.channel_stride / audio->itemsize;
+		stage_end(&session->stats, STAGE_COPY_OUT, &session->timer);
+	}
+	if(cache_key != NULL)
+	{
+		cache_store(output_options.cache, cache_key, audio);
+		stage_end(&session->stats, STAGE_COPY_OUT, &session->timer);
+	}
+
+end:
+	free(scratch);
+	return audio->error[0] ? -1 : 0;
+}
+
+static void report_session_stats(struct DecodeAudioSession* session, struct DecodeAudio* audio)
+{
+	audio->stats = session->stats;
+	audio->stats.num_decodes = 1;
+	audio->stats.num_errors = audio->error[0] != '\0';
+	add_stats(&aggregate_stats, &audio->stats, true);
+	if(session->verbose)
+		print_stats(&audio->stats);
+}
+
+struct DecodeAudio decode_audio_session_decode(struct DecodeAudioSession* session, const char* input_path, struct DecodeAudio input_options, int probe)
+{
+	struct DecodeAudio audio = { 0 };
+	struct DecodeAudio output_options = session->output_options;
+
+	memset(&session->stats, 0, sizeof(session->stats));
+	stage_begin(&session->timer, output_options.profile);
+	if(!probe && decode_wav_fast(input_path, input_options, output_options, session->filter_string, &audio))
+	{
+		// the whole zero-copy path is header parsing, it is charged to opening
+		stage_end(&session->stats, STAGE_OPEN, &session->timer);
+		goto stats;
+	}
+
+	// caller-provided output buffers bypass the cache, a hit could not fill them without a copy
+	char cache_key_buf[1024];
+	bool cached = !probe && output_options.cache != NULL && output_options.data.dl_tensor.data == NULL && output_options.n_mels == 0 && cache_key(input_path, &input_options, &output_options, session->filter_string, cache_key_buf, sizeof(cache_key_buf));
+	if(cached && cache_lookup(output_options.cache, cache_key_buf, output_options.allocator, &audio))
+	{
+		stage_end(&session->stats, STAGE_OPEN, &session->timer);
+		session->stats.num_cache_hits = 1;
+		goto stats;
+	}
+
+	if(session_open_input(session, input_path, input_options, &audio, probe) < 0 || probe)
+		goto end;
+	session_decode_output(session, input_path, input_options, &audio, cached ? cache_key_buf : NULL);
+
+end:
+	if(audio.error[0])
+		release_failed_output(&audio);
+	session_close_input(session);
+
+stats:
+	report_session_stats(session, &audio);
+
+	//fprintf(stderr, "Error occurred: %s\n", av_err2str(ret));
+	return audio;
+}
+
+struct DecodeAudio decode_audio(const char* input_path, struct DecodeAudio input_options, struct DecodeAudio output_options, const char* filter_string, int probe, int verbose)
+{
+	struct DecodeAudio audio = { 0 };
+	if(filter_string != NULL && strlen(filter_string) > 512)
+	{
+		strcpy(audio.error, "Too long filter string");
+		return audio;
+	}
+
+	struct DecodeAudioSession* session = decode_audio_session_create(output_options, filter_string, verbose);
+	audio = decode_audio_session_decode(session, input_path, input_options, probe);
+	decode_audio_session_destroy(session);
+	return audio;
+}
+
+// random crops: windows are sorted and merged into spans (overlapping or closer than a second), every span is one seek and one bounded decode,
+// windows are copied out of their span so overlapping windows share decoded frames
+
+struct crop_window
+{
+	int64_t start;
+	int index;
+};
+
+static int compare_crop_windows(const void* a, const void* b)
+{
+	int64_t x = ((const struct crop_window*)a)->start, y = ((const struct crop_window*)b)->start;
+	return (x > y) - (x < y);
+}
+
+static uint64_t splitmix64(uint64_t* state)
+{
+	uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static int64_t decode_span(struct DecodeAudioSession* session, struct DecodeAudio* audio, int64_t start, int64_t len, uint8_t* data, bool from_start)
+{
+	// decodes output samples [start, start + len) into data, returns how many there were; from_start skips up to start on the freshly opened input instead of seeking,
+	// a seek that lands past start is redone from the beginning of the input
+	uint64_t frame_stride = audio->num_channels * audio->itemsize;
+	uint8_t* data_ptr = data;
+	for(int attempt = 0; attempt < 2; attempt++)
+	{
+		if(from_start && attempt == 0)
+			session->skip_samples = start;
+		else
+		{
+			int64_t target = av_rescale(start, session->dec_ctx->sample_rate, audio->sample_rate);
+			if(session_restart(session, audio) < 0 || session_seek(session, attempt == 0 ? target : 0, audio->error) < 0)
+				return -1;
+			session->seek_target = target;
+		}
+		session->max_samples = len;
+		data_ptr = data;
+		uint64_t data_len = len * frame_stride;
+		while (session_read_packet(session, &data_ptr, &data_len, audio->itemsize) >= 0);
+		if(!session->seek_gap)
+			break;
+	}
+	return (data_ptr - data) / frame_stride;
+}
+
+struct DecodeAudio decode_audio_crops(const char* input_path, struct DecodeAudio input_options, struct DecodeAudio output_options, const char* filter_string, int num_crops, uint64_t crop_samples, const int64_t* starts, uint64_t seed, int64_t* crop_starts, uint64_t* num_samples, int verbose)
+{
+	// num_crops windows of crop_samples output samples as a zero-padded [K, T, C] (or [K, C, T]) tensor; starts (in output samples) are given or drawn uniformly from seed,
+	// crop_starts receives the starts used and num_samples the valid length of every window
+	struct DecodeAudio audio = { 0 };
+	if(num_crops <= 0 || crop_samples == 0)
+	{
+		strcpy(audio.error, "Invalid crop options");
+		return audio;
+	}
+	if(output_options.n_mels > 0)
+	{
+		strcpy(audio.error, "Features are not supported for crops");
+		return audio;
+	}
+
+	// spans decode interleaved into scratch, channels-first is applied while copying windows out
+	int channels_first = output_options.channels_first;
+	output_options.channels_first = output_options.pipeline = output_options.num_segments = 0;
+	output_options.data.dl_tensor.data = NULL;
+	input_options.offset = input_options.duration = 0;
+	struct DecodeAudioSession* session = decode_audio_session_create(output_options, filter_string, verbose);
+	if(!session)
+	{
+		strcpy(audio.error, "Too long filter string");
+		return audio;
+	}
+	session->windowed = true;
+
+	struct crop_window* windows = malloc(num_crops * sizeof(struct crop_window));
+	uint8_t* span = NULL;
+	if(session_open_input(session, input_path, input_options, &audio, false) < 0)
+		goto end;
+	int64_t total = audio.num_samples;
+	if(starts == NULL && total == 0)
+	{
+		strcpy(audio.error, "Cannot draw crops from an input of unknown duration");
+		goto end;
+	}
+	uint64_t state = seed;
+	for(int i = 0; i < num_crops; i++)
+	{
+		int64_t start = starts != NULL ? FFMAX(0, starts[i]) : total > crop_samples ? (int64_t)(splitmix64(&state) % (total - crop_samples + 1)) : 0;
+		windows[i] = (struct crop_window){ start, i };
+		if(crop_starts)
+			crop_starts[i] = start;
+	}
+	qsort(windows, num_crops, sizeof(struct crop_window), compare_crop_windows);
+
+	int num_channels = audio.num_channels, itemsize = audio.itemsize;
+	uint64_t frame_stride = num_channels * itemsize, row_len = crop_samples * frame_stride;
+	free(audio.data.dl_tensor.shape);
+	free(audio.data.dl_tensor.strides);
+	audio.num_samples = crop_samples;
+	audio.duration = (double)crop_samples / audio.sample_rate;
+	audio.channels_first = channels_first;
+	audio.data.dl_tensor.ndim = 3;
+	audio.data.dl_tensor.shape = malloc(3 * sizeof(int64_t));
+	audio.data.dl_tensor.shape[0] = num_crops;
+	audio.data.dl_tensor.shape[channels_first ? 2 : 1] = crop_samples;
+	audio.data.dl_tensor.shape[channels_first ? 1 : 2] = num_channels;
+	audio.data.dl_tensor.strides = malloc(3 * sizeof(int64_t));
+	audio.data.dl_tensor.strides[0] = audio.data.dl_tensor.shape[1] * audio.data.dl_tensor.shape[2];
+	audio.data.dl_tensor.strides[1] = audio.data.dl_tensor.shape[2];
+	audio.data.dl_tensor.strides[2] = 1;
+	if(!alloc_output(&audio, output_options.allocator, num_crops * row_len))
+	{
+		strcpy(audio.error, "Cannot allocate output");
+		goto end;
+	}
+	session->stats.alloc_bytes += num_crops * row_len;
+	// windows running past the end are zero-padded
+	memset(audio.data.dl_tensor.data, 0, num_crops * row_len);
+
+	// decoding through a gap of up to a second is cheaper than seeking with pre-roll; unseekable inputs are one span decoded from the start
+	AVIOContext* pb = session->fmt_ctx->pb;
+	bool seekable = pb != NULL && (pb->seekable & AVIO_SEEKABLE_NORMAL);
+	int64_t max_gap = seekable ? (int64_t)audio.sample_rate : INT64_MAX;
+	size_t span_capacity = 0;
+	for(int first = 0, last; first < num_crops; first = last + 1)
+	{
+		int64_t span_start = windows[first].start, span_end = span_start + crop_samples;
+		for(last = first; last + 1 < num_crops && windows[last + 1].start - span_end <= max_gap; last++)
+			span_end = FFMAX(span_end, windows[last + 1].start + (int64_t)crop_samples);
+		if(!seekable)
+			span_start = 0;
+
+		if((span_end - span_start) * frame_stride > span_capacity)
+		{
+			span_capacity = (span_end - span_start) * frame_stride;
+			free(span);
+			span = malloc(span_capacity);
+		}
+		int64_t decoded = decode_span(session, &audio, span_start, span_end - span_start, span, first == 0 && span_start <= max_gap);
+		if(decoded < 0)
+			goto end;
+
+		stage_begin(&session->timer, output_options.profile);
+		for(int w = first; w <= last; w++)
+		{
+			int64_t offset = windows[w].start - span_start, n = FFMAX(0, FFMIN((int64_t)crop_samples, decoded - offset));
+			uint8_t* row = (uint8_t*)audio.data.dl_tensor.data + windows[w].index * row_len;
+			if(num_samples)
+				num_samples[windows[w].index] = n;
+			if(!channels_first)
+			{
+				memcpy(row, span + offset * frame_stride, n * frame_stride);
+				continue;
+			}
+			uint8_t* planes[num_channels];
+			for(int c = 0; c < num_channels; c++)
+				planes[c] = row + c * crop_samples * itemsize;
+			deinterleave(planes, span + offset * frame_stride, num_channels, n, itemsize);
+		}
+		stage_end(&session->stats, STAGE_COPY_OUT, &session->timer);
+	}
+
+end:
+	if(audio.error[0])
+		release_failed_output(&audio);
+	session_close_input(session);
+	audio.stats = session->stats;
+	audio.stats.num_decodes = 1;
+	audio.stats.num_errors = audio.error[0] != '\0';
+	add_stats(&aggregate_stats, &audio.stats, true);
+	if(verbose)
+		print_stats(&audio.stats);
+	decode_audio_session_destroy(session);
+	free(windows);
+	free(span);
+	return audio;
+}
+
+// multi-stream decoding: one demuxer pass over the container, packets go by stream_index to a session per selected audio stream
+// (decoder, resampler / graph, output buffer of its own); with threads every stream decodes on its own thread fed through a packet ring
+
+struct stream_track
+{
+	struct DecodeAudioSession* session;
+	struct DecodeAudio* audio;
+	uint8_t* data_ptr;
+	uint64_t data_len;
+	// what data_len and the session's max_samples start at, for a second pass
+	uint64_t capacity;
+	int64_t max_samples;
+	// set once the output is full or the decoder failed, further packets are dropped by the demuxer
+	int done;
+	bool threaded;
+	pthread_t thread;
+	AVPacket* packets[PIPELINE_POOL_SIZE];
+	struct spsc_ring packet_ring, free_packet_ring;
+};
+
+static void track_decode(struct stream_track* track, AVPacket* pkt)
+{
+	// pkt == NULL drains the decoder at the end of the input
+	struct DecodeAudioSession* session = track->session;
+	if(__atomic_load_n(&track->done, __ATOMIC_RELAXED))
+		return;
+	if(!pkt)
+	{
+		pkt = session->pkt;
+		av_packet_unref(pkt);
+	}
+	stage_begin(&session->timer, session->output_options.profile);
+	if(decode_packet(session, pkt, &track->data_ptr, &track->data_len, track->audio->itemsize) < 0 || session->max_samples == 0 || !pkt->data)
+		__atomic_store_n(&track->done, 1, __ATOMIC_RELAXED);
+}
+
+static void* stream_track_worker(void* arg)
+{
+	struct stream_track* track = (struct stream_track*)arg;
+	for (;;)
+	{
+		AVPacket* pkt = ring_pop(&track->packet_ring);
+		track_decode(track, pkt);
+		if(!pkt)
+			break;
+		av_packet_unref(pkt);
+		ring_push(&track->free_packet_ring, pkt);
+	}
+	return NULL;
+}
+
+static bool start_track_worker(struct stream_track* track)
+{
+	ring_init(&track->packet_ring, 2 * PIPELINE_POOL_SIZE);
+	ring_init(&track->free_packet_ring, 2 * PIPELINE_POOL_SIZE);
+	for (int i = 0; i < PIPELINE_POOL_SIZE; i++)
+	{
+		if(!(track->packets[i] = av_packet_alloc()))
+			return false;
+		ring_push(&track->free_packet_ring, track->packets[i]);
+	}
+	track->threaded = pthread_create(&track->thread, NULL, stream_track_worker, track) == 0;
+	return track->threaded;
+}
+
+static void stop_track_worker(struct stream_track* track)
+{
+	// rings are initialized for every track that tried to start a worker, unstarted ones only free their pool
+	if(track->threaded)
+	{
+		ring_push(&track->packet_ring, NULL);
+		pthread_join(track->thread, NULL);
+		track->threaded = false;
+	}
+	if(track->packet_ring.slots)
+	{
+		for (int i = 0; i < PIPELINE_POOL_SIZE; i++)
+			av_packet_free(&track->packets[i]);
+		ring_destroy(&track->packet_ring);
+		ring_destroy(&track->free_packet_ring);
+		track->packet_ring.slots = NULL;
+	}
+}
+
+static void demux_tracks(struct DecodeAudioSession* demux, struct stream_track* tracks, const int* track_of, int num_streams)
+{
+	// feeds every packet to the decoder (or worker) of its stream until the input ends or every track is done, then drains the decoders
+	AVFormatContext* fmt_ctx = demux->fmt_ctx;
+	AVPacket* pkt = demux->pkt;
+	for (;;)
+	{
+		stage_begin(&demux->timer, demux->output_options.profile);
+		int ret = av_read_frame(fmt_ctx, pkt);
+		stage_end(&demux->stats, STAGE_DEMUX, &demux->timer);
+		if(ret < 0)
+			break;
+		struct stream_track* track = pkt->stream_index < fmt_ctx->nb_streams && track_of[pkt->stream_index] >= 0 ? &tracks[track_of[pkt->stream_index]] : NULL;
+		if(track && track->threaded && !__atomic_load_n(&track->done, __ATOMIC_RELAXED))
+		{
+			// the free ring blocks the demuxer while the stream's decoder is a pool behind
+			AVPacket* queued = ring_pop(&track->free_packet_ring);
+			av_packet_move_ref(queued, pkt);
+			ring_push(&track->packet_ring, queued);
+		}
+		else if(track && !track->threaded)
+			track_decode(track, pkt);
+		av_packet_unref(pkt);
+
+		bool all_done = true;
+		for (int i = 0; all_done && i < num_streams; i++)
+			all_done = __atomic_load_n(&tracks[i].done, __ATOMIC_RELAXED);
+		if(all_done)
+			break;
+	}
+
+	for (int i = 0; i < num_streams; i++)
+	{
+		if(!tracks[i].threaded)
+			track_decode(&tracks[i], NULL);
+		stop_track_worker(&tracks[i]);
+	}
+}
+
+int decode_audio_streams(const char* input_path, struct DecodeAudio input_options, struct DecodeAudio output_options, const char* filter_string, const int* select, int num_select, int* stream_indices, struct DecodeAudio* results, int max_streams, int num_threads, int verbose)
+{
+	// decodes the audio streams listed in select (container stream indices, or every audio stream if num_select == 0) into results, one tensor and metadata each;
+	// stream_indices receives the container index of every result, returns the number of results or -1 with the error in results[0]
+	if(max_streams <= 0)
+		return -1;
+	memset(results, 0, max_streams * sizeof(struct DecodeAudio));
+	if(output_options.n_mels > 0 || output_options.data.dl_tensor.data)
+	{
+		strcpy(results[0].error, "Features and output buffers need a single stream");
+		return -1;
+	}
+	if(filter_string != NULL && strlen(filter_string) > 512)
+	{
+		strcpy(results[0].error, "Too long filter string");
+		return -1;
+	}
+
+	// the demuxing session only owns the container, its stats cover opening and reading
+	struct DecodeAudioSession* demux = decode_audio_session_create(output_options, NULL, verbose);
+	int num_streams = -1;
+	struct stream_track* tracks = NULL;
+	int* track_of = NULL;
+	if(session_open_container(demux, input_path, input_options, &results[0], false) < 0)
+		goto end;
+	AVFormatContext* fmt_ctx = demux->fmt_ctx;
+	int nb_streams = fmt_ctx->nb_streams;
+
+	num_streams = 0;
+	for (int k = 0; k < (num_select > 0 ? num_select : nb_streams) && num_streams < max_streams; k++)
+	{
+		int stream_index = num_select > 0 ? select[k] : k;
+		bool audio = stream_index >= 0 && stream_index < nb_streams && fmt_ctx->streams[stream_index]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO;
+		if(num_select == 0 && !audio)
+			continue;
+		stream_indices[num_streams] = stream_index;
+		if(!audio)
+			snprintf(results[num_streams].error, sizeof(results[num_streams].error), "Stream %d is not an audio stream", stream_index);
+		num_streams++;
+	}
+	if(num_streams == 0)
+	{
+		strcpy(results[0].error, "Cannot find audio stream");
+		num_streams = -1;
+		goto end;
+	}
+	stage_end(&demux->stats, STAGE_STREAM_DISCOVERY, &demux->timer);
+
+	// streams nobody asked for are skipped by the demuxer where it can
+	track_of = malloc(nb_streams * sizeof(int));
+	for (int k = 0; k < nb_streams; k++)
+	{
+		track_of[k] = -1;
+		fmt_ctx->streams[k]->discard = AVDISCARD_ALL;
+	}
+
+	tracks = calloc(num_streams, sizeof(struct stream_track));
+	int seek_track = -1;
+	for (int i = 0; i < num_streams; i++)
+	{
+		struct stream_track* track = &tracks[i];
+		struct DecodeAudio* audio = &results[i];
+		track->audio = audio;
+		track->done = 1;
+		if(audio->error[0])
+			continue;
+		struct DecodeAudioSession* session = track->session = decode_audio_session_create(output_options, filter_string, verbose);
+		session->fmt_ctx = fmt_ctx;
+		session->shared_input = true;
+		session->stream_index = stream_indices[i];
+		memset(&session->stats, 0, sizeof(session->stats));
+		stage_begin(&session->timer, output_options.profile);
+		if(session_open_stream(session, input_options, audio, false) < 0)
+			continue;
+
+		track->data_len = audio->num_samples * audio->num_channels * audio->itemsize;
+		if(!alloc_output(audio, output_options.allocator, track->data_len))
+		{
+			strcpy(audio->error, "Cannot allocate output");
+			continue;
+		}
+		session->stats.alloc_bytes += track->data_len;
+		session->plane_stride = 0;
+		if(audio->channels_first)
+		{
+			track->data_len /= audio->num_channels;
+			session->plane_stride = track->data_len;
+			audio->data.dl_tensor.strides[0] = session->plane_stride / audio->itemsize;
+		}
+		track->data_ptr = audio->data.dl_tensor.data;
+		track->capacity = track->data_len;
+		track->max_samples = session->max_samples;
+		track->done = 0;
+		track_of[session->stream_index] = i;
+		fmt_ctx->streams[session->stream_index]->discard = AVDISCARD_DEFAULT;
+		if(seek_track < 0 || seek_preroll(fmt_ctx->streams[session->stream_index]) > seek_preroll(fmt_ctx->streams[tracks[seek_track].session->stream_index]))
+			seek_track = i;
+	}
+
+	if(input_options.offset > 0 && seek_track >= 0)
+	{
+		// one seek for all streams, backed off by the longest pre-roll; every other stream keeps the target set when it was opened
+		struct DecodeAudioSession* session = tracks[seek_track].session;
+		if(session_seek(session, session->seek_target, results[0].error) < 0)
+		{
+			num_streams = -1;
+			goto end;
+		}
+		stage_end(&demux->stats, STAGE_DEMUX, &demux->timer);
+	}
+
+	for (int i = 0; num_threads > 1 && num_streams > 1 && i < num_streams; i++)
+		if(!tracks[i].done)
+			start_track_worker(&tracks[i]);
+
+	demux_tracks(demux, tracks, track_of, num_streams);
+
+	// streams whose share of the seek landed past their own target (estimated seeks without a TOC or index) are decoded once more from the start
+	// of the input, serially and with the other streams discarded
+	int redo_track = -1;
+	for (int i = 0; i < num_streams; i++)
+	{
+		struct stream_track* track = &tracks[i];
+		struct DecodeAudioSession* session = track->session;
+		track->done = 1;
+		if(!session || results[i].error[0] || !session->seek_gap)
+		{
+			if(session)
+				fmt_ctx->streams[session->stream_index]->discard = AVDISCARD_ALL;
+			continue;
+		}
+		if(session_restart(session, &results[i]) < 0)
+			continue;
+		track->data_ptr = results[i].data.dl_tensor.data;
+		track->data_len = track->capacity;
+		session->max_samples = track->max_samples;
+		track->done = 0;
+		if(redo_track < 0)
+			redo_track = i;
+	}
+	if(redo_track >= 0)
+	{
+		struct DecodeAudioSession* session = tracks[redo_track].session;
+		int64_t target = session->seek_target;
+		if(session_seek(session, 0, results[redo_track].error) == 0)
+		{
+			session->seek_target = target;
+			for (int i = 0; i < num_streams; i++)
+			{
+				if(tracks[i].done)
+					continue;
+				tracks[i].session->seek_pending = true;
+				tracks[i].session->seek_gap = false;
+			}
+			demux_tracks(demux, tracks, track_of, num_streams);
+		}
+	}
+
+	for (int i = 0; i < num_streams; i++)
+	{
+		struct stream_track* track = &tracks[i];
+		struct DecodeAudio* audio = &results[i];
+		if(!track->session || audio->error[0])
+			continue;
+		if(track->session->seek_gap)
+		{
+			strcpy(audio->error, "Cannot seek sample-exactly");
+			continue;
+		}
+
+		// the duration-based estimate may overshoot, report what was actually decoded
+		uint64_t frame_stride = audio->channels_first ? audio->itemsize : audio->num_channels * audio->itemsize;
+		audio->num_samples = (track->data_ptr - (uint8_t*)audio->data.dl_tensor.data) / frame_stride;
+		audio->data.dl_tensor.shape[audio->channels_first ? 1 : 0] = audio->num_samples;
+	}
+
+end:
+	for (int i = 0; tracks && i < num_streams; i++)
+	{
+		struct DecodeAudio* audio = &results[i];
+		if(tracks[i].session)
+		{
+			session_close_input(tracks[i].session);
+			audio->stats = tracks[i].session->stats;
+			decode_audio_session_destroy(tracks[i].session);
+		}
+		if(audio->error[0])
+			release_failed_output(audio);
+		// the file counts as one decode, its streams add their own stages and errors
+		audio->stats.num_errors = audio->error[0] != '\0';
+		add_stats(&aggregate_stats, &audio->stats, true);
+		if(verbose)
+			print_stats(&audio->stats);
+	}
+	session_close_input(demux);
+	demux->stats.num_decodes = 1;
+	demux->stats.num_errors = num_streams < 0;
+	add_stats(&aggregate_stats, &demux->stats, true);
+	if(verbose)
+		print_stats(&demux->stats);
+	decode_audio_session_destroy(demux);
+	free(tracks);
+	free(track_of);
+	return num_streams;
+}
+
+struct DecodeAudioStream
+{
+	struct DecodeAudioSession* session;
+	// metadata of the opened input, shared by every chunk
+	struct DecodeAudio audio;
+};
+
+void decode_audio_stream_close(struct DecodeAudioStream* stream)
+{
+	if(!stream)
+		return;
+	if(stream->session)
+	{
+		session_close_input(stream->session);
+		// a stream counts as one decode, its counters are aggregated once it is done
+		stream->session->stats.num_decodes = 1;
+		add_stats(&aggregate_stats, &stream->session->stats, true);
+		if(stream->session->verbose)
+			print_stats(&stream->session->stats);
+		decode_audio_session_destroy(stream->session);
+	}
+	free(stream->audio.data.dl_tensor.shape);
+	free(stream->audio.data.dl_tensor.strides);
+	free(stream);
+}
+
+struct DecodeAudioStream* decode_audio_stream_open(const char* input_path, struct DecodeAudio input_options, struct DecodeAudio output_options, const char* filter_string, struct DecodeAudio* audio, int verbose)
+{
+	// pull-style decoding, samples are queued in a FIFO that never holds much more than one requested chunk
+	struct DecodeAudioStream* stream = calloc(1, sizeof(struct DecodeAudioStream));
+	memset(audio, 0, sizeof(struct DecodeAudio));
+
+	if(output_options.n_mels > 0)
+	{
+		strcpy(audio->error, "Features are not supported for streams");
+		goto fail;
+	}
+
+	output_options.data.dl_tensor.data = NULL;
+	stream->session = decode_audio_session_create(output_options, filter_string, verbose);
+	if(!stream->session)
+	{
+		strcpy(audio->error, "Too long filter string");
+		goto fail;
+	}
+	stream->session->streaming = true;
+
+	if(session_open_input(stream->session, input_path, input_options, &stream->audio, false) < 0)
+	{
+		strcpy(audio->error, stream->audio.error);
+		goto fail;
+	}
+
+	stream->session->fifo = av_audio_fifo_alloc(stream->session->out_sample_fmt, stream->audio.num_channels, 1);
+	if(!stream->session->fifo)
+	{
+		strcpy(audio->error, "Cannot allocate FIFO");
+		goto fail;
+	}
+
+	*audio = stream->audio;
+	audio->data.dl_tensor.shape = audio->data.dl_tensor.strides = NULL;
+	return stream;
+
+fail:
+	if(stream->session)
+		stream->session->stats.num_errors = 1;
+	decode_audio_stream_close(stream);
+	return NULL;
+}
+
+struct DecodeAudio decode_audio_stream_read(struct DecodeAudioStream* stream, uint64_t num_samples)
+{
+	// returns up to num_samples samples, a chunk with zero samples marks the end of the stream
+	struct DecodeAudioSession* session = stream->session;
+	struct DecodeAudio chunk = stream->audio;
+	memset(&chunk.data, 0, sizeof(chunk.data));
+
+	while (av_audio_fifo_size(session->fifo) < num_samples && session_read_packet(session, NULL, NULL, chunk.itemsize) >= 0);
+
+	stage_begin(&session->timer, session->output_options.profile);
+	chunk.num_samples = FFMIN(num_samples, (uint64_t)av_audio_fifo_size(session->fifo));
+	chunk.duration = (double)chunk.num_samples / chunk.sample_rate;
+	init_tensor(&chunk, stream->audio.data.dl_tensor.dtype, stream->audio.channels_first);
+	size_t chunk_len = FFMAX(1, chunk.num_samples * chunk.num_channels * chunk.itemsize);
+	if(!alloc_output(&chunk, session->output_options.allocator, chunk_len))
+	{
+		// an empty chunk ends the stream, the error says why
+		strcpy(chunk.error, "Cannot allocate output");
+		chunk.num_samples = 0;
+		session->stats.num_errors = 1;
+		chunk.stats = session->stats;
+		return chunk;
+	}
+	session->stats.alloc_bytes += chunk_len;
+
+	// the FIFO holds interleaved samples, channels-first chunks are deinterleaved on the way out
+	void* planes[] = { chunk.data.dl_tensor.data };
+	if(chunk.channels_first)
+	{
+		av_fast_malloc(&session->fifo_scratch, &session->fifo_scratch_size, chunk_len);
+		planes[0] = session->fifo_scratch;
+	}
+	av_audio_fifo_read(session->fifo, planes, chunk.num_samples);
+	if(chunk.channels_first)
+	{
+		uint8_t* rows[chunk.num_channels];
+		for (int c = 0; c < chunk.num_channels; c++)
+			rows[c] = (uint8_t*)chunk.data.dl_tensor.data + c * chunk.num_samples * chunk.itemsize;
+		deinterleave(rows, planes[0], chunk.num_channels, chunk.num_samples, chunk.itemsize);
+	}
+	stage_end(&session->stats, STAGE_COPY_OUT, &session->timer);
+
+	// every chunk reports the counters of the stream so far
+	chunk.stats = session->stats;
+	return chunk;
+}
+
+// push decoding: the caller feeds network chunks and drains whatever PCM is ready, a worker thread demuxes and decodes as soon as a packet is complete;
+// the worker holds the lock except while it waits for input or for room in the output FIFO, so feed and drain never block on I/O
+
+enum { DECODE_AUDIO_PUSH_FAILED = -1, DECODE_AUDIO_PUSH_OPENING, DECODE_AUDIO_PUSH_DECODING, DECODE_AUDIO_PUSH_STARVED, DECODE_AUDIO_PUSH_DONE };
+
+struct DecodeAudioPush
+{
+	struct DecodeAudioSession* session;
+	// metadata once the stream header is parsed, error when it failed
+	struct DecodeAudio audio;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int state;
+	bool waiting_input;
+	bool finished;
+	bool closing;
+
+	// bounded ring of fed bytes not yet read by the demuxer
+	uint8_t* ring;
+	uint64_t capacity;
+	uint64_t head;
+	uint64_t size;
+	// the worker stops decoding while this many samples wait to be drained
+	uint64_t max_output_samples;
+};
+
+static int push_read(void* opaque, uint8_t* buf, int buf_size)
+{
+	// called by the demuxer on the worker with the lock held, returns whatever is there (short reads are fine) and only waits when nothing is
+	struct DecodeAudioPush* push = (struct DecodeAudioPush*)opaque;
+	while (push->size == 0 && !push->finished && !push->closing)
+	{
+		push->waiting_input = true;
+		pthread_cond_broadcast(&push->cond);
+		pthread_cond_wait(&push->cond, &push->lock);
+	}
+	push->waiting_input = false;
+	if(push->size == 0 || push->closing)
+		return AVERROR_EOF;
+
+	int n = (int)FFMIN((uint64_t)buf_size, push->size);
+	uint64_t first = FFMIN((uint64_t)n, push->capacity - push->head);
+	memcpy(buf, push->ring + push->head, first);
+	memcpy(buf + first, push->ring, n - first);
+	push->head = (push->head + n) % push->capacity;
+	push->size -= n;
+	return n;
+}
+
+static void* push_worker(void* arg)
+{
+	struct DecodeAudioPush* push = (struct DecodeAudioPush*)arg;
+	struct DecodeAudioSession* session = push->session;
+	struct DecodeAudio input_options = { 0 };
+	pthread_mutex_lock(&push->lock);
+
+	if(session_open_input(session, NULL, input_options, &push->audio, false) < 0)
+		push->state = DECODE_AUDIO_PUSH_FAILED;
+	else if(!(session->fifo = av_audio_fifo_alloc(session->out_sample_fmt, push->audio.num_channels, 1)))
+	{
+		strcpy(push->audio.error, "Cannot allocate FIFO");
+		push->state = DECODE_AUDIO_PUSH_FAILED;
+	}
+	else
+		push->state = DECODE_AUDIO_PUSH_DECODING;
+	pthread_cond_broadcast(&push->cond);
+
+	while (push->state == DECODE_AUDIO_PUSH_DECODING && !push->closing)
+	{
+		if(av_audio_fifo_size(session->fifo) >= push->max_output_samples)
+		{
+			pthread_cond_wait(&push->cond, &push->lock);
+			continue;
+		}
+		int ret = session_read_packet(session, NULL, NULL, push->audio.itemsize);
+		if(ret < 0)
+			push->state = DECODE_AUDIO_PUSH_DONE;
+		pthread_cond_broadcast(&push->cond);
+	}
+	if(push->state == DECODE_AUDIO_PUSH_FAILED)
+		session->stats.num_errors = 1;
+
+	pthread_mutex_unlock(&push->lock);
+	return NULL;
+}
+
+struct DecodeAudioPush* decode_audio_push_create(struct DecodeAudio output_options, const char* filter_string, uint64_t max_input_bytes, uint64_t max_output_samples, char* error, int verbose)
+{
+	// max_input_bytes bounds the fed but not yet demuxed bytes (feed accepts less once full), max_output_samples the decoded but not yet drained ones
+	if(output_options.n_mels > 0 || output_options.channels_first)
+	{
+		strcpy(error, "Features and channels-first output are not supported for push decoding");
+		return NULL;
+	}
+	output_options.data.dl_tensor.data = NULL;
+	output_options.pipeline = output_options.num_segments = 0;
+	struct DecodeAudioSession* session = decode_audio_session_create(output_options, filter_string, verbose);
+	if(!session)
+	{
+		strcpy(error, "Too long filter string");
+		return NULL;
+	}
+
+	struct DecodeAudioPush* push = calloc(1, sizeof(struct DecodeAudioPush));
+	push->session = session;
+	session->streaming = true;
+	session->read_input = push_read;
+	session->read_input_opaque = push;
+	push->capacity = max_input_bytes > 0 ? max_input_bytes : 1 << 16;
+	push->max_output_samples = max_output_samples > 0 ? max_output_samples : 1 << 16;
+	push->ring = malloc(push->capacity);
+	session->stats.alloc_bytes += push->capacity;
+	pthread_mutex_init(&push->lock, NULL);
+	pthread_cond_init(&push->cond, NULL);
+	if(pthread_create(&push->thread, NULL, push_worker, push) != 0)
+	{
+		pthread_mutex_destroy(&push->lock);
+		pthread_cond_destroy(&push->cond);
+		decode_audio_session_destroy(session);
+		free(push->ring);
+		free(push);
+		strcpy(error, "Cannot start decoding thread");
+		return NULL;
+	}
+	return push;
+}
+
+void decode_audio_push_destroy(struct DecodeAudioPush* push)
+{
+	if(!push)
+		return;
+	pthread_mutex_lock(&push->lock);
+	push->closing = true;
+	pthread_cond_broadcast(&push->cond);
+	pthread_mutex_unlock(&push->lock);
+	pthread_join(push->thread, NULL);
+
+	struct DecodeAudioSession* session = push->session;
+	session_close_input(session);
+	// a push decoder counts as one decode, its counters are aggregated once it is done
+	session->stats.num_decodes = 1;
+	add_stats(&aggregate_stats, &session->stats, true);
+	if(session->verbose)
+		print_stats(&session->stats);
+	decode_audio_session_destroy(session);
+	pthread_mutex_destroy(&push->lock);
+	pthread_cond_destroy(&push->cond);
+	free(push->audio.data.dl_tensor.shape);
+	free(push->audio.data.dl_tensor.strides);
+	free(push->ring);
+	free(push);
+}
+
+uint64_t decode_audio_push_feed(struct DecodeAudioPush* push, const uint8_t* data, uint64_t size)
+{
+	// copies as much as fits into the input ring and returns how much that was, the rest must be fed again after a drain
+	pthread_mutex_lock(&push->lock);
+	uint64_t n = push->finished ? 0 : FFMIN(size, push->capacity - push->size);
+	uint64_t tail = (push->head + push->size) % push->capacity, first = FFMIN(n, push->capacity - tail);
+	memcpy(push->ring + tail, data, first);
+	memcpy(push->ring, data + first, n - first);
+	push->size += n;
+	if(n > 0)
+		pthread_cond_broadcast(&push->cond);
+	pthread_mutex_unlock(&push->lock);
+	return n;
+}
+
+void decode_audio_push_finish(struct DecodeAudioPush* push)
+{
+	// end of input: the demuxer sees EOF once the ring is empty and the decoder is flushed
+	pthread_mutex_lock(&push->lock);
+	push->finished = true;
+	pthread_cond_broadcast(&push->cond);
+	pthread_mutex_unlock(&push->lock);
+}
+
+int decode_audio_push_poll(struct DecodeAudioPush* push, struct DecodeAudio* audio)
+{
+	// returns the DECODE_AUDIO_PUSH_* state and, when audio is given, the stream metadata, error and counters so far;
+	// STARVED means everything fed so far has been decoded and drain returns the rest
+	pthread_mutex_lock(&push->lock);
+	int state = push->state;
+	if(state == DECODE_AUDIO_PUSH_DECODING && push->waiting_input && push->size == 0)
+		state = DECODE_AUDIO_PUSH_STARVED;
+	if(audio)
+	{
+		*audio = push->audio;
+		audio->data.dl_tensor.shape = audio->data.dl_tensor.strides = NULL;
+		audio->data.dl_tensor.ndim = 0;
+		audio->stats = push->session->stats;
+	}
+	pthread_mutex_unlock(&push->lock);
+	return state;
+}
+
+int64_t decode_audio_push_drain(struct DecodeAudioPush* push, uint8_t* data, uint64_t max_samples)
+{
+	// copies up to max_samples interleaved samples into data, 0 when none are ready yet and -1 once the stream has ended (or failed) and everything was drained
+	struct DecodeAudioSession* session = push->session;
+	pthread_mutex_lock(&push->lock);
+	int64_t num_samples = 0;
+	if(push->state == DECODE_AUDIO_PUSH_DECODING || push->state == DECODE_AUDIO_PUSH_DONE)
+	{
+		stage_begin(&session->timer, session->output_options.profile);
+		void* planes[] = { data };
+		num_samples = av_audio_fifo_read(session->fifo, planes, FFMIN(max_samples, (uint64_t)av_audio_fifo_size(session->fifo)));
+		stage_end(&session->stats, STAGE_COPY_OUT, &session->timer);
+		if(num_samples > 0)
+			pthread_cond_broadcast(&push->cond);
+	}
+	if(num_samples == 0 && (push->state == DECODE_AUDIO_PUSH_DONE || push->state == DECODE_AUDIO_PUSH_FAILED))
+		num_samples = -1;
+	pthread_mutex_unlock(&push->lock);
+	return num_samples;
+}
+
+struct decode_audio_batch_state
+{
+	const char** input_paths;
+	struct DecodeAudio* input_options;
+	struct DecodeAudio output_options;
+	const char* filter_string;
+	int verbose;
+	struct DecodeAudio* results;
+	// items opened up front, decoded afterwards into their rows of batch (into their own allocation when it is NULL)
+	struct DecodeAudioSession** sessions;
+	struct DecodeAudio* batch;
+};
+
+static void decode_audio_batch_item(void* opaque, int i)
+{
+	struct decode_audio_batch_state* state = (struct decode_audio_batch_state*)opaque;
+	struct DecodeAudio input_options = { 0 };
+	if(state->input_options)
+		input_options = state->input_options[i];
+	struct DecodeAudio* result = &state->results[i];
+	*result = decode_audio(state->input_paths ? state->input_paths[i] : NULL, input_options, state->output_options, state->filter_string, false, state->verbose);
+	if(state->output_options.n_mels > 0 && result->error[0] == '\0')
+	{
+		// features collate like samples: frames pad along time, mel bins take the place of channels
+		result->num_samples = result->data.dl_tensor.shape[0];
+		result->num_channels = result->data.dl_tensor.shape[1];
+	}
+}
+
+static void open_batch_item(void* opaque, int i)
+{
+	// header, decoder and resampler, the output is only known once every item is open
+	struct decode_audio_batch_state* state = (struct decode_audio_batch_state*)opaque;
+	struct DecodeAudio input_options = { 0 };
+	if(state->input_options)
+		input_options = state->input_options[i];
+	struct DecodeAudioSession* session = state->sessions[i] = decode_audio_session_create(state->output_options, state->filter_string, state->verbose);
+	memset(&session->stats, 0, sizeof(session->stats));
+	stage_begin(&session->timer, state->output_options.profile);
+	session_open_input(session, state->input_paths ? state->input_paths[i] : NULL, input_options, &state->results[i], false);
+}
+
+static void finish_batch_item(struct decode_audio_batch_state* state, int i)
+{
+	struct DecodeAudio* result = &state->results[i];
+	if(result->error[0])
+		release_failed_output(result);
+	session_close_input(state->sessions[i]);
+	report_session_stats(state->sessions[i], result);
+	decode_audio_session_destroy(state->sessions[i]);
+	state->sessions[i] = NULL;
+}
+
+static void decode_opened_batch_item(void* opaque, int i)
+{
+	struct decode_audio_batch_state* state = (struct decode_audio_batch_state*)opaque;
+	struct DecodeAudio input_options = { 0 };
+	if(state->input_options)
+		input_options = state->input_options[i];
+	struct DecodeAudioSession* session = state->sessions[i];
+	if(state->batch)
+	{
+		// row i is a [T_max, C] ([C, T_max]) view of the batch, shape and strides past the batch dimension
+		DLTensor* batch = &state->batch->data.dl_tensor;
+		DLTensor* row = &session->output_options.data.dl_tensor;
+		*row = *batch;
+		row->ndim = 2;
+		row->shape = batch->shape + 1;
+		row->strides = batch->strides + 1;
+		row->byte_offset = i * batch->strides[0] * state->batch->itemsize;
+	}
+	session_decode_output(session, state->input_paths ? state->input_paths[i] : NULL, input_options, &state->results[i], NULL);
+	finish_batch_item(state, i);
+}
+
+static bool session_duration_exact(struct DecodeAudioSession* session)
+{
+	// sample counts and timestamps of the header are exact up to rounding, durations derived from the bitrate (raw MP3 without a Xing / VBRI
+	// header, ADTS) are not, neither is a missing per-stream duration
+	AVStream* stream = session->fmt_ctx->streams[session->stream_index];
+	return stream->duration != AV_NOPTS_VALUE && session->fmt_ctx->duration_estimation_method != AVFMT_DURATION_FROM_BITRATE;
+}
+
+static bool check_batch_items(struct DecodeAudio* results, int batch_size, char* error)
+{
+	// every item decoded (or opened) and agrees with item 0, errors name the first item that does not
+	for(int i = 0; i < batch_size; i++)
+	{
+		if(results[i].error[0])
+		{
+			snprintf(error, sizeof(results[i].error), "Item %d: %s", i, results[i].error);
+			return false;
+		}
+		if(i > 0 && (results[i].num_channels != results[0].num_channels || results[i].sample_rate != results[0].sample_rate || strcmp(results[i].fmt, results[0].fmt) != 0))
+		{
+			snprintf(error, sizeof(results[i].error), "Item %d: sample rate, format or number of channels differs from item 0", i);
+			return false;
+		}
+	}
+	return true;
+}
+
+static void release_batch_items(struct DecodeAudio* results, int batch_size)
+{
+	// own allocations, or only shape and strides of rows
+	for(int i = 0; i < batch_size; i++)
+		release_failed_output(&results[i]);
+	memset(results, 0, batch_size * sizeof(struct DecodeAudio));
+}
+
+static bool alloc_batch(struct DecodeAudio* audio, const struct DecodeAudio* results, int batch_size, uint64_t num_samples, int channels_first, struct DecodeAudioAllocator* allocator)
+{
+	// [B, T, C] (or [B, C, T]) in the format of the items, not zero-filled
+	if(batch_size > 0)
+	{
+		strcpy(audio->fmt, results[0].fmt);
+		audio->sample_rate = results[0].sample_rate;
+		audio->num_channels = results[0].num_channels;
+		audio->itemsize = results[0].itemsize;
+		audio->data.dl_tensor.dtype = results[0].data.dl_tensor.dtype;
+	}
+	audio->num_samples = num_samples;
+	audio->channels_first = channels_first;
+	audio->data.dl_tensor.ctx.device_type = kDLCPU;
+	audio->data.dl_tensor.ndim = 3;
+	audio->data.dl_tensor.shape = malloc(audio->data.dl_tensor.ndim * sizeof(int64_t));
+	audio->data.dl_tensor.shape[0] = batch_size;
+	audio->data.dl_tensor.shape[channels_first ? 2 : 1] = audio->num_samples;
+	audio->data.dl_tensor.shape[channels_first ? 1 : 2] = audio->num_channels;
+	audio->data.dl_tensor.strides = malloc(audio->data.dl_tensor.ndim * sizeof(int64_t));
+	audio->data.dl_tensor.strides[0] = audio->data.dl_tensor.shape[1] * audio->data.dl_tensor.shape[2];
+	audio->data.dl_tensor.strides[1] = audio->data.dl_tensor.shape[2];
+	audio->data.dl_tensor.strides[2] = 1;
+
+	size_t size = batch_size * audio->num_samples * audio->num_channels * audio->itemsize;
+	if(!alloc_output(audio, allocator, size))
+	{
+		strcpy(audio->error, "Cannot allocate output");
+		return false;
+	}
+	audio->stats.alloc_bytes += size;
+	return true;
+}
+
+static void collate_batch_item(struct DecodeAudio* batch, int i, const struct DecodeAudio* item, uint64_t num_samples)
+{
+	// copies the first num_samples of an item decoded into its own allocation to row i and zero-pads the rest; interleaved items of a channels-first
+	// batch are deinterleaved
+	int64_t* strides = batch->data.dl_tensor.strides;
+	int num_channels = batch->num_channels, itemsize = batch->itemsize;
+	uint8_t* row = (uint8_t*)batch->data.dl_tensor.data + i * strides[0] * itemsize;
+	size_t len = num_samples * itemsize, pad = batch->num_samples * itemsize - len;
+	if(!batch->channels_first)
+	{
+		memcpy(row, item->data.dl_tensor.data, len * num_channels);
+		memset(row + len * num_channels, 0, pad * num_channels);
+		return;
+	}
+	uint8_t* planes[num_channels];
+	for(int c = 0; c < num_channels; c++)
+	{
+		planes[c] = row + c * strides[1] * itemsize;
+		memset(planes[c] + len, 0, pad);
+		if(item->channels_first)
+			memcpy(planes[c], (uint8_t*)item->data.dl_tensor.data + c * item->data.dl_tensor.strides[0] * itemsize, len);
+	}
+	if(!item->channels_first)
+		deinterleave(planes, item->data.dl_tensor.data, num_channels, num_samples, itemsize);
+}
+
+struct DecodeAudio decode_audio_batch(int batch_size, const char** input_paths, struct DecodeAudio* input_options, struct DecodeAudio output_options, const char* filter_string, uint64_t* num_samples, int num_threads, int verbose)
+{
+	// decodes every item on a worker pool into a zero-padded [B, T_max, C] (or [B, C, T_max]) tensor, num_samples receives per-item lengths;
+	// T_max is the longest item, or output_options.num_samples when set (longer items are truncated to it)
+	struct DecodeAudio audio = { 0 };
+	struct DecodeAudio* results = calloc(batch_size, sizeof(struct DecodeAudio));
+	struct DecodeAudioSession** sessions = calloc(batch_size, sizeof(struct DecodeAudioSession*));
+	int channels_first = output_options.channels_first;
+	uint64_t max_num_samples = output_options.num_samples;
+	bool capped = max_num_samples > 0;
+	output_options.data.dl_tensor.data = NULL;
+	output_options.num_samples = 0;
+	struct decode_audio_batch_state state = { input_paths, input_options, output_options, filter_string, verbose, results, sessions };
+
+	// every item is opened once; with a cap, or with lengths every header gives exactly, the batch is allocated first and each item decodes straight
+	// into its row; otherwise items decode into their own allocation and are collated by a copy. Features, filter graphs (which may change rate and
+	// channels) and cached items always go through decode_audio and the copy
+	bool reopen = output_options.n_mels > 0 || output_options.cache != NULL || (filter_string != NULL && filter_string[0] != '\0');
+	if(!reopen)
+	{
+		parallel_for(batch_size, num_threads, open_batch_item, &state);
+		if(!check_batch_items(results, batch_size, audio.error))
+			goto end;
+		bool rows = true;
+		uint64_t capacity = max_num_samples;
+		for(int i = 0; i < batch_size && !capped; i++)
+		{
+			rows = rows && session_duration_exact(sessions[i]);
+			capacity = FFMAX(capacity, results[i].num_samples);
+		}
+		// slack past the longest header length: rounding of the resampler or of millisecond durations fits, an item filling its row was undercounted
+		if(!capped && batch_size > 0)
+			capacity += 1 + results[0].sample_rate / 100;
+		if(rows && !alloc_batch(&audio, results, batch_size, capacity, channels_first, output_options.allocator))
+			goto end;
+
+		state.batch = rows ? &audio : NULL;
+		parallel_for(batch_size, num_threads, decode_opened_batch_item, &state);
+		for(int i = 0; i < batch_size; i++)
+			add_stats(&audio.stats, &results[i].stats, false);
+		if(!check_batch_items(results, batch_size, audio.error) || !rows)
+			goto collate;
+
+		uint64_t num_decoded = 0;
+		bool undercounted = false;
+		for(int i = 0; i < batch_size; i++)
+		{
+			num_decoded = FFMAX(num_decoded, results[i].num_samples);
+			undercounted = undercounted || (!capped && results[i].num_samples >= capacity);
+		}
+		if(!undercounted)
+		{
+			// rows keep their stride, the batch exposes what was decoded
+			audio.num_samples = capped ? capacity : num_decoded;
+			audio.data.dl_tensor.shape[channels_first ? 2 : 1] = audio.num_samples;
+			for(int i = 0; i < batch_size; i++)
+				num_samples[i] = results[i].num_samples;
+			goto end;
+		}
+
+		// a header undercounted its item, the whole batch is decoded again without a bound
+		struct DecodeAudioStats stats = audio.stats;
+		release_failed_output(&audio);
+		memset(&audio, 0, sizeof(audio));
+		audio.stats = stats;
+		release_batch_items(results, batch_size);
+		reopen = true;
+	}
+	if(reopen)
+	{
+		// items decode interleaved, channels-first is applied while collating
+		state.batch = NULL;
+		state.output_options.channels_first = 0;
+		parallel_for(batch_size, num_threads, decode_audio_batch_item, &state);
+		for(int i = 0; i < batch_size; i++)
+			add_stats(&audio.stats, &results[i].stats, false);
+	}
+
+collate:
+	if(audio.error[0] || !check_batch_items(results, batch_size, audio.error))
+		goto end;
+	for(int i = 0; i < batch_size && !capped; i++)
+		max_num_samples = FFMAX(max_num_samples, results[i].num_samples);
+	if(!alloc_batch(&audio, results, batch_size, max_num_samples, channels_first, output_options.allocator))
+		goto end;
+	// item buffers are short-lived, with a pool allocator they are recycled by the next batch
+	for(int i = 0; i < batch_size; i++)
+	{
+		num_samples[i] = FFMIN(results[i].num_samples, max_num_samples);
+		collate_batch_item(&audio, i, &results[i], num_samples[i]);
+	}
+
+end:
+	for(int i = 0; i < batch_size; i++)
+	{
+		// opened items that never got to decode
+		if(!sessions[i])
+			continue;
+		finish_batch_item(&state, i);
+		add_stats(&audio.stats, &results[i].stats, false);
+	}
+	if(audio.error[0])
+		release_failed_output(&audio);
+	else
+		audio.duration = audio.sample_rate > 0 && output_options.n_mels == 0 ? (double)audio.num_samples / audio.sample_rate : 0;
+	release_batch_items(results, batch_size);
+	free(sessions);
+	free(results);
+	return audio;
+}
+
+// metadata index: header, entries sorted by path hash, then the NUL-terminated paths the entries point into;
+// an entry stays valid while its file keeps size and mtime, the file is mmapped and searched in place
+
+struct probe_index_header
+{
+	char magic[8];
+	uint64_t num_entries;
+	uint64_t paths_size;
+};
+
+struct probe_index_entry
+{
+	uint64_t path_hash;
+	uint64_t path_offset;
+	int64_t size;
+	int64_t mtime_ns;
+	uint64_t sample_rate;
+	uint64_t num_channels;
+	uint64_t num_samples;
+	double duration;
+	char fmt[8];
+};
+
+static const char probe_index_magic[8] = "DAIDX01";
+
+struct probe_index
+{
+	struct mmap_ctx mapping;
+	uint64_t num_entries;
+	uint64_t paths_size;
+	struct probe_index_entry* entries;
+	const char* paths;
+};
+
+static bool open_probe_index(const char* index_path, struct probe_index* index)
+{
+	memset(index, 0, sizeof(struct probe_index));
+	if(index_path == NULL || !map_file(index_path, PROT_READ, MAP_SHARED, &index->mapping))
+		return false;
+
+	struct probe_index_header* header = index->mapping.addr;
+	if(index->mapping.length < sizeof(struct probe_index_header) || memcmp(header->magic, probe_index_magic, sizeof(probe_index_magic)) != 0
+		|| header->num_entries > (index->mapping.length - sizeof(struct probe_index_header)) / sizeof(struct probe_index_entry)
+		|| sizeof(struct probe_index_header) + header->num_entries * sizeof(struct probe_index_entry) + header->paths_size != index->mapping.length)
+	{
+		munmap(index->mapping.addr, index->mapping.length);
+		memset(index, 0, sizeof(struct probe_index));
+		return false;
+	}
+	index->num_entries = header->num_entries;
+	index->paths_size = header->paths_size;
+	index->entries = (struct probe_index_entry*)(header + 1);
+	index->paths = (const char*)(index->entries + index->num_entries);
+	return true;
+}
+
+static struct probe_index_entry* find_probe_index_entry(struct probe_index* index, const char* path)
+{
+	uint64_t hash = hash_path(path), path_len = strlen(path);
+	uint64_t lo = 0, hi = index->num_entries;
+	while (lo < hi)
+	{
+		uint64_t mid = lo + (hi - lo) / 2;
+		if(index->entries[mid].path_hash < hash)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (; lo < index->num_entries && index->entries[lo].path_hash == hash; lo++)
+	{
+		uint64_t path_offset = index->entries[lo].path_offset;
+		// the stored path must end with its NUL inside the paths, an unterminated one at the end would match any longer path
+		if(path_offset < index->paths_size && path_len < index->paths_size - path_offset && memcmp(index->paths + path_offset, path, path_len + 1) == 0)
+			return &index->entries[lo];
+	}
+	return NULL;
+}
+
+struct probe_index_record
+{
+	struct probe_index_entry entry;
+	const char* path;
+	bool fresh;
+};
+
+static int compare_probe_index_records(const void* a, const void* b)
+{
+	// by hash then path, a fresh record sorts before the stale one it replaces
+	const struct probe_index_record* x = a, * y = b;
+	if(x->entry.path_hash != y->entry.path_hash)
+		return x->entry.path_hash < y->entry.path_hash ? -1 : 1;
+	int cmp = strcmp(x->path, y->path);
+	return cmp != 0 ? cmp : (int)y->fresh - (int)x->fresh;
+}
+
+static bool write_probe_index(const char* index_path, struct probe_index* index, struct probe_index_record* fresh, int num_fresh)
+{
+	// old and fresh records are merged into a temporary file that atomically replaces the index
+	uint64_t num_records = index->num_entries + num_fresh;
+	struct probe_index_record* records = malloc(FFMAX(1, num_records) * sizeof(struct probe_index_record));
+	for (uint64_t k = 0; k < index->num_entries; k++)
+	{
+		uint64_t path_offset = index->entries[k].path_offset;
+		bool valid = path_offset < index->paths_size && memchr(index->paths + path_offset, '\0', index->paths_size - path_offset) != NULL;
+		records[k] = (struct probe_index_record){ index->entries[k], valid ? index->paths + path_offset : "", false };
+	}
+	memcpy(records + index->num_entries, fresh, num_fresh * sizeof(struct probe_index_record));
+	qsort(records, num_records, sizeof(struct probe_index_record), compare_probe_index_records);
+
+	char tmp_path[4096];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp.%d", index_path, (int)getpid());
+	FILE* f = fopen(tmp_path, "wb");
+	if(!f)
+	{
+		free(records);
+		return false;
+	}
+
+	// drop duplicates (keeping the fresh one) and records whose path was corrupt
+	uint64_t num_unique = 0;
+	for (uint64_t k = 0; k < num_records; k++)
 	{
-		size_t avio_ctx_buffer_size = 4096 * buffer_multiple;
-    	avio_ctx_buffer = av_malloc(avio_ctx_buffer_size);
-		assert(avio_ctx_buffer);
-    	
-		cursor.base = cursor.ptr  = (uint8_t*)input_options.data.dl_tensor.data;
-    	cursor.size = cursor.left = nbytes(&input_options);
-		io_ctx = avio_alloc_context(avio_ctx_buffer, avio_ctx_buffer_size, 0, &cursor, &buffer_read, NULL, &buffer_seek);
-		if(!io_ctx)
-		{
-			strcpy(audio.error, "Cannot allocate IO context");
-			goto end;
-		}
+		struct probe_index_record* last = num_unique > 0 ? &records[num_unique - 1] : NULL;
+		if(records[k].path[0] == '\0' || (last && last->entry.path_hash == records[k].entry.path_hash && strcmp(last->path, records[k].path) == 0))
+			continue;
+		records[num_unique++] = records[k];
+	}
 
-		fmt_ctx->pb = io_ctx;
+	struct probe_index_header header = { { 0 }, num_unique, 0 };
+	memcpy(header.magic, probe_index_magic, sizeof(probe_index_magic));
+	for (uint64_t k = 0; k < num_unique; k++)
+	{
+		records[k].entry.path_offset = header.paths_size;
+		header.paths_size += strlen(records[k].path) + 1;
 	}
+	fwrite(&header, sizeof(header), 1, f);
+	for (uint64_t k = 0; k < num_unique; k++)
+		fwrite(&records[k].entry, sizeof(struct probe_index_entry), 1, f);
+	for (uint64_t k = 0; k < num_unique; k++)
+		fwrite(records[k].path, strlen(records[k].path) + 1, 1, f);
+
+	bool ok = !ferror(f);
+	ok = fclose(f) == 0 && ok;
+	ok = ok && rename(tmp_path, index_path) == 0;
+	if(!ok)
+		unlink(tmp_path);
+	free(records);
+	return ok;
+}
+
+struct decode_audio_probe_state
+{
+	const char** input_paths;
+	struct probe_index* index;
+	struct DecodeAudio* results;
+	struct probe_index_record* records;
+	int verbose;
+};
 
-	if(verbose) printf("decode_audio_BEFORE__: %.2f microsec\n", (float)(clock() - tic) * 1000000 / CLOCKS_PER_SEC);
+static void decode_audio_probe_item(void* opaque, int i)
+{
+	struct decode_audio_probe_state* state = (struct decode_audio_probe_state*)opaque;
+	struct DecodeAudio* audio = &state->results[i];
+	struct probe_index_record* record = &state->records[i];
+	const char* path = state->input_paths[i];
+	memset(audio, 0, sizeof(struct DecodeAudio));
+	memset(record, 0, sizeof(struct probe_index_record));
 
-	fmt_ctx->format_probesize = 2048;
-	AVInputFormat* input_format = av_find_input_format("wav");
-	if (avformat_open_input(&fmt_ctx, input_path, input_format, NULL) != 0)
+	struct stat st;
+	if(stat(path, &st) != 0)
 	{
-		strcpy(audio.error, "Cannot open file");
-		goto end;
+		strcpy(audio->error, "Cannot stat file");
+		return;
 	}
-	if(probe) return audio;
-	fmt_ctx->streams[0]->probe_packets = 1;
-	//fmt_ctx->streams[0]->probesize = 2048;
-	if(verbose) printf("decode_audio_BEFORE: %.2f microsec\n", (float)(clock() - tic) * 1000000 / CLOCKS_PER_SEC);
-	
-	//if (avformat_find_stream_info(fmt_ctx, NULL) < 0)
-	//{
-	//	strcpy(audio.error, "Cannot open find stream information");
-	//	goto end;
-	//}
-	if(verbose) printf("decode_audio_AFTER: %.2f microsec\n", (float)(clock() - tic) * 1000000 / CLOCKS_PER_SEC);
-	
+	int64_t mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
 
-	int stream_index = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
-	if (stream_index < 0)
+	struct probe_index_entry* entry = find_probe_index_entry(state->index, path);
+	if(entry == NULL || entry->size != st.st_size || entry->mtime_ns != mtime_ns)
 	{
-		strcpy(audio.error, "Cannot find audio stream");
-		goto end;
+		struct DecodeAudio no_options = { 0 };
+		*audio = decode_audio(path, no_options, no_options, NULL, true, state->verbose);
+		if(audio->error[0])
+			return;
+
+		// a fresh record for the index
+		entry = &record->entry;
+		entry->path_hash = hash_path(path);
+		entry->size = st.st_size;
+		entry->mtime_ns = mtime_ns;
+		entry->sample_rate = audio->sample_rate;
+		entry->num_channels = audio->num_channels;
+		entry->num_samples = audio->num_samples;
+		entry->duration = audio->duration;
+		memcpy(entry->fmt, audio->fmt, sizeof(entry->fmt));
+		record->path = path;
+		record->fresh = true;
+		return;
 	}
-	AVStream *stream = fmt_ctx->streams[stream_index];
-	//stream->codecpar->block_align = 4096 * buffer_multiple;
 
-	AVCodec *codec = avcodec_find_decoder(stream->codecpar->codec_id);
-	if (!codec)
+	memcpy(audio->fmt, entry->fmt, sizeof(entry->fmt));
+	audio->fmt[sizeof(audio->fmt) - 1] = '\0';
+	audio->sample_rate = entry->sample_rate;
+	audio->num_channels = entry->num_channels;
+	audio->num_samples = entry->num_samples;
+	audio->duration = entry->duration;
+}
+
+int decode_audio_probe(int batch_size, const char** input_paths, struct DecodeAudio* results, const char* index_path, int num_threads, int verbose)
+{
+	// header-only metadata for many files on a worker pool, files whose size and mtime match the index are not opened at all;
+	// returns the number of files that had to be probed, results[i].error is set for files that could not be
+	struct probe_index index;
+	open_probe_index(index_path, &index);
+
+	struct probe_index_record* records = malloc(FFMAX(1, batch_size) * sizeof(struct probe_index_record));
+	struct decode_audio_probe_state state = { input_paths, &index, results, records, verbose };
+	parallel_for(batch_size, num_threads, decode_audio_probe_item, &state);
+
+	int num_fresh = 0;
+	for (int i = 0; i < batch_size; i++)
+		if(records[i].fresh)
+			records[num_fresh++] = records[i];
+	if(index_path != NULL && num_fresh > 0)
+		write_probe_index(index_path, &index, records, num_fresh);
+
+	free(records);
+	if(index.mapping.addr)
+		munmap(index.mapping.addr, index.mapping.length);
+	return num_fresh;
+}
+
+struct seek_index_build_state
+{
+	const char** input_paths;
+	struct DecodeAudio* results;
+	int verbose;
+};
+
+static void build_seek_index_item(void* opaque, int i)
+{
+	// demux only, no codec is opened: every packet of the stream contributes its byte offset and first sample (from its timestamp or the running sum of durations)
+	struct seek_index_build_state* state = (struct seek_index_build_state*)opaque;
+	struct DecodeAudio* audio = &state->results[i];
+	const char* input_path = state->input_paths[i];
+	struct DecodeAudio no_options = { 0 };
+	memset(audio, 0, sizeof(struct DecodeAudio));
+
+	struct stat st;
+	if(stat(input_path, &st) != 0)
 	{
-		strcpy(audio.error, "Codec not found");
-		goto end;
+		strcpy(audio->error, "Cannot stat file");
+		return;
 	}
+	struct DecodeAudioSession* session = decode_audio_session_create(no_options, NULL, state->verbose);
+	AVPacket* pkt = av_packet_alloc();
+	struct seek_index_entry* entries = NULL;
+	uint64_t num_entries = 0, capacity = 0;
+	FILE* f = NULL;
+	char path[4096], tmp_path[4096 + 32];
+	if(session_open_input(session, input_path, no_options, audio, true) < 0)
+		goto end;
+	if(session->mapping.length > 0)
+		advise_range(session->mapping.addr, 0, session->mapping.length, MADV_SEQUENTIAL);
 
-	dec_ctx = avcodec_alloc_context3(codec);
-	if (!dec_ctx)
+	AVFormatContext* fmt_ctx = session->fmt_ctx;
+	AVStream* stream = fmt_ctx->streams[session->stream_index];
+	int sample_rate = stream->codecpar->sample_rate;
+	if(sample_rate <= 0)
 	{
-		strcpy(audio.error, "Cannot allocate audio codec context");
+		strcpy(audio->error, "Cannot deduce sample rate");
 		goto end;
 	}
-
-	if (avcodec_parameters_to_context(dec_ctx, stream->codecpar) < 0)
+	AVRational sample_time_base = { 1, sample_rate };
+	int64_t start_time = stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0, next_sample = 0, prev_pos = -1;
+	while (av_read_frame(fmt_ctx, pkt) >= 0)
 	{
-		strcpy(audio.error, "Failed to copy audio codec parameters to decoder context");
-		goto end;
+		if(pkt->stream_index == session->stream_index)
+		{
+			// packets sharing a position (Ogg packets of one page) are only reachable through the first of them, a byte seek restarts there
+			int64_t sample = pkt->pts != AV_NOPTS_VALUE ? av_rescale_q(pkt->pts - start_time, stream->time_base, sample_time_base) : next_sample;
+			bool first_at_pos = pkt->pos != prev_pos;
+			prev_pos = pkt->pos;
+			if(pkt->pos >= 0 && first_at_pos && (pkt->flags & AV_PKT_FLAG_KEY) && (num_entries == 0 || sample - entries[num_entries - 1].sample >= sample_rate / 10))
+			{
+				if(num_entries == capacity)
+				{
+					capacity = FFMAX(1024, 2 * capacity);
+					entries = realloc(entries, capacity * sizeof(struct seek_index_entry));
+				}
+				entries[num_entries++] = (struct seek_index_entry){ pkt->pos, sample };
+			}
+			next_sample = FFMAX(next_sample, sample + av_rescale_q(pkt->duration, stream->time_base, sample_time_base));
+		}
+		av_packet_unref(pkt);
 	}
-
-	if (avcodec_open2(dec_ctx, codec, NULL) < 0)
+	if(num_entries == 0)
 	{
-		strcpy(audio.error, "Cannot open codec");
+		strcpy(audio->error, "No packet positions to index");
 		goto end;
 	}
 
-	enum AVSampleFormat sample_fmt = dec_ctx->sample_fmt;
-	if (av_sample_fmt_is_planar(sample_fmt))
+	// written to a temporary file that atomically replaces the sidecar
+	struct seek_index_header header = { { 0 }, st.st_size, (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec, session->stream_index, sample_rate, seek_preroll(stream), next_sample, num_entries };
+	memcpy(header.magic, seek_index_magic, sizeof(seek_index_magic));
+	seek_index_path(input_path, path, sizeof(path));
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp.%d", path, (int)getpid());
+	f = fopen(tmp_path, "wb");
+	if(!f)
 	{
-		const char *packed = av_get_sample_fmt_name(sample_fmt);
-		printf("Warning: the sample format the decoder produced is planar (%s). This example will output the first channel only.\n", packed ? packed : "?");
-		sample_fmt = av_get_packed_sample_fmt(dec_ctx->sample_fmt);
+		strcpy(audio->error, "Cannot write seek index");
+		goto end;
 	}
-	static struct sample_fmt_entry {enum AVSampleFormat sample_fmt; const char *fmt_be, *fmt_le; DLDataType dtype;} supported_sample_fmt_entries[] =
+	fwrite(&header, sizeof(header), 1, f);
+	fwrite(entries, sizeof(struct seek_index_entry), num_entries, f);
+	bool ok = !ferror(f);
+	ok = fclose(f) == 0 && ok;
+	if(!ok || rename(tmp_path, path) != 0)
 	{
-		{ AV_SAMPLE_FMT_U8,  "u8"   ,    "u8" , { kDLUInt  , 8 , 1 }},
-		{ AV_SAMPLE_FMT_S16, "s16be", "s16le" , { kDLInt   , 16, 1 }},
-		{ AV_SAMPLE_FMT_S32, "s32be", "s32le" , { kDLInt   , 32, 1 }},
-		{ AV_SAMPLE_FMT_FLT, "f32be", "f32le" , { kDLFloat , 32, 1 }},
-		{ AV_SAMPLE_FMT_DBL, "f64be", "f64le" , { kDLFloat , 64, 1 }},
-	};
-	
-	double in_duration = stream->time_base.num * (int)stream->duration / stream->time_base.den;
-	//double in_duration = fmt_ctx->duration / (float) AV_TIME_BASE; assert(in_duration > 0);
-	double out_duration = in_duration;
-	int in_sample_rate = dec_ctx->sample_rate;
-	int out_sample_rate = output_options.sample_rate > 0 ? output_options.sample_rate : in_sample_rate;
-	uint64_t out_num_samples  = out_duration * out_sample_rate;
-	int out_num_channels = dec_ctx->channels;
+		unlink(tmp_path);
+		strcpy(audio->error, "Cannot write seek index");
+	}
+	audio->num_samples = next_sample;
 
-	DLDataType in_dtype, out_dtype;
-	enum AVSampleFormat in_sample_fmt = AV_SAMPLE_FMT_NONE, out_sample_fmt = AV_SAMPLE_FMT_NONE; 
-	for (int k = 0; k < FF_ARRAY_ELEMS(supported_sample_fmt_entries); k++)
-	{
-		struct sample_fmt_entry* entry = &supported_sample_fmt_entries[k];
-		
-		if (sample_fmt == entry->sample_fmt)
-		{
-			in_dtype = entry->dtype;
-			in_sample_fmt = entry->sample_fmt;
-            strcpy(audio.fmt, AV_NE(entry->fmt_be, entry->fmt_le));
-		}
+end:
+	free(entries);
+	av_packet_free(&pkt);
+	session_close_input(session);
+	decode_audio_session_destroy(session);
+}
 
-		if (strcmp(output_options.fmt, entry->fmt_le) == 0 || strcmp(output_options.fmt, entry->fmt_be) == 0)
-		{
-			out_dtype = entry->dtype;
-			out_sample_fmt = entry->sample_fmt;
-		}
+int decode_audio_seek_index_build(int batch_size, const char** input_paths, struct DecodeAudio* results, int num_threads, int verbose)
+{
+	// writes the seek index sidecar of every input on a worker pool, returns how many were written;
+	// results[i] holds the header metadata and the scanned length, or the error of a file that could not be indexed
+	struct seek_index_build_state state = { input_paths, results, verbose };
+	parallel_for(batch_size, num_threads, build_seek_index_item, &state);
+	int num_built = 0;
+	for (int i = 0; i < batch_size; i++)
+		num_built += results[i].error[0] == '\0';
+	return num_built;
+}
+
+// tar / zip shards: the archive is mmapped once and its member index (offsets, sizes, a name hash table) built at open,
+// members are decoded in place through the buffer cursor, zero-copy WAV views keep the shard alive by reference
+
+struct shard_member
+{
+	uint64_t offset;
+	uint64_t size;
+	uint64_t name_offset;
+	bool compressed;
+};
+
+struct DecodeAudioShard
+{
+	struct mmap_ctx mapping;
+	int refcount;
+	int num_members, max_members;
+	struct shard_member* members;
+	char* names;
+	uint64_t names_size, max_names_size;
+	// open addressing over the name hashes, -1 marks an empty bucket
+	int* buckets;
+	int num_buckets;
+};
+
+static void shard_add_member(struct DecodeAudioShard* shard, const char* name, size_t name_len, uint64_t offset, uint64_t size, bool compressed)
+{
+	// "./a.wav" as written by tar -C dir . is looked up as "a.wav"
+	for(; name_len > 2 && name[0] == '.' && name[1] == '/'; name += 2, name_len -= 2);
+	if(shard->num_members == shard->max_members)
+	{
+		shard->max_members = FFMAX(64, shard->max_members * 2);
+		shard->members = realloc(shard->members, shard->max_members * sizeof(struct shard_member));
 	}
-	if (in_sample_fmt == AV_SAMPLE_FMT_NONE)
+	if(shard->names_size + name_len + 1 > shard->max_names_size)
 	{
-		strcpy(audio.error, "Cannot deduce format");
-		goto end;
+		shard->max_names_size = FFMAX(shard->max_names_size * 2, shard->names_size + name_len + 4096);
+		shard->names = realloc(shard->names, shard->max_names_size);
 	}
-	if (out_sample_fmt == AV_SAMPLE_FMT_NONE)
+	shard->members[shard->num_members++] = (struct shard_member){ offset, size, shard->names_size, compressed };
+	memcpy(shard->names + shard->names_size, name, name_len);
+	shard->names[shard->names_size + name_len] = '\0';
+	shard->names_size += name_len + 1;
+}
+
+static uint64_t tar_number(const uint8_t* field, int len)
+{
+	// octal with optional leading spaces, or base-256 with the high bit set (GNU, sizes of 8 GiB and more)
+	uint64_t value = 0;
+	if(field[0] & 0x80)
 	{
-		out_sample_fmt = in_sample_fmt;
-		out_dtype = in_dtype;
+		for(int i = 1; i < len; i++)
+			value = (value << 8) | field[i];
+		return value;
 	}
+	int i = 0;
+	for(; i < len && field[i] == ' '; i++);
+	for(; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+		value = value * 8 + (field[i] - '0');
+	return value;
+}
 
-	if (!dec_ctx->channel_layout)
-		dec_ctx->channel_layout = av_get_default_channel_layout(dec_ctx->channels);
-	uint64_t channel_layout = dec_ctx->channel_layout;
+static bool is_tar_header(const uint8_t* header)
+{
+	// the checksum covers the header with its own field read as spaces, this also accepts pre-POSIX (v7) archives
+	uint64_t checksum = 8 * ' ';
+	for(int i = 0; i < 512; i++)
+		checksum += (i >= 148 && i < 156) ? 0 : header[i];
+	return checksum == tar_number(header + 148, 8);
+}
 
-	audio.duration = out_duration;
-	audio.sample_rate = out_sample_rate;
-	audio.num_channels = out_num_channels;
-	audio.num_samples = out_num_samples;
-	audio.data.dl_tensor.ctx.device_type = kDLCPU;
-	audio.data.dl_tensor.ndim = 2;
-	audio.data.dl_tensor.dtype = out_dtype; 
-	audio.data.dl_tensor.shape = malloc(audio.data.dl_tensor.ndim * sizeof(int64_t));
-	audio.data.dl_tensor.shape[0] = audio.num_samples;
-	audio.data.dl_tensor.shape[1] = audio.num_channels;
-	audio.data.dl_tensor.strides = malloc(audio.data.dl_tensor.ndim * sizeof(int64_t));
-	audio.data.dl_tensor.strides[0] = audio.data.dl_tensor.shape[1];
-	audio.data.dl_tensor.strides[1] = 1;
-	audio.itemsize = audio.data.dl_tensor.dtype.lanes * audio.data.dl_tensor.dtype.bits / 8;
-	
-	if(probe)
-		goto end;
-    
-	bool need_filter = filter_string != NULL && strlen(filter_string) > 0;
-	bool need_resample = out_sample_rate != in_sample_rate || out_sample_fmt != in_sample_fmt;
-	if(need_filter || need_resample)
+static int index_tar(struct DecodeAudioShard* shard, char* error)
+{
+	const uint8_t* base = shard->mapping.addr;
+	uint64_t size = shard->mapping.length;
+	// GNU long name ('L') and pax ('x') records name the member that follows them
+	const char* long_name = NULL;
+	size_t long_name_len = 0;
+	for(uint64_t pos = 0; pos + 512 <= size; )
 	{
-		graph = avfilter_graph_alloc();
-		if(!graph)
+		const uint8_t* header = base + pos;
+		if(header[0] == '\0')
+			break;
+		if(!is_tar_header(header))
 		{
-			strcpy(audio.error, "Cannot allocate filter graph");
-			goto end;
+			strcpy(error, "Corrupt tar header");
+			return -1;
+		}
+		uint64_t member_size = tar_number(header + 124, 12), data = pos + 512;
+		if(member_size > size - data)
+		{
+			strcpy(error, "Truncated tar member");
+			return -1;
 		}
 
-		sprintf(filter_args, "sample_rate=%d:sample_fmt=%s:channel_layout=0x%"PRIx64":time_base=%d/%d", in_sample_rate, av_get_sample_fmt_name(in_sample_fmt), channel_layout, dec_ctx->time_base.num, dec_ctx->time_base.den);
-
-		if (avfilter_graph_create_filter(&buffersrc_ctx, buffersrc, "in", filter_args, NULL, graph) < 0)
+		char type = header[156];
+		if(type == 'L')
 		{
-			strcpy(audio.error, "Cannot create buffer source");
-			goto end;
+			long_name = (const char*)base + data;
+			long_name_len = strnlen(long_name, member_size);
 		}
-		int ret;
-		if ((ret = avfilter_graph_create_filter(&buffersink_ctx, buffersink, "out", NULL, NULL, graph)) < 0)
+		else if(type == 'x')
 		{
-			strcpy(audio.error, "Cannot create buffer sink");
-			goto end;
+			// records are "<length> <key>=<value>\n", only the path matters
+			for(uint64_t record = data; record < data + member_size; )
+			{
+				uint64_t record_len = 0, p = record;
+				for(; p < data + member_size && base[p] >= '0' && base[p] <= '9'; p++)
+					record_len = record_len * 10 + (base[p] - '0');
+				if(record_len == 0 || record_len > data + member_size - record)
+					break;
+				if(record_len > p + 6 - record && memcmp(base + p, " path=", 6) == 0)
+				{
+					long_name = (const char*)base + p + 6;
+					long_name_len = record + record_len - 1 - (p + 6);
+				}
+				record += record_len;
+			}
 		}
-		const enum AVSampleFormat out_sample_fmts[] = { out_sample_fmt, -1 };
-		if (av_opt_set_int_list(buffersink_ctx, "sample_fmts", out_sample_fmts, -1, AV_OPT_SEARCH_CHILDREN) < 0)
+		else
 		{
-			strcpy(audio.error, "Cannot set output sample format");
-			goto end;
+			if(type == '0' || type == '\0' || type == '7')
+			{
+				char name[256 + 1];
+				size_t name_len = 0;
+				if(!long_name)
+				{
+					// ustar splits long paths into prefix and name
+					size_t prefix_len = memcmp(header + 257, "ustar", 5) == 0 ? strnlen((const char*)header + 345, 155) : 0;
+					memcpy(name, header + 345, prefix_len);
+					name_len = prefix_len;
+					if(prefix_len > 0)
+						name[name_len++] = '/';
+					size_t base_len = strnlen((const char*)header, 100);
+					memcpy(name + name_len, header, base_len);
+					name_len += base_len;
+				}
+				shard_add_member(shard, long_name ? long_name : name, long_name ? long_name_len : name_len, data, member_size, false);
+			}
+			long_name = NULL;
 		}
-		const int64_t out_channel_layouts[] = { channel_layout , -1 };
-		if (av_opt_set_int_list(buffersink_ctx, "channel_layouts", out_channel_layouts, -1, AV_OPT_SEARCH_CHILDREN) < 0) 
+		pos = data + (member_size + 511) / 512 * 512;
+	}
+	return 0;
+}
+
+static int index_zip(struct DecodeAudioShard* shard, char* error)
+{
+	const uint8_t* base = shard->mapping.addr;
+	uint64_t size = shard->mapping.length;
+	// the end of central directory record is in the last 22 bytes plus at most 64 KiB of comment
+	int64_t eocd = -1;
+	for(int64_t p = (int64_t)size - 22; p >= 0 && p >= (int64_t)size - 22 - 65535; p--)
+		if(AV_RL32(base + p) == 0x06054b50)
 		{
-			strcpy(audio.error, "Cannot set output channel layout");
-			goto end;
+			eocd = p;
+			break;
 		}
-		const int out_sample_rates[] = { out_sample_rate, -1 };
-		if (av_opt_set_int_list(buffersink_ctx, "sample_rates", out_sample_rates, -1, AV_OPT_SEARCH_CHILDREN) < 0)
+	if(eocd < 0)
+	{
+		strcpy(error, "Cannot find zip central directory");
+		return -1;
+	}
+	uint64_t num_entries = AV_RL16(base + eocd + 10), pos = AV_RL32(base + eocd + 16);
+	if(num_entries == 0xFFFF || pos == 0xFFFFFFFF)
+	{
+		strcpy(error, "Zip64 archives are not supported");
+		return -1;
+	}
+
+	for(uint64_t i = 0; i < num_entries; i++)
+	{
+		const uint8_t* entry = base + pos;
+		if(pos + 46 > size || AV_RL32(entry) != 0x02014b50 || pos + 46 + AV_RL16(entry + 28) > size)
 		{
-			strcpy(audio.error, "Cannot set output sample rate");
-			goto end;
+			strcpy(error, "Corrupt zip central directory");
+			return -1;
 		}
-		
-		const char* out_sample_fmt_name = av_get_sample_fmt_name(out_sample_fmt);
-		if(need_resample)
+		int method = AV_RL16(entry + 10), name_len = AV_RL16(entry + 28);
+		uint64_t compressed_size = AV_RL32(entry + 20), local = AV_RL32(entry + 42);
+		const char* name = (const char*)entry + 46;
+		pos += 46 + name_len + AV_RL16(entry + 30) + AV_RL16(entry + 32);
+		if(name_len == 0 || name[name_len - 1] == '/')
+			continue;
+
+		// the local header repeats the name and may carry a different extra field, the data follows it
+		if(local + 30 > size || AV_RL32(base + local) != 0x04034b50)
 		{
-			sprintf(filter_args, "%s%saresample=out_sample_rate=%d:out_sample_fmt=%s,aformat=sample_rates=%d:sample_fmts=%s:channel_layouts=0x%"PRIu64, need_filter ? filter_string : "", need_filter ? "," : "", out_sample_rate, out_sample_fmt_name, out_sample_rate, out_sample_fmt_name, channel_layout);
+			strcpy(error, "Corrupt zip local header");
+			return -1;
 		}
-		else
+		uint64_t data = local + 30 + AV_RL16(base + local + 26) + AV_RL16(base + local + 28);
+		if(data > size || compressed_size > size - data)
 		{
-			sprintf(filter_args, "%s%saformat=sample_rates=%d:sample_fmts=%s:channel_layouts=0x%"PRIu64, need_filter ? filter_string : "", need_filter ? "," : "", out_sample_rate, out_sample_fmt_name, channel_layout);
+			strcpy(error, "Truncated zip member");
+			return -1;
 		}
-		
-		gis->name = av_strdup("out");
-		gis->filter_ctx = buffersink_ctx;
-		gis->pad_idx = 0;
-		gis->next = NULL;
+		shard_add_member(shard, name, name_len, data, compressed_size, method != 0);
+	}
+	return 0;
+}
+
+static void shard_release(struct DecodeAudioShard* shard)
+{
+	if(__atomic_sub_fetch(&shard->refcount, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+	if(shard->mapping.addr)
+		munmap(shard->mapping.addr, shard->mapping.length);
+	free(shard->members);
+	free(shard->names);
+	free(shard->buckets);
+	free(shard);
+}
+
+void deleter_shard(struct DLManagedTensor* self)
+{
+	struct DecodeAudioShard* shard = (struct DecodeAudioShard*)self->manager_ctx;
+	deleter_borrowed(self);
+	if(shard)
+	{
+		self->manager_ctx = NULL;
+		shard_release(shard);
+	}
+}
+
+struct DecodeAudioShard* decode_audio_shard_open(const char* path, char* error)
+{
+	struct DecodeAudioShard* shard = calloc(1, sizeof(struct DecodeAudioShard));
+	shard->refcount = 1;
+	// private writable mapping like the WAV fast path: tensors viewing a member may be written to without touching the file
+	if(!map_file(path, PROT_READ | PROT_WRITE, MAP_PRIVATE, &shard->mapping))
+	{
+		strcpy(error, "Cannot map shard");
+		shard_release(shard);
+		return NULL;
+	}
+	// only the headers are touched while indexing, member data is read ahead when decoded
+	madvise(shard->mapping.addr, shard->mapping.length, MADV_RANDOM);
+
+	const uint8_t* base = shard->mapping.addr;
+	int ret;
+	if(shard->mapping.length >= 4 && (AV_RL32(base) == 0x04034b50 || AV_RL32(base) == 0x06054b50))
+		ret = index_zip(shard, error);
+	else if(shard->mapping.length >= 512 && is_tar_header(base))
+		ret = index_tar(shard, error);
+	else
+	{
+		strcpy(error, "Shard is neither tar nor zip");
+		ret = -1;
+	}
+	if(ret < 0)
+	{
+		shard_release(shard);
+		return NULL;
+	}
+
+	// duplicate names resolve to the last member, as when extracting the archive
+	for(shard->num_buckets = 16; shard->num_buckets < 2 * shard->num_members; shard->num_buckets *= 2);
+	shard->buckets = malloc(shard->num_buckets * sizeof(int));
+	memset(shard->buckets, 0xff, shard->num_buckets * sizeof(int));
+	for(int i = 0; i < shard->num_members; i++)
+	{
+		const char* name = shard->names + shard->members[i].name_offset;
+		int b = hash_path(name) & (shard->num_buckets - 1);
+		for(; shard->buckets[b] >= 0 && strcmp(shard->names + shard->members[shard->buckets[b]].name_offset, name) != 0; b = (b + 1) & (shard->num_buckets - 1));
+		shard->buckets[b] = i;
+	}
+	return shard;
+}
+
+void decode_audio_shard_close(struct DecodeAudioShard* shard)
+{
+	// tensors still viewing the shard hold their own reference
+	if(shard)
+		shard_release(shard);
+}
+
+int decode_audio_shard_num_members(struct DecodeAudioShard* shard)
+{
+	return shard->num_members;
+}
+
+const char* decode_audio_shard_member(struct DecodeAudioShard* shard, int member_index, uint64_t* offset, uint64_t* size)
+{
+	// the name stays valid until the shard is closed, offset / size may be passed to decode_audio as member_offset / member_size with the shard path
+	if(member_index < 0 || member_index >= shard->num_members)
+		return NULL;
+	struct shard_member* member = &shard->members[member_index];
+	if(offset)
+		*offset = member->offset;
+	if(size)
+		*size = member->size;
+	return shard->names + member->name_offset;
+}
+
+int decode_audio_shard_find(struct DecodeAudioShard* shard, const char* name)
+{
+	for(int b = hash_path(name) & (shard->num_buckets - 1); shard->buckets[b] >= 0; b = (b + 1) & (shard->num_buckets - 1))
+		if(strcmp(shard->names + shard->members[shard->buckets[b]].name_offset, name) == 0)
+			return shard->buckets[b];
+	return -1;
+}
+
+struct DecodeAudio decode_audio_shard_decode(struct DecodeAudioShard* shard, int member_index, struct DecodeAudio output_options, const char* filter_string, int probe, int verbose)
+{
+	struct DecodeAudio audio = { 0 };
+	if(member_index < 0 || member_index >= shard->num_members)
+	{
+		strcpy(audio.error, "Member index out of range");
+		return audio;
+	}
+	struct shard_member* member = &shard->members[member_index];
+	if(member->compressed)
+	{
+		strcpy(audio.error, "Cannot decode compressed zip member");
+		return audio;
+	}
+
+	// the member is a buffer input pointing into the mapping, read ahead just its pages
+	int64_t shape[1] = { member->size };
+	struct DecodeAudio input_options = { 0 };
+	input_options.data.dl_tensor.data = (uint8_t*)shard->mapping.addr + member->offset;
+	input_options.data.dl_tensor.ndim = 1;
+	input_options.data.dl_tensor.shape = shape;
+	input_options.data.dl_tensor.dtype = (DLDataType){ kDLUInt, 8, 1 };
+	if(!probe && member->size > 0)
+		advise_range(shard->mapping.addr, member->offset, member->size, MADV_WILLNEED);
+
+	audio = decode_audio(NULL, input_options, output_options, filter_string, probe, verbose);
+	if(audio.data.deleter == deleter_borrowed && audio.data.dl_tensor.data != NULL)
+	{
+		// zero-copy view of the member
+		__atomic_add_fetch(&shard->refcount, 1, __ATOMIC_RELAXED);
+		audio.data.manager_ctx = shard;
+		audio.data.deleter = deleter_shard;
+	}
+	return audio;
+}
+
+struct decode_job
+{
+	int64_t id;
+	char* input_path;
+	struct DecodeAudio input_options;
+	struct DecodeAudio output_options;
+	char filter_string[513];
+	void (*callback)(void* opaque, int64_t job_id);
+	void* opaque;
+	struct DecodeAudio result;
+	bool finished;
+	// worker deque while queued, id bucket from submission until the result is taken, completion queue until polled or taken
+	struct decode_job* next_queued;
+	struct decode_job* next_in_bucket;
+	struct decode_job* prev_completed;
+	struct decode_job* next_completed;
+};
+
+struct job_deque
+{
+	pthread_mutex_t mutex;
+	struct decode_job* head;
+	struct decode_job* tail;
+};
+
+#define EXECUTOR_NUM_BUCKETS 4096
+
+struct DecodeAudioExecutor
+{
+	int num_threads;
+	pthread_t* threads;
+	// one deque per worker, submissions are spread round-robin and idle workers steal from the others
+	struct job_deque* deques;
+	unsigned int next_deque;
+	int64_t next_id;
 
-		gos->name = av_strdup("in");
-		gos->filter_ctx = buffersrc_ctx;
-		gos->pad_idx = 0;
-		gos->next = NULL;
+	// num_queued counts jobs not yet picked up by a worker, idle workers sleep on cond
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int num_queued;
+	bool stopping;
+
+	// jobs by id, finished jobs wait in completed (FIFO) for poll and in the buckets for result
+	pthread_mutex_t jobs_mutex;
+	pthread_cond_t completed_cond;
+	struct decode_job* buckets[EXECUTOR_NUM_BUCKETS];
+	struct decode_job* completed_head;
+	struct decode_job* completed_tail;
+	int event_fd;
+};
+
+static struct decode_job* job_deque_pop(struct job_deque* deque)
+{
+	pthread_mutex_lock(&deque->mutex);
+	struct decode_job* job = deque->head;
+	if(job)
+	{
+		deque->head = job->next_queued;
+		if(!deque->head)
+			deque->tail = NULL;
+	}
+	pthread_mutex_unlock(&deque->mutex);
+	return job;
+}
 
-		if(avfilter_graph_parse_ptr(graph, filter_args, &gis, &gos, NULL) < 0)
+static void* executor_worker(void* arg)
+{
+	struct DecodeAudioExecutor* executor = (struct DecodeAudioExecutor*)arg;
+	int self = __atomic_fetch_add(&executor->next_deque, 1, __ATOMIC_RELAXED) % executor->num_threads;
+	for (;;)
+	{
+		pthread_mutex_lock(&executor->mutex);
+		while (executor->num_queued == 0 && !executor->stopping)
+			pthread_cond_wait(&executor->cond, &executor->mutex);
+		if(executor->num_queued == 0)
 		{
-			strcpy(audio.error, "Cannot parse graph");
-			goto end;
+			pthread_mutex_unlock(&executor->mutex);
+			return NULL;
 		}
+		// the decrement reserves one queued job, it is in some deque: own first, then steal
+		executor->num_queued--;
+		pthread_mutex_unlock(&executor->mutex);
+
+		struct decode_job* job = NULL;
+		for (int k = 0; !job; k = (k + 1) % executor->num_threads)
+			job = job_deque_pop(&executor->deques[(self + k) % executor->num_threads]);
+
+		job->result = decode_audio(job->input_path, job->input_options, job->output_options, job->filter_string, false, false);
+		void (*callback)(void* opaque, int64_t job_id) = job->callback;
+		void* opaque = job->opaque;
+		int64_t id = job->id;
+
+		pthread_mutex_lock(&executor->jobs_mutex);
+		job->finished = true;
+		job->prev_completed = executor->completed_tail;
+		if(executor->completed_tail)
+			executor->completed_tail->next_completed = job;
+		else
+			executor->completed_head = job;
+		executor->completed_tail = job;
+		uint64_t one = 1;
+		if(executor->event_fd >= 0 && write(executor->event_fd, &one, sizeof(one)) < 0)
+			perror("decode_audio: eventfd");
+		pthread_cond_broadcast(&executor->completed_cond);
+		pthread_mutex_unlock(&executor->jobs_mutex);
+
+		// the job must not be touched after this, a poller may already have taken its result
+		if(callback)
+			callback(opaque, id);
+	}
+}
+
+void decode_audio_executor_destroy(struct DecodeAudioExecutor* executor);
+
+struct DecodeAudioExecutor* decode_audio_executor_create(int num_threads)
+{
+	// worker pool for asynchronous decodes, completions are reported by callback, by the eventfd and by decode_audio_executor_poll
+	if(num_threads <= 0)
+		num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	struct DecodeAudioExecutor* executor = calloc(1, sizeof(struct DecodeAudioExecutor));
+	executor->num_threads = num_threads;
+	executor->threads = calloc(num_threads, sizeof(pthread_t));
+	executor->deques = calloc(num_threads, sizeof(struct job_deque));
+	executor->next_id = 1;
+	executor->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	pthread_mutex_init(&executor->mutex, NULL);
+	pthread_cond_init(&executor->cond, NULL);
+	pthread_mutex_init(&executor->jobs_mutex, NULL);
+	pthread_cond_init(&executor->completed_cond, NULL);
+	for (int t = 0; t < num_threads; t++)
+		pthread_mutex_init(&executor->deques[t].mutex, NULL);
 
-		if(avfilter_graph_config(graph, NULL) < 0)
+	for (int t = 0; t < num_threads; t++)
+	{
+		if(pthread_create(&executor->threads[t], NULL, executor_worker, executor) != 0)
 		{
-			strcpy(audio.error, "Cannot configure graph.");
-			goto end;
+			// workers index the deques by num_threads, it cannot shrink once they run
+			executor->num_threads = t;
+			decode_audio_executor_destroy(executor);
+			return NULL;
 		}
 	}
+	return executor;
+}
 
-	uint64_t data_len = 0;
-	if(output_options.data.dl_tensor.data)
+void decode_audio_executor_destroy(struct DecodeAudioExecutor* executor)
+{
+	// queued jobs still run, results that were never taken are released
+	if(!executor)
+		return;
+	pthread_mutex_lock(&executor->mutex);
+	executor->stopping = true;
+	pthread_cond_broadcast(&executor->cond);
+	pthread_mutex_unlock(&executor->mutex);
+	for (int t = 0; t < executor->num_threads; t++)
+		pthread_join(executor->threads[t], NULL);
+
+	for (int b = 0; b < EXECUTOR_NUM_BUCKETS; b++)
 	{
-		data_len = nbytes(&output_options);
-		audio.data.dl_tensor.data = output_options.data.dl_tensor.data;
+		for (struct decode_job* job = executor->buckets[b], *next; job; job = next)
+		{
+			next = job->next_in_bucket;
+			if(job->result.data.deleter)
+				job->result.data.deleter(&job->result.data);
+			free(job->input_path);
+			free(job);
+		}
 	}
+	for (int t = 0; t < executor->num_threads; t++)
+		pthread_mutex_destroy(&executor->deques[t].mutex);
+	if(executor->event_fd >= 0)
+		close(executor->event_fd);
+	pthread_mutex_destroy(&executor->mutex);
+	pthread_cond_destroy(&executor->cond);
+	pthread_mutex_destroy(&executor->jobs_mutex);
+	pthread_cond_destroy(&executor->completed_cond);
+	free(executor->deques);
+	free(executor->threads);
+	free(executor);
+}
+
+int64_t decode_audio_executor_submit(struct DecodeAudioExecutor* executor, const char* input_path, const struct DecodeAudio* input_options, const struct DecodeAudio* output_options, const char* filter_string, void (*callback)(void* opaque, int64_t job_id), void* opaque)
+{
+	// options are copied, an input buffer must stay alive until the job completes; returns the job id or -1
+	if(filter_string != NULL && strlen(filter_string) > 512)
+		return -1;
+	struct decode_job* job = calloc(1, sizeof(struct decode_job));
+	if(!job)
+		return -1;
+	job->input_path = input_path ? strdup(input_path) : NULL;
+	if(input_options)
+		job->input_options = *input_options;
+	if(output_options)
+		job->output_options = *output_options;
+	strcpy(job->filter_string, filter_string != NULL ? filter_string : "");
+	job->callback = callback;
+	job->opaque = opaque;
+
+	pthread_mutex_lock(&executor->jobs_mutex);
+	job->id = executor->next_id++;
+	struct decode_job** bucket = &executor->buckets[job->id % EXECUTOR_NUM_BUCKETS];
+	job->next_in_bucket = *bucket;
+	*bucket = job;
+	pthread_mutex_unlock(&executor->jobs_mutex);
+	int64_t id = job->id;
+
+	struct job_deque* deque = &executor->deques[__atomic_fetch_add(&executor->next_deque, 1, __ATOMIC_RELAXED) % executor->num_threads];
+	pthread_mutex_lock(&deque->mutex);
+	if(deque->tail)
+		deque->tail->next_queued = job;
+	else
+		deque->head = job;
+	deque->tail = job;
+	pthread_mutex_unlock(&deque->mutex);
+
+	pthread_mutex_lock(&executor->mutex);
+	executor->num_queued++;
+	pthread_cond_signal(&executor->cond);
+	pthread_mutex_unlock(&executor->mutex);
+	return id;
+}
+
+int decode_audio_executor_fd(struct DecodeAudioExecutor* executor)
+{
+	// readable while completions are waiting for decode_audio_executor_poll, for select / epoll / asyncio loops
+	return executor->event_fd;
+}
+
+static struct decode_job* unlink_completed(struct DecodeAudioExecutor* executor, struct decode_job* job)
+{
+	if(job->prev_completed)
+		job->prev_completed->next_completed = job->next_completed;
+	else
+		executor->completed_head = job->next_completed;
+	if(job->next_completed)
+		job->next_completed->prev_completed = job->prev_completed;
 	else
+		executor->completed_tail = job->prev_completed;
+	job->prev_completed = job->next_completed = NULL;
+	return job;
+}
+
+int decode_audio_executor_poll(struct DecodeAudioExecutor* executor, int64_t* job_ids, int max_jobs, int timeout_ms)
+{
+	// returns up to max_jobs ids of finished jobs, waiting up to timeout_ms (negative waits indefinitely) for the first one;
+	// -1 with errno set when the eventfd cannot be cleared, the completed jobs then stay queued for the next poll
+	pthread_mutex_lock(&executor->jobs_mutex);
+	if(!executor->completed_head && timeout_ms != 0)
 	{
-		audio.data.deleter = deleter;
-		data_len = audio.num_samples * audio.num_channels * audio.itemsize;
-		audio.data.dl_tensor.data = calloc(data_len, 1);
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += timeout_ms / 1000;
+		deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+		if(deadline.tv_nsec >= 1000000000)
+		{
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		while (!executor->completed_head)
+			if((timeout_ms < 0 ? pthread_cond_wait(&executor->completed_cond, &executor->jobs_mutex) : pthread_cond_timedwait(&executor->completed_cond, &executor->jobs_mutex, &deadline)) != 0)
+				break;
 	}
 
-	uint8_t* data_ptr = audio.data.dl_tensor.data;
-	pkt = av_packet_alloc();
-	while (av_read_frame(fmt_ctx, pkt) >= 0)
+	int num_jobs = 0;
+	for (struct decode_job* job = executor->completed_head; job && num_jobs <= max_jobs; job = job->next_completed)
+		num_jobs++;
+	if(num_jobs <= max_jobs && executor->event_fd >= 0)
 	{
-		//if (pkt->stream_index == stream_index && decode_packet(dec_ctx, buffersrc_ctx, buffersink_ctx, pkt, &data_ptr, &data_len, audio.itemsize) < 0)
-		//	break;
-		//av_packet_unref(pkt);
+		// the eventfd counter is cleared together with the queue, a completion after this makes it readable again
+		uint64_t count;
+		int ret;
+		while ((ret = read(executor->event_fd, &count, sizeof(count))) < 0 && errno == EINTR);
+		if(ret < 0 && errno != EAGAIN)
+		{
+			pthread_mutex_unlock(&executor->jobs_mutex);
+			return -1;
+		}
 	}
-	return audio;
-
-	pkt->data = NULL;
-	pkt->size = 0;
-	//decode_packet(dec_ctx, buffersrc_ctx, buffersink_ctx, pkt, &data_ptr, &data_len, audio.itemsize);
+	num_jobs = 0;
+	for (; num_jobs < max_jobs && executor->completed_head; num_jobs++)
+		job_ids[num_jobs] = unlink_completed(executor, executor->completed_head)->id;
+	pthread_mutex_unlock(&executor->jobs_mutex);
+	return num_jobs;
+}
 
-end:
-	if(graph)
-		avfilter_graph_free(&graph);
-	if(dec_ctx)
-		avcodec_free_context(&dec_ctx);
-	if(fmt_ctx)
-		avformat_close_input(&fmt_ctx);
-	if(pkt)
-		av_packet_free(&pkt);
-	if(gis)
-		avfilter_inout_free(&gis);
-	if(gos)
-		avfilter_inout_free(&gos);
-    if(io_ctx)
-		av_free(io_ctx);
-	
-	//fprintf(stderr, "Error occurred: %s\n", av_err2str(ret));
-	return audio;
+int decode_audio_executor_result(struct DecodeAudioExecutor* executor, int64_t job_id, struct DecodeAudio* audio)
+{
+	// hands the result of a finished job over to the caller (who then owns its tensor) and forgets the job; -1 for unknown or unfinished jobs
+	int ret = -1;
+	pthread_mutex_lock(&executor->jobs_mutex);
+	for (struct decode_job** link = &executor->buckets[job_id % EXECUTOR_NUM_BUCKETS]; *link; link = &(*link)->next_in_bucket)
+	{
+		struct decode_job* job = *link;
+		if(job->id != job_id)
+			continue;
+		if(job->finished)
+		{
+			// results taken without polling (e.g. from the callback) leave the completion queue as well
+			if(job->prev_completed || executor->completed_head == job)
+				unlink_completed(executor, job);
+			*link = job->next_in_bucket;
+			*audio = job->result;
+			free(job->input_path);
+			free(job);
+			ret = 0;
+		}
+		break;
+	}
+	pthread_mutex_unlock(&executor->jobs_mutex);
+	return ret;
 }
 
+#ifndef DECODE_AUDIO_NO_MAIN
 int main(int argc, char **argv)
 {
 	if (argc <= 2)
@@ -504,3 +5805,4 @@ int main(int argc, char **argv)
 	//fwrite(audio.data.dl_tensor.data, audio.itemsize, audio.num_samples * audio.num_channels, fopen(argv[2], "wb"));
 	return 0;
 }
+#endif
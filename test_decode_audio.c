@@ -0,0 +1,628 @@
+// checks every SIMD kernel against its scalar counterpart bit for bit: interleave / deinterleave for 1-8 channels of every itemsize, the SSE2 sample
+// conversions and the normalize clamps, on random input with odd lengths so that the scalar tails run as well; the mixed-radix FFT against a naive
+// DFT and one log-mel frame against reference values; the tar / zip shard, seek index and probe index parsers on truncated and malformed files
+// make test
+
+#define DECODE_AUDIO_NO_MAIN
+#include "decode_audio_ffmpeg.c"
+
+static const int test_num_samples[] = { 0, 1, 3, 7, 8, 17, 63, 64, 1001 };
+
+static void fill_random(uint8_t* buf, size_t size)
+{
+	for (size_t i = 0; i < size; i++)
+		buf[i] = rand() & 0xFF;
+}
+
+static int test_interleave()
+{
+	int failures = 0, max_samples = test_num_samples[FF_ARRAY_ELEMS(test_num_samples) - 1];
+	for (int itemsize = 1; itemsize <= 8; itemsize *= 2)
+	{
+		for (int num_channels = 1; num_channels <= 8; num_channels++)
+		{
+			for (int k = 0; k < FF_ARRAY_ELEMS(test_num_samples); k++)
+			{
+				int num_samples = test_num_samples[k];
+				size_t plane_size = (size_t)max_samples * itemsize, packed_size = plane_size * num_channels;
+				uint8_t* planes[num_channels];
+				uint8_t* expected_planes[num_channels];
+				uint8_t* packed = malloc(packed_size), *expected_packed = malloc(packed_size);
+				for (int c = 0; c < num_channels; c++)
+				{
+					planes[c] = malloc(plane_size);
+					expected_planes[c] = malloc(plane_size);
+					fill_random(planes[c], plane_size);
+				}
+
+				// both directions write into buffers that hold the same bytes beforehand, so stray stores show up as well
+				fill_random(packed, packed_size);
+				memcpy(expected_packed, packed, packed_size);
+				interleave(packed, planes, num_channels, num_samples, itemsize);
+				interleave_scalar(expected_packed, planes, num_channels, 0, num_samples, itemsize);
+				if(memcmp(packed, expected_packed, packed_size) != 0)
+				{
+					printf("interleave: itemsize %d, %d channels, %d samples differ from the scalar kernel\n", itemsize, num_channels, num_samples);
+					failures++;
+				}
+
+				for (int c = 0; c < num_channels; c++)
+				{
+					fill_random(planes[c], plane_size);
+					memcpy(expected_planes[c], planes[c], plane_size);
+				}
+				deinterleave(planes, packed, num_channels, num_samples, itemsize);
+				deinterleave_scalar(expected_planes, packed, num_channels, 0, num_samples, itemsize);
+				for (int c = 0; c < num_channels; c++)
+				{
+					if(memcmp(planes[c], expected_planes[c], plane_size) != 0)
+					{
+						printf("deinterleave: itemsize %d, %d channels, %d samples differ from the scalar kernel\n", itemsize, num_channels, num_samples);
+						failures++;
+						break;
+					}
+				}
+
+				for (int c = 0; c < num_channels; c++)
+				{
+					free(planes[c]);
+					free(expected_planes[c]);
+				}
+				free(packed);
+				free(expected_packed);
+			}
+		}
+	}
+	return failures;
+}
+
+static void fill_random_float(uint8_t* buf, int count)
+{
+	// mostly in range, some clipping, exact full scale and rounding ties
+	static const float edges[] = { 0.0f, -0.0f, 1.0f, -1.0f, 0.99999994f, -1.0000001f, 0.5f / (1 << 15), 1.5f / (1 << 15), -0.5f / (1 << 15), 1e10f, -1e10f };
+	float* x = (float*)buf;
+	for (int i = 0; i < count; i++)
+		x[i] = rand() % 16 == 0 ? edges[rand() % FF_ARRAY_ELEMS(edges)] : (float)rand() / RAND_MAX * 4.0f - 2.0f;
+}
+
+static int test_convert()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	struct {const char* name; void (*simd)(uint8_t*, const uint8_t*, int); void (*scalar)(uint8_t*, const uint8_t*, int); int in_size, out_size; bool float_in;} kernels[] =
+	{
+		{ "u8_flt",  convert_u8_flt_sse2,  convert_u8_flt,  1, 4, false },
+		{ "s16_flt", convert_s16_flt_sse2, convert_s16_flt, 2, 4, false },
+		{ "s32_flt", convert_s32_flt_sse2, convert_s32_flt, 4, 4, false },
+		{ "flt_s16", convert_flt_s16_sse2, convert_flt_s16, 4, 2, true  },
+		{ "flt_s32", convert_flt_s32_sse2, convert_flt_s32, 4, 4, true  },
+	};
+	int failures = 0;
+	for (int j = 0; j < FF_ARRAY_ELEMS(kernels); j++)
+	{
+		for (int k = 0; k < FF_ARRAY_ELEMS(test_num_samples); k++)
+		{
+			// the count is over all channels, 1-8 channels of odd lengths give every remainder of the SIMD width
+			for (int num_channels = 1; num_channels <= 8; num_channels++)
+			{
+				int count = test_num_samples[k] * num_channels;
+				uint8_t* src = malloc(FFMAX(1, count * kernels[j].in_size)), *out = malloc(FFMAX(1, count * kernels[j].out_size)), *expected = malloc(FFMAX(1, count * kernels[j].out_size));
+				if(kernels[j].float_in)
+					fill_random_float(src, count);
+				else
+					fill_random(src, count * kernels[j].in_size);
+				kernels[j].simd(out, src, count);
+				kernels[j].scalar(expected, src, count);
+				if(memcmp(out, expected, count * kernels[j].out_size) != 0)
+				{
+					printf("convert_%s: %d samples differ from the scalar kernel\n", kernels[j].name, count);
+					failures++;
+				}
+				free(src);
+				free(out);
+				free(expected);
+			}
+		}
+	}
+	return failures;
+#else
+	return 0;
+#endif
+}
+
+static int test_clamp()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	int failures = 0;
+	for (int k = 0; k < FF_ARRAY_ELEMS(test_num_samples); k++)
+	{
+		int count = test_num_samples[k] * 2;
+		float* flt = malloc(FFMAX(1, count * sizeof(float))), *expected_flt = malloc(FFMAX(1, count * sizeof(float))), *src = malloc(FFMAX(1, count * sizeof(float)));
+		double* dbl = malloc(FFMAX(1, count * sizeof(double))), *expected_dbl = malloc(FFMAX(1, count * sizeof(double)));
+		fill_random_float((uint8_t*)src, count);
+		for (int i = 0; i < count; i++)
+			dbl[i] = expected_dbl[i] = flt[i] = expected_flt[i] = src[i];
+		clamp_flt_sse2((uint8_t*)flt, count);
+		clamp_flt((uint8_t*)expected_flt, count);
+		clamp_dbl_sse2((uint8_t*)dbl, count);
+		clamp_dbl((uint8_t*)expected_dbl, count);
+		if(memcmp(flt, expected_flt, count * sizeof(float)) != 0 || memcmp(dbl, expected_dbl, count * sizeof(double)) != 0)
+		{
+			printf("clamp: %d samples differ from the scalar kernel\n", count);
+			failures++;
+		}
+		for (int i = 0; i < count; i++)
+		{
+			// in-range samples pass unchanged (signed zeros included), the rest lands on the bound
+			float x = src[i] < -1 ? -1 : src[i] > 1 ? 1 : src[i];
+			if(memcmp(&flt[i], &x, sizeof(float)) != 0 || dbl[i] != x)
+			{
+				printf("clamp: %g became %g / %g\n", src[i], flt[i], dbl[i]);
+				failures++;
+				break;
+			}
+		}
+		free(flt);
+		free(expected_flt);
+		free(src);
+		free(dbl);
+		free(expected_dbl);
+	}
+	return failures;
+#else
+	return 0;
+#endif
+}
+
+static int test_fft()
+{
+	// the mixed-radix FFT against a naive DFT in double: the complex halves of n_fft 400 (4 * 2 * 5 * 5), 512 (4^4 * 2) and 882 (3^2 * 7^2, odd
+	// factors only), then the real power spectrum that log_mel_frame builds from them with the split step
+	static const int n_ffts[] = { 400, 512, 882 };
+	int failures = 0;
+	for (int j = 0; j < FF_ARRAY_ELEMS(n_ffts); j++)
+	{
+		int n_fft = n_ffts[j], half = n_fft / 2;
+		struct fft_plan plan;
+		fft_plan_init(&plan, half);
+		struct cpx* in = malloc(half * sizeof(struct cpx)), *out = malloc(half * sizeof(struct cpx));
+		for (int i = 0; i < half; i++)
+			in[i] = (struct cpx){ (float)rand() / RAND_MAX * 2 - 1, (float)rand() / RAND_MAX * 2 - 1 };
+		fft_work(out, in, 1, plan.factors, &plan);
+		double err = 0, norm = 0;
+		for (int k = 0; k < half; k++)
+		{
+			double re = 0, im = 0;
+			for (int i = 0; i < half; i++)
+			{
+				double phase = -2 * M_PI * (double)((int64_t)i * k % half) / half;
+				re += in[i].re * cos(phase) - in[i].im * sin(phase);
+				im += in[i].re * sin(phase) + in[i].im * cos(phase);
+			}
+			err += (out[k].re - re) * (out[k].re - re) + (out[k].im - im) * (out[k].im - im);
+			norm += re * re + im * im;
+		}
+		if(!(sqrt(err / norm) < 1e-5))
+		{
+			printf("fft: size %d is off the naive DFT by %g relative\n", half, sqrt(err / norm));
+			failures++;
+		}
+		free(in);
+		free(out);
+		fft_plan_free(&plan);
+
+		// one interior frame: hop = n_fft / 2 puts frame 2 on samples [n_fft / 2, 3 * n_fft / 2), clear of the reflection
+		struct DecodeAudio options = {0};
+		options.n_mels = 1;
+		options.n_fft = n_fft;
+		options.hop_length = half;
+		struct log_mel mel;
+		char error[128];
+		if(log_mel_init(&mel, &options, 16000, error) < 0)
+		{
+			printf("fft: log_mel_init failed for n_fft %d: %s\n", n_fft, error);
+			failures++;
+			continue;
+		}
+		mel.signal_len = 2 * n_fft;
+		mel.signal = malloc(mel.signal_len * sizeof(float));
+		for (int i = 0; i < mel.signal_len; i++)
+			mel.signal[i] = (float)rand() / RAND_MAX * 2 - 1;
+		mel.num_frames = 2;
+		float feature;
+		log_mel_frame(&mel, mel.signal_len, &feature);
+		double max_power = 0, max_err = 0;
+		for (int k = 0; k <= half; k++)
+		{
+			double re = 0, im = 0;
+			for (int i = 0; i < n_fft; i++)
+			{
+				double x = mel.signal[half + i] * mel.window[i], phase = -2 * M_PI * (double)((int64_t)i * k % n_fft) / n_fft;
+				re += x * cos(phase);
+				im += x * sin(phase);
+			}
+			max_power = FFMAX(max_power, re * re + im * im);
+			max_err = FFMAX(max_err, fabs(mel.power[k] - (re * re + im * im)));
+		}
+		if(!(max_err < 1e-5 * max_power))
+		{
+			printf("fft: power spectrum of n_fft %d is off the naive DFT by %g of the peak\n", n_fft, max_err / max_power);
+			failures++;
+		}
+		log_mel_free(&mel);
+	}
+	return failures;
+}
+
+static int test_log_mel()
+{
+	// frame 3 of 440 Hz + 3 kHz tones over a 37 sample sawtooth at 16 kHz, n_fft 400, hop 160, 8 mels; the reference values come from numpy:
+	// periodic Hann, |rfft|^2 and torchaudio.functional.melscale_fbanks (htk, and slaney with slaney norm), log(mel + 1e-6)
+	static const float expected[2][8] =
+	{
+		{ 6.93274f, 7.85214f, 2.76962f, 2.04151f, 4.10601f, 6.74160f, 0.99867f, 0.87151f },
+		{ 1.99689f, 1.21708f, -3.47883f, -4.25675f, -4.95578f, -0.25185f, -2.40069f, -6.61371f },
+	};
+	int failures = 0;
+	for (int slaney = 0; slaney <= 1; slaney++)
+	{
+		struct DecodeAudio options = {0};
+		options.n_mels = 8;
+		options.n_fft = 400;
+		options.hop_length = 160;
+		options.mel_slaney = slaney;
+		struct log_mel mel;
+		char error[128];
+		if(log_mel_init(&mel, &options, 16000, error) < 0)
+		{
+			printf("log_mel: log_mel_init failed: %s\n", error);
+			failures++;
+			continue;
+		}
+		mel.signal_len = 1600;
+		mel.signal = malloc(mel.signal_len * sizeof(float));
+		for (int t = 0; t < mel.signal_len; t++)
+			mel.signal[t] = 0.5 * sin(2 * M_PI * 440 * t / 16000) + 0.25 * sin(2 * M_PI * 3000 * t / 16000 + 0.3) + 0.1 * ((t % 37) / 18.0 - 1);
+		mel.num_frames = 3;
+		float features[8];
+		log_mel_frame(&mel, mel.signal_len, features);
+		for (int b = 0; b < 8; b++)
+		{
+			if(!(fabsf(features[b] - expected[slaney][b]) < 1e-3f))
+			{
+				printf("log_mel: %s band %d is %g instead of %g\n", slaney ? "slaney" : "htk", b, features[b], expected[slaney][b]);
+				failures++;
+			}
+		}
+		log_mel_free(&mel);
+	}
+	return failures;
+}
+
+// the parsers of untrusted files below write their inputs into a temporary directory: well-formed files first, then truncated and malformed ones
+// that must be rejected (or their bad record skipped) without reading outside the file
+static char test_dir[64];
+
+static void write_test_file(const char* name, const void* data, size_t size, char* path)
+{
+	sprintf(path, "%s/%s", test_dir, name);
+	FILE* f = fopen(path, "wb");
+	fwrite(data, 1, size, f);
+	fclose(f);
+}
+
+static int check_shard(const char* what, const uint8_t* data, size_t size, const char* expected_error, const char* expected_name, uint64_t expected_offset, uint64_t expected_size)
+{
+	// a valid shard holds exactly one member
+	char path[128], error[128] = "";
+	write_test_file("shard", data, size, path);
+	struct DecodeAudioShard* shard = decode_audio_shard_open(path, error);
+	int failures = 0;
+	if(expected_error != NULL)
+	{
+		if(shard != NULL || strcmp(error, expected_error) != 0)
+		{
+			printf("shard: %s %s \"%s\" instead of \"%s\"\n", what, shard ? "opened, error" : "failed with", error, expected_error);
+			failures++;
+		}
+	}
+	else if(shard == NULL)
+	{
+		printf("shard: %s failed with \"%s\"\n", what, error);
+		failures++;
+	}
+	else
+	{
+		uint64_t offset = 0, member_size = 0;
+		const char* name = decode_audio_shard_member(shard, 0, &offset, &member_size);
+		if(decode_audio_shard_num_members(shard) != 1 || strcmp(name, expected_name) != 0 || offset != expected_offset || member_size != expected_size
+			|| decode_audio_shard_find(shard, expected_name) != 0)
+		{
+			printf("shard: %s indexed %d members, first \"%s\" at %llu size %llu\n", what, decode_audio_shard_num_members(shard), name, (unsigned long long)offset, (unsigned long long)member_size);
+			failures++;
+		}
+	}
+	decode_audio_shard_close(shard);
+	unlink(path);
+	return failures;
+}
+
+static void tar_checksum(uint8_t* header)
+{
+	memset(header + 148, ' ', 8);
+	unsigned checksum = 0;
+	for (int i = 0; i < 512; i++)
+		checksum += header[i];
+	sprintf((char*)header + 148, "%06o", checksum);
+}
+
+static void tar_header(uint8_t* header, const char* name, uint64_t size, char type)
+{
+	memset(header, 0, 512);
+	strcpy((char*)header, name);
+	memcpy(header + 100, "0000644", 7);
+	sprintf((char*)header + 124, "%011llo", (unsigned long long)size);
+	header[156] = type;
+	memcpy(header + 257, "ustar\0" "00", 8);
+	tar_checksum(header);
+}
+
+static int test_tar()
+{
+	// a pax record naming a.wav, whose 3 bytes are at 1536, then two zero blocks
+	static const char pax_record[] = "26 path=dir/long_name.wav\n";
+	uint8_t tar[3072];
+	int failures = 0;
+	memset(tar, 0, sizeof(tar));
+	tar_header(tar, "PaxHeaders/a.wav", strlen(pax_record), 'x');
+	memcpy(tar + 512, pax_record, strlen(pax_record));
+	tar_header(tar + 1024, "a.wav", 3, '0');
+	memcpy(tar + 1536, "abc", 3);
+	failures += check_shard("tar with a pax path", tar, sizeof(tar), NULL, "dir/long_name.wav", 1536, 3);
+
+	// a record length past the pax data, or one too short to hold its key, is ignored with the rest of the records
+	memcpy(tar + 512, "99", 2);
+	failures += check_shard("tar with a pax length past the record", tar, sizeof(tar), NULL, "a.wav", 1536, 3);
+	memcpy(tar + 512, "07", 2);
+	failures += check_shard("tar with a short pax length", tar, sizeof(tar), NULL, "a.wav", 1536, 3);
+	memcpy(tar + 512, "26", 2);
+
+	// a header cut off after the first member ends the archive
+	uint8_t cut[2048 + 512];
+	memcpy(cut, tar, 2048);
+	tar_header(cut + 2048, "b.wav", 3, '0');
+	failures += check_shard("tar with a truncated header", cut, 2048 + 100, NULL, "dir/long_name.wav", 1536, 3);
+
+	failures += check_shard("tar with a truncated member", tar, 1538, "Truncated tar member", NULL, 0, 0);
+	tar_header(tar, "PaxHeaders/a.wav", 1 << 20, 'x');
+	failures += check_shard("tar with a pax size past the end", tar, sizeof(tar), "Truncated tar member", NULL, 0, 0);
+	tar_header(tar, "PaxHeaders/a.wav", strlen(pax_record), 'x');
+
+	// base-256 sizes as large as the field holds
+	tar[1024 + 124] = 0x80;
+	memset(tar + 1024 + 125, 0xff, 11);
+	tar_checksum(tar + 1024);
+	failures += check_shard("tar with a base-256 size past the end", tar, sizeof(tar), "Truncated tar member", NULL, 0, 0);
+	tar_header(tar + 1024, "a.wav", 3, '0');
+
+	tar[1024 + 1] ^= 1;
+	failures += check_shard("tar with a bad checksum", tar, sizeof(tar), "Corrupt tar header", NULL, 0, 0);
+	return failures;
+}
+
+static int test_zip()
+{
+	// local header and the 4 bytes of a.wav at 0, the central directory entry at 39, the end of central directory record at 90
+	uint8_t zip[112];
+	int failures = 0;
+	memset(zip, 0, sizeof(zip));
+	AV_WL32(zip, 0x04034b50);
+	AV_WL16(zip + 26, 5);
+	memcpy(zip + 30, "a.wav", 5);
+	memcpy(zip + 35, "wxyz", 4);
+	AV_WL32(zip + 39, 0x02014b50);
+	AV_WL32(zip + 39 + 20, 4);
+	AV_WL32(zip + 39 + 24, 4);
+	AV_WL16(zip + 39 + 28, 5);
+	memcpy(zip + 39 + 46, "a.wav", 5);
+	AV_WL32(zip + 90, 0x06054b50);
+	AV_WL16(zip + 90 + 8, 1);
+	AV_WL16(zip + 90 + 10, 1);
+	AV_WL32(zip + 90 + 12, 51);
+	AV_WL32(zip + 90 + 16, 39);
+	failures += check_shard("zip", zip, sizeof(zip), NULL, "a.wav", 35, 4);
+
+	AV_WL32(zip + 39 + 42, 1000);
+	failures += check_shard("zip with a local header offset past the end", zip, sizeof(zip), "Corrupt zip local header", NULL, 0, 0);
+	AV_WL32(zip + 39 + 42, 100);
+	failures += check_shard("zip with a local header offset into the end record", zip, sizeof(zip), "Corrupt zip local header", NULL, 0, 0);
+	AV_WL32(zip + 39 + 42, 0);
+
+	AV_WL16(zip + 26, 200);
+	failures += check_shard("zip with a local name past the end", zip, sizeof(zip), "Truncated zip member", NULL, 0, 0);
+	AV_WL16(zip + 26, 5);
+	AV_WL32(zip + 39 + 20, 0xfffffff0);
+	failures += check_shard("zip with a member size past the end", zip, sizeof(zip), "Truncated zip member", NULL, 0, 0);
+	AV_WL32(zip + 39 + 20, 4);
+
+	AV_WL16(zip + 39 + 28, 0xffff);
+	failures += check_shard("zip with an entry name past the end", zip, sizeof(zip), "Corrupt zip central directory", NULL, 0, 0);
+	AV_WL16(zip + 39 + 28, 5);
+	AV_WL32(zip + 90 + 16, 100);
+	failures += check_shard("zip with a central directory offset past the end", zip, sizeof(zip), "Corrupt zip central directory", NULL, 0, 0);
+	AV_WL32(zip + 90 + 16, 39);
+	AV_WL16(zip + 90 + 10, 2);
+	failures += check_shard("zip with more entries than the central directory", zip, sizeof(zip), "Corrupt zip central directory", NULL, 0, 0);
+	AV_WL16(zip + 90 + 10, 1);
+
+	failures += check_shard("zip without an end record", zip, 90 + 21, "Cannot find zip central directory", NULL, 0, 0);
+	failures += check_shard("zip of a local header only", zip, 10, "Cannot find zip central directory", NULL, 0, 0);
+	return failures;
+}
+
+static int test_seek_index()
+{
+	char input_path[128], path[128];
+	struct stat st;
+	write_test_file("input.mp3", "not decoded", 11, input_path);
+	stat(input_path, &st);
+	seek_index_path(input_path, path, sizeof(path));
+
+	struct {struct seek_index_header header; struct seek_index_entry entries[3]; char extra[5];} sidecar;
+	memset(&sidecar, 0, sizeof(sidecar));
+	memcpy(sidecar.header.magic, seek_index_magic, sizeof(seek_index_magic));
+	sidecar.header.size = st.st_size;
+	sidecar.header.mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+	sidecar.header.stream_index = 0;
+	sidecar.header.sample_rate = 44100;
+	sidecar.header.num_samples = 44100;
+	sidecar.header.num_entries = 3;
+	for (int i = 0; i < 3; i++)
+		sidecar.entries[i] = (struct seek_index_entry){ 100 * i, 4410 * i };
+
+	// the sidecar size must be the header and exactly num_entries entries
+	struct {const char* what; size_t size; uint64_t num_entries; int stream_index; bool valid;} cases[] =
+	{
+		{ "valid",                       sizeof(struct seek_index_header) + 3 * sizeof(struct seek_index_entry),     3, 0, true  },
+		{ "trailing bytes",              sizeof(struct seek_index_header) + 3 * sizeof(struct seek_index_entry) + 5, 3, 0, false },
+		{ "a truncated entry",           sizeof(struct seek_index_header) + 3 * sizeof(struct seek_index_entry) - 1, 3, 0, false },
+		{ "more entries than the file",  sizeof(struct seek_index_header) + 3 * sizeof(struct seek_index_entry),     4, 0, false },
+		{ "an entry count that wraps",   sizeof(struct seek_index_header) + 3 * sizeof(struct seek_index_entry),     3 + (1ULL << 60), 0, false },
+		{ "no entries",                  sizeof(struct seek_index_header),                                            0, 0, false },
+		{ "a truncated header",          sizeof(struct seek_index_header) - 1,                                        3, 0, false },
+		{ "another stream",              sizeof(struct seek_index_header) + 3 * sizeof(struct seek_index_entry),     3, 1, false },
+	};
+	int failures = 0;
+	for (int j = 0; j < FF_ARRAY_ELEMS(cases); j++)
+	{
+		sidecar.header.num_entries = cases[j].num_entries;
+		write_test_file("input.mp3.seekidx", &sidecar, cases[j].size, path);
+		struct seek_index index;
+		bool valid = open_seek_index(input_path, cases[j].stream_index, 44100, &index);
+		if(valid != cases[j].valid || (valid && find_seek_index_entry(&index, 5000)->pos != 100))
+		{
+			printf("seek_index: sidecar with %s was %s\n", cases[j].what, valid ? "accepted" : "rejected");
+			failures++;
+		}
+		close_seek_index(&index);
+	}
+
+	// the sidecar of an input that changed since it was written is not used
+	sidecar.header.num_entries = 3;
+	sidecar.header.size++;
+	write_test_file("input.mp3.seekidx", &sidecar, cases[0].size, path);
+	struct seek_index index;
+	if(open_seek_index(input_path, 0, 44100, &index))
+	{
+		printf("seek_index: sidecar of another input size was accepted\n");
+		failures++;
+	}
+	close_seek_index(&index);
+	unlink(path);
+	unlink(input_path);
+	return failures;
+}
+
+static int test_probe_index()
+{
+	// two entries sorted by path hash, then their paths; the second path is last in the file
+	static const char* names[2] = { "dir/a.wav", "dir/b.wav" };
+	struct {struct probe_index_header header; struct probe_index_entry entries[2]; char paths[20];} file;
+	memset(&file, 0, sizeof(file));
+	memcpy(file.header.magic, probe_index_magic, sizeof(probe_index_magic));
+	file.header.num_entries = 2;
+	file.header.paths_size = 20;
+	int first = hash_path(names[0]) < hash_path(names[1]) ? 0 : 1;
+	for (int k = 0; k < 2; k++)
+	{
+		int i = k == 0 ? first : 1 - first;
+		file.entries[k].path_hash = hash_path(names[i]);
+		file.entries[k].path_offset = 10 * k;
+		file.entries[k].sample_rate = 8000 * (i + 1);
+		strcpy(file.paths + 10 * k, names[i]);
+	}
+	size_t full_size = sizeof(struct probe_index_header) + 2 * sizeof(struct probe_index_entry) + 20;
+
+	char path[128];
+	struct probe_index index;
+	int failures = 0;
+	write_test_file("probe.idx", &file, full_size, path);
+	struct probe_index_entry* a = open_probe_index(path, &index) ? find_probe_index_entry(&index, names[0]) : NULL, * b = a ? find_probe_index_entry(&index, names[1]) : NULL;
+	if(!a || !b || a->sample_rate != 8000 || b->sample_rate != 16000 || find_probe_index_entry(&index, "dir/c.wav") || find_probe_index_entry(&index, "dir/a.wa"))
+	{
+		printf("probe_index: valid index not read back\n");
+		failures++;
+	}
+	if(index.mapping.addr)
+		munmap(index.mapping.addr, index.mapping.length);
+
+	// the index size must be the header, num_entries entries and paths_size bytes of paths
+	struct {const char* what; size_t size; uint64_t num_entries, paths_size;} cases[] =
+	{
+		{ "a truncated path",           full_size - 1,                    2, 20 },
+		{ "trailing bytes",             full_size + 1,                    2, 20 },
+		{ "more entries than the file", full_size,                        3, 20 },
+		{ "an entry count that wraps",  full_size,                        2 + (1ULL << 58), 20 },
+		{ "a paths size past the file", full_size,                        2, UINT64_MAX },
+		{ "a truncated header",         sizeof(struct probe_index_header) - 1, 0, 0 },
+	};
+	uint8_t padded[sizeof(file) + 1];
+	memset(padded, 0, sizeof(padded));
+	for (int j = 0; j < FF_ARRAY_ELEMS(cases); j++)
+	{
+		file.header.num_entries = cases[j].num_entries;
+		file.header.paths_size = cases[j].paths_size;
+		memcpy(padded, &file, sizeof(file));
+		write_test_file("probe.idx", padded, cases[j].size, path);
+		if(open_probe_index(path, &index))
+		{
+			printf("probe_index: index with %s was accepted\n", cases[j].what);
+			failures++;
+			munmap(index.mapping.addr, index.mapping.length);
+		}
+	}
+
+	// entries pointing past the paths, or to a last path without its NUL, match nothing
+	file.header.num_entries = 2;
+	file.header.paths_size = 19;
+	int last = 1 - first;
+	file.entries[1].path_offset = 10;
+	strcpy(file.paths + 10, "dir/b.wa");
+	file.paths[18] = 'v';
+	file.entries[1].path_hash = hash_path("dir/b.wavx");
+	write_test_file("probe.idx", &file, full_size - 1, path);
+	if(!open_probe_index(path, &index) || find_probe_index_entry(&index, "dir/b.wavx") || find_probe_index_entry(&index, names[last]))
+	{
+		printf("probe_index: unterminated path matched a longer one\n");
+		failures++;
+	}
+	if(index.mapping.addr)
+		munmap(index.mapping.addr, index.mapping.length);
+	file.header.paths_size = 20;
+	file.entries[1].path_offset = 1000;
+	write_test_file("probe.idx", &file, full_size, path);
+	if(!open_probe_index(path, &index) || find_probe_index_entry(&index, "dir/b.wavx"))
+	{
+		printf("probe_index: path offset past the paths matched\n");
+		failures++;
+	}
+	if(index.mapping.addr)
+		munmap(index.mapping.addr, index.mapping.length);
+	unlink(path);
+	return failures;
+}
+
+int main(int argc, char **argv)
+{
+	srand(argc > 1 ? atoi(argv[1]) : 1);
+	int failures = test_interleave() + test_convert() + test_clamp() + test_fft() + test_log_mel();
+	strcpy(test_dir, "/tmp/decode_audio_test.XXXXXX");
+	if(mkdtemp(test_dir) == NULL)
+	{
+		printf("Cannot create %s\n", test_dir);
+		return 1;
+	}
+	failures += test_tar() + test_zip() + test_seek_index() + test_probe_index();
+	rmdir(test_dir);
+	printf("%s: %d failures\n", failures ? "FAILED" : "OK", failures);
+	return failures ? 1 : 0;
+}